@@ -3,6 +3,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <limits.h>
+#include <float.h>
+#include <string.h>
+#include <sys/stat.h>
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+#include <direct.h>
+#endif
 
 #if defined(__APPLE__)
 #include <GLUT/GLUT.h>
@@ -18,9 +25,21 @@
 
 #include <string>
 #include <vector>
+#include <map>
 #include <fstream>
 #include <algorithm>
 #include <iostream>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <utility>
+#include <type_traits>
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE__)
+#include <xmmintrin.h>
+#endif
 #include <windows.h>
 #include <mmsystem.h>
 const unsigned int windowWidth = 512, windowHeight = 512;
@@ -29,6 +48,165 @@ int majorVersion = 3, minorVersion = 0;
 
 bool keyboardState[256];
 
+// GL objects are owned by move-only handles: the handle that created an object deletes it, moving
+// a handle hands the object over, and handles cannot be copied. live objects are counted by kind,
+// and in leak check mode the counts left at shutdown are printed
+bool glLeakCheck = false;
+
+enum GLObjectKind { GLBufferKind, GLVertexArrayKind, GLTextureKind, GLFramebufferKind, GLRenderbufferKind,
+	GLProgramKind, GLShaderKind, GLQueryKind, GLTransformFeedbackKind, GLSyncKind, GLObjectKinds };
+
+const char* glObjectKindNames[GLObjectKinds] = { "buffers", "vertex arrays", "textures", "framebuffers", "renderbuffers",
+	"programs", "shaders", "queries", "transform feedbacks", "syncs" };
+
+// GL objects are only made and deleted on the render thread
+int liveGLObjects[GLObjectKinds];
+
+void reportGLLeaks()
+{
+	if (!glLeakCheck) return;
+	int total = 0;
+	for (int i = 0; i < GLObjectKinds; i++) total += liveGLObjects[i];
+	printf("GL leak check: %d objects alive at shutdown\n", total);
+	for (int i = 0; i < GLObjectKinds; i++)
+		if (liveGLObjects[i]) printf("      %d %s\n", liveGLObjects[i], glObjectKindNames[i]);
+}
+
+struct GLBufferTraits
+{
+	typedef unsigned int Type;
+	static const GLObjectKind kind = GLBufferKind;
+	static Type Create() { Type id = 0; glGenBuffers(1, &id); return id; }
+	static void Delete(Type id) { glDeleteBuffers(1, &id); }
+};
+
+struct GLVertexArrayTraits
+{
+	typedef unsigned int Type;
+	static const GLObjectKind kind = GLVertexArrayKind;
+	static Type Create() { Type id = 0; glGenVertexArrays(1, &id); return id; }
+	static void Delete(Type id) { glDeleteVertexArrays(1, &id); }
+};
+
+struct GLTextureTraits
+{
+	typedef unsigned int Type;
+	static const GLObjectKind kind = GLTextureKind;
+	static Type Create() { Type id = 0; glGenTextures(1, &id); return id; }
+	static void Delete(Type id) { glDeleteTextures(1, &id); }
+};
+
+struct GLFramebufferTraits
+{
+	typedef unsigned int Type;
+	static const GLObjectKind kind = GLFramebufferKind;
+	static Type Create() { Type id = 0; glGenFramebuffers(1, &id); return id; }
+	static void Delete(Type id) { glDeleteFramebuffers(1, &id); }
+};
+
+struct GLRenderbufferTraits
+{
+	typedef unsigned int Type;
+	static const GLObjectKind kind = GLRenderbufferKind;
+	static Type Create() { Type id = 0; glGenRenderbuffers(1, &id); return id; }
+	static void Delete(Type id) { glDeleteRenderbuffers(1, &id); }
+};
+
+struct GLProgramTraits
+{
+	typedef unsigned int Type;
+	static const GLObjectKind kind = GLProgramKind;
+	static Type Create() { return glCreateProgram(); }
+	static void Delete(Type id) { glDeleteProgram(id); }
+};
+
+struct GLShaderTraits
+{
+	typedef unsigned int Type;
+	static const GLObjectKind kind = GLShaderKind;
+	static Type Create(unsigned int type) { return glCreateShader(type); }
+	static void Delete(Type id) { glDeleteShader(id); }
+};
+
+struct GLQueryTraits
+{
+	typedef unsigned int Type;
+	static const GLObjectKind kind = GLQueryKind;
+	static Type Create() { Type id = 0; glGenQueries(1, &id); return id; }
+	static void Delete(Type id) { glDeleteQueries(1, &id); }
+};
+
+struct GLTransformFeedbackTraits
+{
+	typedef unsigned int Type;
+	static const GLObjectKind kind = GLTransformFeedbackKind;
+	static Type Create() { Type id = 0; glGenTransformFeedbacks(1, &id); return id; }
+	static void Delete(Type id) { glDeleteTransformFeedbacks(1, &id); }
+};
+
+struct GLSyncTraits
+{
+	typedef GLsync Type;
+	static const GLObjectKind kind = GLSyncKind;
+	static Type Create() { return glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0); }
+	static void Delete(Type id) { glDeleteSync(id); }
+};
+
+// converts to the raw name, so it goes straight into GL calls; an empty handle is the name 0
+template <typename Traits>
+class GLHandle
+{
+	typedef typename Traits::Type Type;
+	Type id;
+
+public:
+	GLHandle() : id() { }
+	GLHandle(GLHandle&& other) : id(other.id) { other.id = Type(); }
+	GLHandle(const GLHandle&) = delete;
+	~GLHandle() { Reset(); }
+
+	GLHandle& operator=(GLHandle&& other)
+	{
+		if (this != &other) {
+			Reset();
+			id = other.id;
+			other.id = Type();
+		}
+		return *this;
+	}
+	GLHandle& operator=(const GLHandle&) = delete;
+
+	// deletes what the handle held before
+	template <typename... Args>
+	void Create(Args... args)
+	{
+		Reset();
+		id = Traits::Create(args...);
+		if (id) liveGLObjects[Traits::kind]++;
+	}
+
+	void Reset()
+	{
+		if (!id) return;
+		Traits::Delete(id);
+		liveGLObjects[Traits::kind]--;
+		id = Type();
+	}
+
+	operator Type() const { return id; }
+};
+
+typedef GLHandle<GLBufferTraits> GLBuffer;
+typedef GLHandle<GLVertexArrayTraits> GLVertexArray;
+typedef GLHandle<GLTextureTraits> GLTexture;
+typedef GLHandle<GLFramebufferTraits> GLFramebuffer;
+typedef GLHandle<GLRenderbufferTraits> GLRenderbuffer;
+typedef GLHandle<GLProgramTraits> GLProgram;
+typedef GLHandle<GLShaderTraits> GLShader;
+typedef GLHandle<GLQueryTraits> GLQuery;
+typedef GLHandle<GLTransformFeedbackTraits> GLTransformFeedback;
+typedef GLHandle<GLSyncTraits> GLSync;
+
 void getErrorInfo(unsigned int handle)
 {
 	int logLen;
@@ -39,7 +217,7 @@ void getErrorInfo(unsigned int handle)
 		int written;
 		glGetShaderInfoLog(handle, logLen, &written, log);
 		printf("Shader log:\n%s", log);
-		delete log;
+		delete[] log;
 	}
 }
 
@@ -65,6 +243,134 @@ void checkLinking(unsigned int program)
 	}
 }
 
+// program binaries, compressed textures and texture level files go here rather than next to the assets
+std::string cacheDirectory = "cache";
+
+// a file in cacheDirectory, which is created the first time anything is cached
+std::string cacheFileName(const std::string& name)
+{
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+	_mkdir(cacheDirectory.c_str());
+#else
+	mkdir(cacheDirectory.c_str(), 0755);
+#endif
+	return cacheDirectory + "/" + name;
+}
+
+// program binary cache: linked programs are stored as programcache_<key>.bin in cacheDirectory
+bool useProgramCache = true;
+int programsFromCache = 0, programsCompiled = 0;
+double programSubmitMs = 0;
+
+unsigned long long hashString(const char* str, unsigned long long hash = 14695981039346656037ULL)
+{
+	if (!str) return hash;
+	for (; *str; str++)
+	{
+		hash ^= (unsigned char)*str;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// a binary is only valid for the exact sources on the exact driver that produced it
+unsigned long long programCacheKey(const char* vertexSource, const char* fragmentSource)
+{
+	unsigned long long hash = hashString(vertexSource);
+	hash = hashString(fragmentSource, hash);
+	hash = hashString((const char*)glGetString(GL_VENDOR), hash);
+	hash = hashString((const char*)glGetString(GL_RENDERER), hash);
+	hash = hashString((const char*)glGetString(GL_VERSION), hash);
+	return hash;
+}
+
+std::string programCacheFileName(unsigned long long key)
+{
+	char name[64];
+	sprintf(name, "programcache_%016llx.bin", key);
+	return cacheFileName(name);
+}
+
+bool loadProgramBinary(unsigned int program, unsigned long long key)
+{
+	if (!useProgramCache || !GLEW_ARB_get_program_binary) return false;
+
+	FILE* file = fopen(programCacheFileName(key).c_str(), "rb");
+	if (!file) return false;
+
+	unsigned int format = 0;
+	std::vector<char> binary;
+	bool ok = fread(&format, sizeof(format), 1, file) == 1;
+	if (ok)
+	{
+		fseek(file, 0, SEEK_END);
+		long size = ftell(file) - (long)sizeof(format);
+		fseek(file, sizeof(format), SEEK_SET);
+		binary.resize(size > 0 ? size : 0);
+		ok = size > 0 && fread(&binary[0], size, 1, file) == 1;
+	}
+	fclose(file);
+	if (!ok) return false;
+
+	// the driver may reject binaries after an update, then we fall back to compiling
+	glProgramBinary(program, format, &binary[0], (int)binary.size());
+	int linked;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	return linked != 0;
+}
+
+void saveProgramBinary(unsigned int program, unsigned long long key)
+{
+	if (!useProgramCache || !GLEW_ARB_get_program_binary) return;
+
+	int linked, length = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (!linked || length <= 0) return;
+
+	std::vector<char> binary(length);
+	unsigned int format;
+	glGetProgramBinary(program, length, NULL, &format, &binary[0]);
+
+	FILE* file = fopen(programCacheFileName(key).c_str(), "wb");
+	if (!file) return;
+	fwrite(&format, sizeof(format), 1, file);
+	fwrite(&binary[0], binary.size(), 1, file);
+	fclose(file);
+}
+
+// GL_KHR_parallel_shader_compile is newer than the bundled GLEW, so it is loaded by hand
+#define GL_MAX_SHADER_COMPILER_THREADS_KHR 0x91B0
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+typedef void (WINAPI *MaxShaderCompilerThreadsProc)(unsigned int count);
+bool parallelShaderCompile = false;
+
+bool hasExtension(const char* name)
+{
+	int count = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+	for (int i = 0; i < count; i++)
+		if (strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), name) == 0) return true;
+	return false;
+}
+
+void initParallelShaderCompile()
+{
+	MaxShaderCompilerThreadsProc maxShaderCompilerThreads = 0;
+#if !defined(__APPLE__)
+	if (hasExtension("GL_KHR_parallel_shader_compile"))
+		maxShaderCompilerThreads = (MaxShaderCompilerThreadsProc)glutGetProcAddress("glMaxShaderCompilerThreadsKHR");
+	else if (hasExtension("GL_ARB_parallel_shader_compile"))
+		maxShaderCompilerThreads = (MaxShaderCompilerThreadsProc)glutGetProcAddress("glMaxShaderCompilerThreadsARB");
+#endif
+	if (!maxShaderCompilerThreads) return;
+
+	unsigned int threads = std::thread::hardware_concurrency();
+	maxShaderCompilerThreads(threads > 0 ? threads : 0xFFFFFFFF);
+	parallelShaderCompile = true;
+	printf("Parallel shader compile: %u driver threads\n", threads);
+}
+
 // row-major matrix 4x4
 struct mat4
 {
@@ -182,28 +488,345 @@ vec3 cross(const vec3& a, const vec3& b)
 
 
 
+// persistent worker threads; ParallelFor hands out indices until all are done, the caller helps
+class ThreadPool
+{
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	const std::function<void(int)>* job;
+	int jobCount;
+	std::atomic<int> nextJob;
+	int busyWorkers;
+	unsigned int generation;
+	bool quit;
+
+	void RunJobs()
+	{
+		int i;
+		while ((i = nextJob++) < jobCount) (*job)(i);
+	}
+
+	void WorkerLoop()
+	{
+		unsigned int seen = 0;
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [&] { return quit || generation != seen; });
+				if (quit) return;
+				seen = generation;
+			}
+			RunJobs();
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--busyWorkers == 0) done.notify_all();
+		}
+	}
+
+public:
+	ThreadPool(int threadCount = -1) : job(0), jobCount(0), nextJob(0), busyWorkers(0), generation(0), quit(false)
+	{
+		if (threadCount < 0) threadCount = (int)std::thread::hardware_concurrency() - 1;
+		for (int i = 0; i < threadCount; i++) workers.push_back(std::thread(&ThreadPool::WorkerLoop, this));
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wake.notify_all();
+		for (unsigned int i = 0; i < workers.size(); i++) workers[i].join();
+	}
+
+	int GetThreadCount() { return (int)workers.size() + 1; }
+
+	void ParallelFor(int count, const std::function<void(int)>& fn)
+	{
+		if (workers.empty() || count <= 1)
+		{
+			for (int i = 0; i < count; i++) fn(i);
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = &fn;
+			jobCount = count;
+			nextJob = 0;
+			busyWorkers = (int)workers.size();
+			generation++;
+		}
+		wake.notify_all();
+		RunJobs();
+
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [&] { return busyWorkers == 0; });
+		job = 0;
+	}
+};
+
+ThreadPool* threadPool;
+// threads the pool runs jobs on, the GL thread included; 0 uses one per core. set lower to measure
+// how the recorder and the software renderer scale
+int renderThreads = 0;
+
+// per-frame counters, averaged and printed once a second while enabled with 'f'
+struct RenderStats
+{
+	bool enabled;
+	int frames;
+	double frameMs;
+	double reportTime;
+
+	int lights;
+	int lightIndices;
+	double lightAssignMs;
+
+	int prepassFrames;
+	double fragmentsWithPrepass, fragmentsWithoutPrepass;
+
+	double resolutionScale;
+
+	int views, objects, culled, draws;
+	double recordMs, replayMs;
+	int vertices, impostors;
+	// the recorder's ParallelFor: jobs handed out, its wall time and the time summed over its jobs,
+	// so the difference is what handing out and waiting cost
+	int recordJobs;
+	double recordParallelMs, recordJobMs;
+
+	unsigned int textureResidentBytes, textureBudgetBytes;
+	int texturePending, textureLoads, textureEvictions;
+
+	// software GL runs the update's vertex and geometry stages inside the draw calls, where only
+	// the CPU time sees them; a hardware GPU shows up in the timer query instead
+	int particles;
+	double particleUpdateMs, particleSubmitMs;
+
+	// captureMs is the render thread's share; encoding happens on the writer thread
+	int captureFrames, captureStalls;
+	double captureMs;
+
+	int minimapRefreshes, minimapTerrainRenders, minimapMarkers;
+	double minimapMs;
+
+	// resident and pending are the latest frame's; drawn chunks count each pass that draws them
+	int terrainChunks, terrainPending, terrainGenerated, terrainDrawn, terrainTriangles;
+	unsigned int terrainBytes;
+	float terrainDistance;
+	double terrainMs;
+
+	// geometry is the jobs' transform, clip and binning, tiles the rasterizing and shading
+	int softwareThreads, softwareTiles, softwareVertices, softwareTriangles, softwareBinned;
+	double softwareGeometryMs, softwareTileMs, softwareBlitMs;
+	// balance: the slowest job and tile of each frame against the time summed over all of them; with
+	// t threads a slowest item well above summed / t is what keeps the last thread busy alone
+	int softwareJobs;
+	double softwareJobMaxMs, softwareJobSumMs, softwareTileMaxMs, softwareTileSumMs;
+
+	RenderStats() : enabled(false), reportTime(0), views(1), textureResidentBytes(0), textureBudgetBytes(0), texturePending(0), particles(0), particleUpdateMs(0), minimapMarkers(0),
+		terrainChunks(0), terrainPending(0), terrainBytes(0), terrainDistance(0), softwareThreads(0), softwareTiles(0) { Reset(); }
+
+	void Reset()
+	{
+		frames = 0;
+		frameMs = 0;
+		lights = lightIndices = 0;
+		lightAssignMs = 0;
+		prepassFrames = 0;
+		resolutionScale = 0;
+		objects = culled = draws = 0;
+		recordMs = replayMs = 0;
+		vertices = impostors = 0;
+		recordJobs = 0;
+		recordParallelMs = recordJobMs = 0;
+		textureLoads = textureEvictions = 0;
+		particleSubmitMs = 0;
+		captureFrames = captureStalls = 0;
+		captureMs = 0;
+		minimapRefreshes = minimapTerrainRenders = 0;
+		minimapMs = 0;
+		terrainGenerated = terrainDrawn = terrainTriangles = 0;
+		terrainMs = 0;
+		softwareVertices = softwareTriangles = softwareBinned = 0;
+		softwareGeometryMs = softwareTileMs = softwareBlitMs = 0;
+		softwareJobs = 0;
+		softwareJobMaxMs = softwareJobSumMs = softwareTileMaxMs = softwareTileSumMs = 0;
+	}
+
+	void EndFrame(double t, double dtMs)
+	{
+		frames++;
+		frameMs += dtMs;
+		if (t - reportTime < 1.0) return;
+		reportTime = t;
+		if (enabled && frames > 0)
+		{
+			printf("frame %.2f ms | lights %d, %d cluster entries, assign %.3f ms | pre-pass %d/%d frames, fragments shaded %.0f with, %.0f without | resolution scale %.2f\n",
+				frameMs / frames, lights / frames, lightIndices / frames, lightAssignMs / frames,
+				prepassFrames, frames, fragmentsWithPrepass, fragmentsWithoutPrepass, resolutionScale / frames);
+			printf("      %d views, objects %d, %d culled | record %.3f ms | %d draws, replay %.3f ms, %.2f us per draw | %d vertices, %d impostors\n",
+				views, objects / frames, culled / frames, recordMs / frames, draws / frames, replayMs / frames, draws > 0 ? replayMs * 1000 / draws : 0.0,
+				vertices / frames, impostors / frames);
+			printf("      record on %d threads | %d jobs, %.3f ms in ParallelFor, %.3f ms summed over jobs\n",
+				threadPool ? threadPool->GetThreadCount() : 1, recordJobs / frames, recordParallelMs / frames, recordJobMs / frames);
+			printf("      streamed textures %.1f MB resident of %.1f MB, %d pending | %d levels loaded, %d evicted\n",
+				textureResidentBytes / 1048576.0, textureBudgetBytes / 1048576.0, texturePending, textureLoads, textureEvictions);
+			double particleMs = std::max(particleUpdateMs, particleSubmitMs / frames);
+			printf("      particles %d | update %.3f ms GPU, %.3f ms CPU, %.0f particles per ms\n",
+				particles, particleUpdateMs, particleSubmitMs / frames, particleMs > 0 ? particles / particleMs : 0.0);
+			if (captureFrames > 0) printf("      captured %d frames, %d stalls, %.3f ms per frame on the render thread\n",
+				captureFrames, captureStalls, captureMs / frames);
+			if (minimapMs > 0) printf("      minimap %.3f ms per frame | %d refreshes, %d terrain renders, %d markers\n",
+				minimapMs / frames, minimapRefreshes, minimapTerrainRenders, minimapMarkers);
+			if (terrainChunks > 0) printf("      terrain to %.0f units | %d chunks, %.1f MB, %d pending, %d generated | %d drawn, %d triangles | update %.3f ms per frame\n",
+				terrainDistance, terrainChunks, terrainBytes / 1048576.0, terrainPending, terrainGenerated, terrainDrawn / frames, terrainTriangles / frames, terrainMs / frames);
+			if (softwareTileMs > 0) printf("      software %d threads, %d tiles | %d vertices, %d triangles, %d tile entries | geometry %.3f ms, tiles %.3f ms, blit %.3f ms per frame\n",
+				softwareThreads, softwareTiles, softwareVertices / frames, softwareTriangles / frames, softwareBinned / frames,
+				softwareGeometryMs / frames, softwareTileMs / frames, softwareBlitMs / frames);
+			if (softwareTileMs > 0) printf("      software balance | %d jobs, slowest %.3f ms of %.3f ms | %d tiles, slowest %.3f ms of %.3f ms per frame\n",
+				softwareJobs / frames, softwareJobMaxMs / frames, softwareJobSumMs / frames,
+				softwareTiles, softwareTileMaxMs / frames, softwareTileSumMs / frames);
+		}
+		Reset();
+	}
+};
+
+RenderStats renderStats;
+
+
+// what the software renderer draws of a geometry: an indexed triangle list of interleaved position,
+// texture coordinate and normal, or the infinite ground, which it traces per pixel instead
+struct SoftwareMesh
+{
+	const float* vertices;	// 8 floats a vertex
+	int vertexCount;
+	const unsigned int* indices;
+	int indexCount;
+	bool groundPlane;
+};
+
+// a path named in an .obj or .mtl file, which is relative to that file's directory unless absolute
+std::string resolveAssetPath(const std::string& referencingFile, std::string path)
+{
+	size_t end = path.find_last_not_of(" \t\r");
+	path = end == std::string::npos ? std::string() : path.substr(0, end + 1);
+	if (path.empty() || path[0] == '/' || path[0] == '\\' || (path.size() > 1 && path[1] == ':')) return path;
+
+	size_t slash = referencingFile.find_last_of("/\\");
+	if (slash != std::string::npos) path = referencingFile.substr(0, slash + 1) + path;
+
+	// folds "directory/../" away, so an image reached from two files is recognised as one
+	for (size_t up = path.find("/../"); up != std::string::npos; up = path.find("/../"))
+	{
+		size_t start = up == 0 ? std::string::npos : path.find_last_of("/\\", up - 1);
+		start = start == std::string::npos ? 0 : start + 1;
+		if (path.compare(start, up - start, "..") == 0) break;
+		path.erase(start, up + 4 - start);
+	}
+	return path;
+}
+
+// a material of an .mtl library, as an .obj names it for its faces
+struct MtlMaterial
+{
+	std::string name;
+	vec3 ka, kd, ks;
+	float shininess;
+	std::string diffuseMap;	// empty for an untextured material, else resolved against the library's directory
+};
+
+// what one draw of a geometry submits, resolved when a draw is recorded so the replay binds and
+// draws without calling back into the geometry
+struct GeometryDraw
+{
+	unsigned int vao;
+	unsigned int mode;
+	int first, count;
+	unsigned int indexBuffer;	// 0 for array draws, else the 16-bit indices first and count refer to
+	bool blend;
+};
+
 class Geometry
 {
 protected:
-	unsigned int vao;
+	GLVertexArray vao;
+	GLVertexArray depthVao;
+	// model-space sphere around the origin, negative for geometry that is never culled
+	float boundingRadius;
 
 public:
 	Geometry()
 	{
-		glGenVertexArrays(1, &vao);
+		vao.Create();
+		boundingRadius = -1;
 	}
 
-	virtual void Draw() = 0;
+	virtual ~Geometry() { }
+
+	float GetBoundingRadius() { return boundingRadius; }
+
+	// vertices submitted by one Draw
+	virtual int GetVertexCount() = 0;
+
+	// instances above one repeat the draw for split-screen views
+	virtual void Draw(int instances = 1) = 0;
+
+	// position-only draw for the depth pre-pass
+	virtual void DrawDepth(int instances = 1) { Draw(instances); }
+
+	// false when the geometry has nothing the software renderer can draw
+	virtual bool GetSoftwareMesh(SoftwareMesh& mesh) { return false; }
+
+	// the vertices are grouped by material at load time, so each material is one contiguous range;
+	// the software mesh's indices run in the same order, a range covers the same span of them
+	virtual int GetRangeCount() { return 1; }
+	virtual void GetRange(int range, int& first, int& count) { first = 0; count = GetVertexCount(); }
+
+	// the material the file gives a range, 0 where the range is drawn with the mesh's own
+	virtual const MtlMaterial* GetRangeMaterial(int range) { return 0; }
+
+	virtual void DrawRange(int range, int instances = 1) { Draw(instances); }
+
+	// what Draw, DrawDepth or, for a range of 0 or more, DrawRange would submit
+	virtual void GetDraw(int range, bool depthOnly, GeometryDraw& draw) = 0;
+
+protected:
+	void SetDraw(GeometryDraw& draw, unsigned int vao, unsigned int mode, int first, int count, unsigned int indexBuffer = 0, bool blend = false)
+	{
+		draw.vao = vao;
+		draw.mode = mode;
+		draw.first = first;
+		draw.count = count;
+		draw.indexBuffer = indexBuffer;
+		draw.blend = blend;
+	}
+
+	static void DrawArrays(unsigned int mode, int count, int instances, int first = 0)
+	{
+		if (instances > 1) glDrawArraysInstancedARB(mode, first, count, instances);
+		else glDrawArrays(mode, first, count);
+	}
+
+	// from the bound element buffer, 16-bit indices
+	static void DrawElements(unsigned int mode, int count, int instances)
+	{
+		if (instances > 1) glDrawElementsInstancedARB(mode, count, GL_UNSIGNED_SHORT, NULL, instances);
+		else glDrawElements(mode, count, GL_UNSIGNED_SHORT, NULL);
+	}
 };
 
 class TexturedQuad : public Geometry {
-	unsigned int vbos[3];
+	GLBuffer vbos[3];
 
 public:
 	TexturedQuad() {
 		glBindVertexArray(vao);
 
-		glGenBuffers(3, &vbos[0]);
+		for (int i = 0; i < 3; i++) vbos[i].Create();
 
 		glBindBuffer(GL_ARRAY_BUFFER, vbos[0]);
 		static float vertexCoords[] = {-1,0,-1, 
@@ -227,25 +850,29 @@ public:
 		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, NULL);
 	}
 
-	void Draw() {
+	int GetVertexCount() { return 4; }
+
+	void Draw(int instances = 1) {
 		glEnable(GL_BLEND);
 		glEnable(GL_DEPTH_TEST);
 		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 		glBindVertexArray(vao);
-		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		DrawArrays(GL_TRIANGLE_STRIP, 4, instances);
 		glDisable(GL_BLEND);
 		glDisable(GL_DEPTH_TEST);
 	}
+
+	void GetDraw(int range, bool depthOnly, GeometryDraw& draw) { SetDraw(draw, vao, GL_TRIANGLE_STRIP, 0, 4, 0, true); }
 };
 
 class InfiniteTexturedQuad : public Geometry {
-	unsigned int vbos[3];
+	GLBuffer vbos[3];
 
 public:
 	InfiniteTexturedQuad() {
 		glBindVertexArray(vao);
 
-		glGenBuffers(3, &vbos[0]);
+		for (int i = 0; i < 3; i++) vbos[i].Create();
 
 		glBindBuffer(GL_ARRAY_BUFFER, vbos[0]);
 		static float vertexCoords[] = {0, 0, 0, 1,
@@ -270,17 +897,113 @@ public:
 		glBufferData(GL_ARRAY_BUFFER, sizeof(normVecs), normVecs, GL_STATIC_DRAW);
 		glEnableVertexAttribArray(2);
 		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+
+		depthVao.Create();
+		glBindVertexArray(depthVao);
+		glBindBuffer(GL_ARRAY_BUFFER, vbos[0]);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, NULL);
 	}
 
-	void Draw() {
+	int GetVertexCount() { return 6; }
+
+	void Draw(int instances = 1) {
 		glEnable(GL_BLEND);
 		glEnable(GL_DEPTH_TEST);
 		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 		glBindVertexArray(vao);
-		glDrawArrays(GL_TRIANGLE_FAN, 0, 6);
+		DrawArrays(GL_TRIANGLE_FAN, 6, instances);
 		glDisable(GL_BLEND);
 		glDisable(GL_DEPTH_TEST);
 	}
+
+	void DrawDepth(int instances = 1) {
+		glEnable(GL_DEPTH_TEST);
+		glBindVertexArray(depthVao);
+		DrawArrays(GL_TRIANGLE_FAN, 6, instances);
+		glDisable(GL_DEPTH_TEST);
+	}
+
+	void GetDraw(int range, bool depthOnly, GeometryDraw& draw) {
+		if (depthOnly) SetDraw(draw, depthVao, GL_TRIANGLE_FAN, 0, 6);
+		else SetDraw(draw, vao, GL_TRIANGLE_FAN, 0, 6, 0, true);
+	}
+
+	bool GetSoftwareMesh(SoftwareMesh& mesh) {
+		mesh.vertices = 0;
+		mesh.vertexCount = 0;
+		mesh.indices = 0;
+		mesh.indexCount = 0;
+		mesh.groundPlane = true;
+		return true;
+	}
+};
+
+// one terrain tile: a square grid of interleaved position, texture coordinate and normal around the
+// tile's center, drawn with the shared index buffer its level of detail and neighbours call for
+class TerrainChunk : public Geometry {
+	GLBuffer vbo;
+	unsigned int indexBuffer;
+	int indexCount;
+	// the software renderer's copy
+	std::vector<float> vertices;
+	const unsigned int* indices;
+
+public:
+	TerrainChunk(const std::vector<float>& vertices, float radius) : vertices(vertices) {
+		boundingRadius = radius;
+		indexBuffer = 0;
+		indexCount = 0;
+		indices = 0;
+
+		glBindVertexArray(vao);
+		vbo.Create();
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), &vertices[0], GL_STATIC_DRAW);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), NULL);
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(3 * sizeof(float)));
+		glEnableVertexAttribArray(2);
+		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(5 * sizeof(float)));
+	}
+
+	// chosen once a frame, before the frame's draws are recorded
+	void SetIndices(unsigned int buffer, const unsigned int* list, int count) {
+		indexBuffer = buffer;
+		indices = list;
+		indexCount = count;
+	}
+
+	int GetVertexCount() { return indexCount; }
+
+	// the pre-pass uses the same vertex array, its program reads only the positions
+	void DrawDepth(int instances = 1) {
+		glEnable(GL_DEPTH_TEST);
+		glBindVertexArray(vao);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+		DrawElements(GL_TRIANGLES, indexCount, instances);
+		glDisable(GL_DEPTH_TEST);
+	}
+
+	void Draw(int instances = 1) {
+		DrawDepth(instances);
+		renderStats.terrainDrawn++;
+		renderStats.terrainTriangles += indexCount / 3 * instances;
+	}
+
+	// the recorder counts indexed color draws as drawn terrain, chunks being the only indexed geometry
+	void GetDraw(int range, bool depthOnly, GeometryDraw& draw) { SetDraw(draw, vao, GL_TRIANGLES, 0, indexCount, indexBuffer); }
+
+	bool GetSoftwareMesh(SoftwareMesh& mesh) {
+		if (!indices) return false;
+		mesh.vertices = &vertices[0];
+		mesh.vertexCount = (int)vertices.size() / 8;
+		mesh.indices = indices;
+		mesh.indexCount = indexCount;
+		mesh.groundPlane = false;
+		return true;
+	}
 };
 
 
@@ -300,13 +1023,42 @@ class   PolygonalMesh : public Geometry
 	std::vector<vec3*> normals;
 	std::vector<vec2*> texcoords;
 
+	// the usemtl name of each submesh; the library holds what the mtllib files define
+	std::vector<std::string> submeshMaterialNames;
+	std::vector<MtlMaterial> library;
+
+	// submeshes in vertex buffer order, those of one material next to each other; each range is a
+	// material's run of vertices, its library index or -1 for names the library lacks
+	std::vector<int> submeshOrder;
+	std::vector<int> rangeFirst, rangeCount, rangeMaterials;
+
 	int nTriangles;
+	GLBuffer vbo[3];
+
+	// for the software renderer every distinct position, texture coordinate and normal triple of the
+	// faces is one vertex, so shared corners are transformed once
+	std::vector<float> softwareVertices;
+	std::vector<unsigned int> softwareIndices;
+
+	void LoadMaterialLibrary(const char* filename);
+	void GroupByMaterial();
+	void BuildSoftwareMesh();
 
 public:
 	PolygonalMesh(const char *filename);
 	~PolygonalMesh();
 
-	void Draw();
+	int GetVertexCount() { return nTriangles * 3; }
+
+	void Draw(int instances = 1);
+	void DrawDepth(int instances = 1);
+	bool GetSoftwareMesh(SoftwareMesh& mesh);
+
+	int GetRangeCount() { return (int)rangeMaterials.size(); }
+	void GetRange(int range, int& first, int& count) { first = rangeFirst[range]; count = rangeCount[range]; }
+	const MtlMaterial* GetRangeMaterial(int range) { return rangeMaterials[range] < 0 ? 0 : &library[rangeMaterials[range]]; }
+	void DrawRange(int range, int instances = 1);
+	void GetDraw(int range, bool depthOnly, GeometryDraw& draw);
 };
 
 
@@ -327,6 +1079,7 @@ PolygonalMesh::PolygonalMesh(const char *filename)
 	}
 
 	submeshFaces.push_back(std::vector<Face*>());
+	submeshMaterialNames.push_back(std::string());
 	std::vector<Face*>* faces = &submeshFaces.at(submeshFaces.size() - 1);
 
 	for (int i = 0; i < rows.size(); i++)
@@ -380,11 +1133,28 @@ PolygonalMesh::PolygonalMesh(const char *filename)
 			if (faces->size() > 0)
 			{
 				submeshFaces.push_back(std::vector<Face*>());
+				submeshMaterialNames.push_back(submeshMaterialNames.back());
+				faces = &submeshFaces.at(submeshFaces.size() - 1);
+			}
+		}
+		else if (rows[i]->compare(0, 7, "usemtl ") == 0)
+		{
+			if (faces->size() > 0)
+			{
+				submeshFaces.push_back(std::vector<Face*>());
+				submeshMaterialNames.push_back(std::string());
 				faces = &submeshFaces.at(submeshFaces.size() - 1);
 			}
+			submeshMaterialNames.back() = rows[i]->substr(7);
+		}
+		else if (rows[i]->compare(0, 7, "mtllib ") == 0)
+		{
+			LoadMaterialLibrary(resolveAssetPath(filename, rows[i]->substr(7)).c_str());
 		}
 	}
 
+	GroupByMaterial();
+
 	int numberOfTriangles = 0;
 	for (int iSubmesh = 0; iSubmesh<submeshFaces.size(); iSubmesh++)
 	{
@@ -399,15 +1169,18 @@ PolygonalMesh::PolygonalMesh(const char *filename)
 
 	nTriangles = numberOfTriangles;
 
+	boundingRadius = 0;
+	for (int i = 0; i < positions.size(); i++) boundingRadius = std::max(boundingRadius, positions[i]->length());
+
 	float *vertexCoords = new float[numberOfTriangles * 9];
 	float *vertexTexCoords = new float[numberOfTriangles * 6];
 	float *vertexNormalCoords = new float[numberOfTriangles * 9];
 
 
 	int triangleIndex = 0;
-	for (int iSubmesh = 0; iSubmesh<submeshFaces.size(); iSubmesh++)
+	for (int iSubmesh = 0; iSubmesh<submeshOrder.size(); iSubmesh++)
 	{
-		std::vector<Face*>& faces = submeshFaces.at(iSubmesh);
+		std::vector<Face*>& faces = submeshFaces.at(submeshOrder[iSubmesh]);
 
 		for (int i = 0;i<faces.size();i++)
 		{
@@ -529,10 +1302,11 @@ PolygonalMesh::PolygonalMesh(const char *filename)
 		}
 	}
 
+	BuildSoftwareMesh();
+
 	glBindVertexArray(vao);
 
-	unsigned int vbo[3];
-	glGenBuffers(3, &vbo[0]);
+	for (int i = 0; i < 3; i++) vbo[i].Create();
 
 	glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
 	glBufferData(GL_ARRAY_BUFFER, nTriangles * 9 * sizeof(float), vertexCoords, GL_STATIC_DRAW);
@@ -549,24 +1323,179 @@ PolygonalMesh::PolygonalMesh(const char *filename)
 	glEnableVertexAttribArray(2);
 	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, NULL);
 
-	delete vertexCoords;
-	delete vertexTexCoords;
-	delete vertexNormalCoords;
+	depthVao.Create();
+	glBindVertexArray(depthVao);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+
+	delete[] vertexCoords;
+	delete[] vertexTexCoords;
+	delete[] vertexNormalCoords;
 }
 
 
-void PolygonalMesh::Draw()
+// newmtl starts a material, Ka, Kd, Ks, Ns and map_Kd set it; anything else is ignored
+void PolygonalMesh::LoadMaterialLibrary(const char* filename)
 {
-	glEnable(GL_DEPTH_TEST);
-	glBindVertexArray(vao);
-	glDrawArrays(GL_TRIANGLES, 0, nTriangles * 3);
-	glDisable(GL_DEPTH_TEST);
-}
+	std::fstream file(filename);
+	if (!file.is_open())
+	{
+		printf("Material library %s not found, its materials fall back to the mesh's\n", filename);
+		return;
+	}
 
+	char buffer[256];
+	while (!file.eof())
+	{
+		file.getline(buffer, 256);
+		std::string row(buffer);
+		size_t start = row.find_first_not_of(" \t");
+		if (start == std::string::npos || row[start] == '#') continue;
+		row = row.substr(start);
 
-PolygonalMesh::~PolygonalMesh()
-{
-	for (unsigned int i = 0; i < rows.size(); i++) delete rows[i];
+		if (row.compare(0, 7, "newmtl ") == 0)
+		{
+			library.push_back(MtlMaterial());
+			MtlMaterial& material = library.back();
+			material.name = row.substr(7);
+			material.ka = vec3(.1, .1, .1);
+			material.kd = vec3(.9, .9, .9);
+			material.ks = vec3(0, 0, 0);
+			material.shininess = 0;
+			continue;
+		}
+		if (library.empty()) continue;
+
+		MtlMaterial& material = library.back();
+		float x, y, z;
+		if (sscanf(row.c_str(), "Ka %f %f %f", &x, &y, &z) == 3) material.ka = vec3(x, y, z);
+		else if (sscanf(row.c_str(), "Kd %f %f %f", &x, &y, &z) == 3) material.kd = vec3(x, y, z);
+		else if (sscanf(row.c_str(), "Ks %f %f %f", &x, &y, &z) == 3) material.ks = vec3(x, y, z);
+		else if (sscanf(row.c_str(), "Ns %f", &x) == 1) material.shininess = x;
+		else if (row.compare(0, 7, "map_Kd ") == 0) material.diffuseMap = resolveAssetPath(filename, row.substr(7));
+	}
+}
+
+
+// one range per material in order of first use, so parts sharing a material go out in one draw;
+// names the library lacks share the range drawn with the mesh's own material
+void PolygonalMesh::GroupByMaterial()
+{
+	std::vector<int> submeshRanges;
+	for (int i = 0; i < submeshFaces.size(); i++)
+	{
+		int material = -1;
+		for (int m = 0; m < library.size(); m++)
+			if (library[m].name == submeshMaterialNames[i]) material = m;
+
+		int range = (int)(std::find(rangeMaterials.begin(), rangeMaterials.end(), material) - rangeMaterials.begin());
+		if (range == rangeMaterials.size()) rangeMaterials.push_back(material);
+		submeshRanges.push_back(range);
+	}
+
+	int first = 0;
+	for (int r = 0; r < rangeMaterials.size(); r++)
+	{
+		int count = 0;
+		for (int i = 0; i < submeshFaces.size(); i++)
+		{
+			if (submeshRanges[i] != r) continue;
+			submeshOrder.push_back(i);
+			for (int f = 0; f < submeshFaces[i].size(); f++) count += submeshFaces[i][f]->isQuad ? 6 : 3;
+		}
+		rangeFirst.push_back(first);
+		rangeCount.push_back(count);
+		first += count;
+	}
+}
+
+
+void PolygonalMesh::BuildSoftwareMesh()
+{
+	std::map<unsigned long long, unsigned int> vertexIndices;
+	for (int iSubmesh = 0; iSubmesh < submeshOrder.size(); iSubmesh++)
+	{
+		std::vector<Face*>& faces = submeshFaces.at(submeshOrder[iSubmesh]);
+		for (int i = 0; i < faces.size(); i++)
+		{
+			// quads split the same way as for the vertex buffers
+			static const int corners[2][3] = { { 0, 1, 2 }, { 1, 2, 3 } };
+			for (int t = 0; t < (faces[i]->isQuad ? 2 : 1); t++)
+			{
+				for (int c = 0; c < 3; c++)
+				{
+					int k = corners[t][c];
+					int p = faces[i]->positionIndices[k] - 1, uv = faces[i]->texcoordIndices[k] - 1, n = faces[i]->normalIndices[k] - 1;
+					unsigned long long key = (unsigned long long)p << 42 | (unsigned long long)uv << 21 | (unsigned long long)n;
+					std::map<unsigned long long, unsigned int>::iterator found = vertexIndices.find(key);
+					if (found != vertexIndices.end()) {
+						softwareIndices.push_back(found->second);
+						continue;
+					}
+					unsigned int index = (unsigned int)(softwareVertices.size() / 8);
+					float vertex[] = { positions[p]->x, positions[p]->y, positions[p]->z, texcoords[uv]->x, 1 - texcoords[uv]->y,
+						normals[n]->x, normals[n]->y, normals[n]->z };
+					softwareVertices.insert(softwareVertices.end(), vertex, vertex + 8);
+					vertexIndices[key] = index;
+					softwareIndices.push_back(index);
+				}
+			}
+		}
+	}
+}
+
+
+bool PolygonalMesh::GetSoftwareMesh(SoftwareMesh& mesh)
+{
+	if (softwareIndices.empty()) return false;
+	mesh.vertices = &softwareVertices[0];
+	mesh.vertexCount = (int)softwareVertices.size() / 8;
+	mesh.indices = &softwareIndices[0];
+	mesh.indexCount = (int)softwareIndices.size();
+	mesh.groundPlane = false;
+	return true;
+}
+
+
+void PolygonalMesh::Draw(int instances)
+{
+	glEnable(GL_DEPTH_TEST);
+	glBindVertexArray(vao);
+	DrawArrays(GL_TRIANGLES, nTriangles * 3, instances);
+	glDisable(GL_DEPTH_TEST);
+}
+
+
+void PolygonalMesh::DrawRange(int range, int instances)
+{
+	glEnable(GL_DEPTH_TEST);
+	glBindVertexArray(vao);
+	DrawArrays(GL_TRIANGLES, rangeCount[range], instances, rangeFirst[range]);
+	glDisable(GL_DEPTH_TEST);
+}
+
+
+void PolygonalMesh::DrawDepth(int instances)
+{
+	glEnable(GL_DEPTH_TEST);
+	glBindVertexArray(depthVao);
+	DrawArrays(GL_TRIANGLES, nTriangles * 3, instances);
+	glDisable(GL_DEPTH_TEST);
+}
+
+
+void PolygonalMesh::GetDraw(int range, bool depthOnly, GeometryDraw& draw)
+{
+	if (depthOnly) SetDraw(draw, depthVao, GL_TRIANGLES, 0, nTriangles * 3);
+	else if (range >= 0) SetDraw(draw, vao, GL_TRIANGLES, rangeFirst[range], rangeCount[range]);
+	else SetDraw(draw, vao, GL_TRIANGLES, 0, nTriangles * 3);
+}
+
+
+PolygonalMesh::~PolygonalMesh()
+{
+	for (unsigned int i = 0; i < rows.size(); i++) delete rows[i];
 	for (unsigned int i = 0; i < positions.size(); i++) delete positions[i];
 	for (unsigned int i = 0; i < submeshFaces.size(); i++)
 		for (unsigned int j = 0; j < submeshFaces.at(i).size(); j++)
@@ -577,63 +1506,531 @@ PolygonalMesh::~PolygonalMesh()
 
 
 
+// GLSL for clustered point lights; the light lists live in integer and float textures fetched with
+// texelFetch, 1024 texels per row, because the GL 3.0 context has no SSBOs
+const char *clusteredLightingSource = "\n\
+	#ifdef CLUSTERED\n\
+	uniform usampler2D clusterGrid; \n\
+	uniform usampler2D clusterLightIndices; \n\
+	uniform sampler2D clusterLightData; \n\
+	uniform ivec3 clusterDimensions; \n\
+	uniform vec2 clusterTileSize; \n\
+	uniform vec3 clusterDepth; \n\
+	ivec2 clusterTexel(int i) { return ivec2(i & 1023, i >> 10); } \n\
+	vec3 clusteredLighting(vec3 position, vec3 N, vec3 diffuse) { \n\
+		float n = clusterDepth.x, f = clusterDepth.y; \n\
+		float depth = 2.0 * n * f / (f + n - (gl_FragCoord.z * 2.0 - 1.0) * (f - n)); \n\
+		vec2 pixel = gl_FragCoord.xy; \n\
+		int firstCluster = 0; \n\
+		#ifdef MULTI_VIEW\n\
+		vec4 rect = viewRect[fragmentView]; \n\
+		pixel -= rect.xy / rect.zw * clusterTileSize * vec2(clusterDimensions.xy); \n\
+		firstCluster = fragmentView * clusterDimensions.x * clusterDimensions.y * clusterDimensions.z; \n\
+		#endif\n\
+		ivec3 cell = ivec3(pixel / clusterTileSize, log(depth / n) * clusterDepth.z); \n\
+		cell = clamp(cell, ivec3(0), clusterDimensions - 1); \n\
+		int cluster = firstCluster + (cell.z * clusterDimensions.y + cell.y) * clusterDimensions.x + cell.x; \n\
+		uvec2 range = texelFetch(clusterGrid, clusterTexel(cluster), 0).xy; \n\
+		vec3 color = vec3(0, 0, 0); \n\
+		for (int i = 0; i < int(range.y); i++) { \n\
+			int light = int(texelFetch(clusterLightIndices, clusterTexel(int(range.x) + i), 0).r); \n\
+			vec4 positionRadius = texelFetch(clusterLightData, clusterTexel(2 * light), 0); \n\
+			vec3 lightColor = texelFetch(clusterLightData, clusterTexel(2 * light + 1), 0).rgb; \n\
+			vec3 L = positionRadius.xyz - position; \n\
+			float distance = length(L); \n\
+			float attenuation = clamp(1.0 - distance / positionRadius.w, 0.0, 1.0); \n\
+			color += lightColor * diffuse * max(0.0, dot(N, L / distance)) * attenuation * attenuation; \n\
+		} \n\
+		return color; \n\
+	} \n\
+	#endif\n\
+";
+
+void uploadClusterUniforms(unsigned int program, int dimX, int dimY, int dimZ, float tileWidth, float tileHeight, float nearPlane, float farPlane)
+{
+	const char* samplers[] = { "clusterGrid", "clusterLightIndices", "clusterLightData" };
+	for (int i = 0; i < 3; i++)
+	{
+		int location = glGetUniformLocation(program, samplers[i]);
+		if (location >= 0) glUniform1i(location, 1 + i);
+		else printf("uniform %s cannot be set\n", samplers[i]);
+	}
+
+	int location = glGetUniformLocation(program, "clusterDimensions");
+	if (location >= 0) glUniform3i(location, dimX, dimY, dimZ);
+	else printf("uniform clusterDimensions cannot be set\n");
+
+	location = glGetUniformLocation(program, "clusterTileSize");
+	if (location >= 0) glUniform2f(location, tileWidth, tileHeight);
+	else printf("uniform clusterTileSize cannot be set\n");
+
+	location = glGetUniformLocation(program, "clusterDepth");
+	if (location >= 0) glUniform3f(location, nearPlane, farPlane, dimZ / log(farPlane / nearPlane));
+	else printf("uniform clusterDepth cannot be set\n");
+}
+
+// procedural spin of an object about its origin, so that animated objects need no per-object matrix
+// work on the CPU; spinMatrix is ObjectSnapshot's Rz, applied to row vectors, so the result matches
+// an object rotated by spinAngle degrees, which the CPU wraps to [0, 360) to keep it precise
+const char *proceduralAnimationSource = "\n\
+	uniform float spinAngle; \n\
+	uniform vec3 spinAxis; \n\
+	\n\
+	mat3 spinMatrix() { \n\
+		float b = radians(spinAngle); \n\
+		float c = cos(b), s = sin(b); \n\
+		vec3 u = spinAxis; \n\
+		return mat3(vec3(c + u.x * u.x * (1.0 - c), -u.z * s, u.x * u.z * (1.0 - c)), \n\
+			vec3(u.z * s, c, -u.x * s), \n\
+			vec3(u.z * u.x * (1.0 - c), u.x * s, c + u.z * u.z * (1.0 - c))); \n\
+	} \n\
+	\n\
+	vec4 spinAboutOrigin(vec4 worldPosition, mat4 M, mat3 spin) { \n\
+		vec3 origin = (vec4(0, 0, 0, 1) * M).xyz; \n\
+		return vec4(origin + spin * (worldPosition.xyz - origin), 1); \n\
+	} \n\
+";
+
+// split-screen views drawn by one instanced draw: instance n goes to the n-th view set in viewMask,
+// is moved into that view's rectangle of the target and clipped to it there. rectangles are x, y,
+// width and height as fractions of the target
+const char *multiViewSource = "\n\
+	#ifdef MULTI_VIEW\n\
+	uniform mat4 viewVP[4]; \n\
+	uniform vec4 viewRect[4]; \n\
+	uniform vec3 viewEye[4]; \n\
+	uniform int viewMask; \n\
+	flat out int fragmentView; \n\
+	\n\
+	int selectView() { \n\
+		int n = gl_InstanceIDARB; \n\
+		for (int v = 0; v < 4; v++) { \n\
+			if ((viewMask & (1 << v)) == 0) continue; \n\
+			if (n == 0) return v; \n\
+			n--; \n\
+		} \n\
+		return 0; \n\
+	} \n\
+	\n\
+	vec4 placeInView(vec4 clip, int view) { \n\
+		gl_ClipDistance[0] = clip.w + clip.x; \n\
+		gl_ClipDistance[1] = clip.w - clip.x; \n\
+		gl_ClipDistance[2] = clip.w + clip.y; \n\
+		gl_ClipDistance[3] = clip.w - clip.y; \n\
+		vec4 rect = viewRect[view]; \n\
+		return vec4(clip.xy * rect.zw + clip.w * (2.0 * rect.xy + rect.zw - 1.0), clip.zw); \n\
+	} \n\
+	#endif\n\
+";
+
+// defines for the programs using the snippets above; they go ahead of any declaration, as the
+// extension directive has to
+const char *multiViewDefines = "#extension GL_ARB_draw_instanced : enable\n#define MULTI_VIEW\n";
+
+// the fragment side of the above, for programs that shade with the view's eye or clusters
+const char *multiViewFragmentSource = "\n\
+	#ifdef MULTI_VIEW\n\
+	uniform vec4 viewRect[4]; \n\
+	uniform vec3 viewEye[4]; \n\
+	flat in int fragmentView; \n\
+	#endif\n\
+";
+
+// a stage may not use every view uniform, so missing ones are skipped quietly
+void uploadViewUniforms(unsigned int program, int count, mat4* VP, vec4* rect, vec3* eye)
+{
+	int location = glGetUniformLocation(program, "viewVP");
+	if (location >= 0) glUniformMatrix4fv(location, count, GL_TRUE, VP[0]);
+
+	location = glGetUniformLocation(program, "viewRect");
+	if (location >= 0) glUniform4fv(location, count, rect[0].v);
+
+	location = glGetUniformLocation(program, "viewEye");
+	if (location >= 0) glUniform3fv(location, count, &eye[0].x);
+}
+
+int viewMaskCount(int mask)
+{
+	int count = 0;
+	for (; mask; mask >>= 1) count += mask & 1;
+	return count;
+}
+
+// what a recorded draw sets for its object; each program's parameter block reads only its own fields
+struct DrawUniforms
+{
+	const mat4* M;
+	const mat4* InvM;
+	const mat4* MVP;
+	float spinAngle;
+	vec3 spinAxis;
+	float groundHeight;
+	int viewMask;
+};
+
+// what a material sets, uploaded when the replay changes material
+struct MaterialUniforms
+{
+	vec3 ka, kd, ks;
+	float shininess;
+	float textureLayer;
+	int samplerUnit;
+};
+
+// parameter block fields: the uniform's GLSL name and the upload of its value
+struct ModelField
+{
+	static const char* Name() { return "M"; }
+	static void Upload(int location, const DrawUniforms& u) { glUniformMatrix4fv(location, 1, GL_TRUE, &u.M->m[0][0]); }
+};
+
+struct InverseModelField
+{
+	static const char* Name() { return "InvM"; }
+	static void Upload(int location, const DrawUniforms& u) { glUniformMatrix4fv(location, 1, GL_TRUE, &u.InvM->m[0][0]); }
+};
+
+struct ModelViewProjectionField
+{
+	static const char* Name() { return "MVP"; }
+	static void Upload(int location, const DrawUniforms& u) { glUniformMatrix4fv(location, 1, GL_TRUE, &u.MVP->m[0][0]); }
+};
+
+struct SpinAngleField
+{
+	static const char* Name() { return "spinAngle"; }
+	static void Upload(int location, const DrawUniforms& u) { glUniform1f(location, u.spinAngle); }
+};
+
+struct SpinAxisField
+{
+	static const char* Name() { return "spinAxis"; }
+	static void Upload(int location, const DrawUniforms& u) { glUniform3f(location, u.spinAxis.x, u.spinAxis.y, u.spinAxis.z); }
+};
+
+struct GroundHeightField
+{
+	static const char* Name() { return "groundHeight"; }
+	static void Upload(int location, const DrawUniforms& u) { glUniform1f(location, u.groundHeight); }
+};
+
+struct ViewMaskField
+{
+	static const char* Name() { return "viewMask"; }
+	static void Upload(int location, const DrawUniforms& u) { glUniform1i(location, u.viewMask); }
+};
+
+struct AmbientField
+{
+	static const char* Name() { return "ka"; }
+	static void Upload(int location, const MaterialUniforms& u) { glUniform3f(location, u.ka.x, u.ka.y, u.ka.z); }
+};
+
+struct DiffuseField
+{
+	static const char* Name() { return "kd"; }
+	static void Upload(int location, const MaterialUniforms& u) { glUniform3f(location, u.kd.x, u.kd.y, u.kd.z); }
+};
+
+struct SpecularField
+{
+	static const char* Name() { return "ks"; }
+	static void Upload(int location, const MaterialUniforms& u) { glUniform3f(location, u.ks.x, u.ks.y, u.ks.z); }
+};
+
+struct ShininessField
+{
+	static const char* Name() { return "shininess"; }
+	static void Upload(int location, const MaterialUniforms& u) { glUniform1f(location, u.shininess); }
+};
+
+struct TextureLayerField
+{
+	static const char* Name() { return "textureLayer"; }
+	static void Upload(int location, const MaterialUniforms& u) { glUniform1f(location, u.textureLayer); }
+};
+
+struct SamplerField
+{
+	static const char* Name() { return "samplerUnit"; }
+	static void Upload(int location, const MaterialUniforms& u) { glUniform1i(location, u.samplerUnit); }
+};
+
+// stands in for a field a variant does not declare; it is never located and its upload is empty
+struct NoField
+{
+	static const char* Name() { return 0; }
+	template<class Source>
+	static void Upload(int location, const Source& source) { }
+};
+
+// a program's uniforms for the fields listed, located once the program is linked; the uploads are
+// unrolled at compile time, and fields a variant compiles out keep location -1 and are skipped
+template<class Source, class... Fields>
+class ParamBlock
+{
+	int locations[sizeof...(Fields) + 1];
+	bool located;
+
+	template<int I>
+	void UploadFields(const Source& source) { }
+
+	template<int I, class Field, class... Rest>
+	void UploadFields(const Source& source)
+	{
+		if (locations[I] >= 0) Field::Upload(locations[I], source);
+		UploadFields<I + 1, Rest...>(source);
+	}
+
+public:
+	ParamBlock() : located(false) { }
+
+	bool IsLocated() { return located; }
+
+	void Locate(unsigned int program)
+	{
+		const char* names[] = { Fields::Name()..., 0 };
+		for (int i = 0; i < sizeof...(Fields); i++) locations[i] = names[i] ? glGetUniformLocation(program, names[i]) : -1;
+		located = true;
+	}
+
+	void Upload(const Source& source) { UploadFields<0, Fields...>(source); }
+};
+
+// the shader classes whose objects the draw recorder binds through parameter blocks
+enum ShaderClass { OtherShaderClass, MeshShaderClass, InfiniteQuadShaderClass, DepthShaderClass, ShadowShaderClass };
+
 class Shader
 {
 protected:
-	unsigned int shaderProgram;
+	GLProgram shaderProgram;
+	ShaderClass shaderClass;
+
+	GLShader vertexShader, fragmentShader, geometryShader;
+	unsigned long long cacheKey;
+	bool pending;
+
+	static std::vector<Shader*> pendingBuilds;
+
+	// restores the program from the program binary cache, or submits compile and link without
+	// waiting for them; status is checked later by FinishBuild. transform feedback programs name
+	// their captured outputs, which are interleaved into one buffer
+	void BuildProgram(const char* vertexSource, const char* fragmentSource, const char* geometrySource = 0,
+		const char** feedbackVaryings = 0, int feedbackCount = 0)
+	{
+		std::chrono::high_resolution_clock::time_point submitStart = std::chrono::high_resolution_clock::now();
+		shaderProgram.Create();
+		if (!shaderProgram) { printf("Error in shader program creation\n"); exit(1); }
+
+		cacheKey = programCacheKey(vertexSource, fragmentSource);
+		if (geometrySource) cacheKey = hashString(geometrySource, cacheKey);
+		for (int i = 0; i < feedbackCount; i++) cacheKey = hashString(feedbackVaryings[i], cacheKey);
+		if (loadProgramBinary(shaderProgram, cacheKey))
+		{
+			programsFromCache++;
+			programSubmitMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - submitStart).count();
+			return;
+		}
+
+		vertexShader.Create(GL_VERTEX_SHADER);
+		if (!vertexShader) { printf("Error in vertex shader creation\n"); exit(1); }
+
+		glShaderSource(vertexShader, 1, &vertexSource, NULL);
+		glCompileShader(vertexShader);
+
+		fragmentShader.Create(GL_FRAGMENT_SHADER);
+		if (!fragmentShader) { printf("Error in fragment shader creation\n"); exit(1); }
+
+		glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
+		glCompileShader(fragmentShader);
+
+		glAttachShader(shaderProgram, vertexShader);
+		glAttachShader(shaderProgram, fragmentShader);
+
+		if (geometrySource)
+		{
+			geometryShader.Create(GL_GEOMETRY_SHADER);
+			if (!geometryShader) { printf("Error in geometry shader creation\n"); exit(1); }
+
+			glShaderSource(geometryShader, 1, &geometrySource, NULL);
+			glCompileShader(geometryShader);
+			glAttachShader(shaderProgram, geometryShader);
+		}
+		if (feedbackCount > 0) glTransformFeedbackVaryings(shaderProgram, feedbackCount, feedbackVaryings, GL_INTERLEAVED_ATTRIBS);
+
+		glBindAttribLocation(shaderProgram, 0, "vertexPosition");
+		glBindAttribLocation(shaderProgram, 1, "vertexTexCoord");
+		glBindAttribLocation(shaderProgram, 2, "vertexNormal");
+
+		// per-instance rows of M and InvM, only present in instanced variants
+		const char* instanceAttributes[] = { "instanceM0", "instanceM1", "instanceM2", "instanceM3",
+			"instanceInvM0", "instanceInvM1", "instanceInvM2", "instanceInvM3" };
+		for (int i = 0; i < 8; i++) glBindAttribLocation(shaderProgram, 3 + i, instanceAttributes[i]);
+
+		// per-instance bounding sphere, then yaw and ground height, of impostors
+		glBindAttribLocation(shaderProgram, 11, "instanceSphere");
+		glBindAttribLocation(shaderProgram, 12, "instancePlacement");
+
+		// per-instance place, size and color of minimap markers, never in the same program as the above
+		glBindAttribLocation(shaderProgram, 11, "markerSprite");
+		glBindAttribLocation(shaderProgram, 12, "markerColor");
+
+		// particle state, read back from transform feedback buffers
+		glBindAttribLocation(shaderProgram, 13, "particlePosition");
+		glBindAttribLocation(shaderProgram, 14, "particleVelocity");
+		glBindAttribLocation(shaderProgram, 15, "particleColor");
+
+		glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
+		glBindFragDataLocation(shaderProgram, 1, "fragmentNormalDepth");
+
+		if (GLEW_ARB_get_program_binary) glProgramParameteri(shaderProgram, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		glLinkProgram(shaderProgram);
+
+		pending = true;
+		pendingBuilds.push_back(this);
+		programSubmitMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - submitStart).count();
+	}
+
+	// without parallel compilation the driver finishes on the first status query anyway
+	bool IsBuildComplete()
+	{
+		if (!pending || !parallelShaderCompile) return true;
+		int complete = 0;
+		glGetProgramiv(shaderProgram, GL_COMPLETION_STATUS_KHR, &complete);
+		return complete != 0;
+	}
+
+	void FinishBuild()
+	{
+		if (!pending) return;
+		pending = false;
+		pendingBuilds.erase(std::find(pendingBuilds.begin(), pendingBuilds.end(), this));
+
+		checkShader(vertexShader, "Vertex shader error");
+		checkShader(fragmentShader, "Fragment shader error");
+		if (geometryShader) checkShader(geometryShader, "Geometry shader error");
+		checkLinking(shaderProgram);
+
+		saveProgramBinary(shaderProgram, cacheKey);
+		programsCompiled++;
+
+		// the linked program keeps what it needs of its stages
+		vertexShader.Reset();
+		fragmentShader.Reset();
+		geometryShader.Reset();
+	}
 
 public:
-	Shader()
+	Shader(ShaderClass shaderClass = OtherShaderClass) : shaderClass(shaderClass)
+	{
+		cacheKey = 0;
+		pending = false;
+	}
+
+	virtual ~Shader()
 	{
-		shaderProgram = 0;
+		if (pending) pendingBuilds.erase(std::find(pendingBuilds.begin(), pendingBuilds.end(), this));
 	}
 
-	~Shader()
+	// polls every submitted program and finishes each one as the driver completes it,
+	// so status queries never block on a program that is still compiling
+	static void FinishPendingBuilds()
 	{
-		if (shaderProgram) glDeleteProgram(shaderProgram);
+		while (!pendingBuilds.empty())
+		{
+			bool progress = false;
+			for (unsigned int i = 0; i < pendingBuilds.size(); i++)
+			{
+				if (pendingBuilds[i]->IsBuildComplete())
+				{
+					pendingBuilds[i]->FinishBuild();
+					progress = true;
+					i--;
+				}
+			}
+			if (!progress) std::this_thread::yield();
+		}
 	}
 
 	void Run()
 	{
+		if (pending) FinishBuild();
 		if (shaderProgram) glUseProgram(shaderProgram);
 	}
 
-	virtual void UploadInvM(mat4& InVM) { }
+	ShaderClass GetClass() { return shaderClass; }
+	unsigned int GetProgram() { return shaderProgram; }
 
 	virtual void UploadMVP(mat4& MVP) { }
 	virtual void UploadVP(mat4& VP) {}
 
-	virtual void UploadM(mat4& M) {}
-
 	virtual void UploadSamplerID() { }
 
+	virtual void UploadTextureLayer(int layer) { }
+
 	virtual void UploadMaterialAttributes(vec3 ka, vec3 kd, vec3 ks, float shininess) {}
 
 	virtual void UploadLightAttributes(vec3 La, vec3 Le, vec4 worldLightPosition) {}
 
+	// the point planar shadows are projected from
+	virtual void UploadShadowLight(vec4 worldLightPosition) {}
+
+	// the height of the ground under the object drawn next, which its planar shadow falls on
+	virtual void UploadGroundHeight(float height) {}
+
 	virtual void UploadEyePosition(vec3 wEye) {}
+
+	virtual void UploadClusterAttributes(int dimX, int dimY, int dimZ, float tileWidth, float tileHeight, float nearPlane, float farPlane) {}
+
+	virtual void UploadViews(int count, mat4* VP, vec4* rect, vec3* eye) {}
 };
 
+std::vector<Shader*> Shader::pendingBuilds;
+
 class ShadowShader : public Shader {
+	bool animated, multiView;
+
 public:
-	ShadowShader() {
-		const char *vertexSource = " \n\
+	// the light is raised along with the ground height, so a shadow keeps the shape it has on the level
+	typedef ParamBlock<DrawUniforms, ModelField, GroundHeightField, SpinAngleField, SpinAxisField, ViewMaskField> DrawParams;
+	typedef ParamBlock<MaterialUniforms> MaterialParams;
+	DrawParams drawParams;
+	MaterialParams materialParams;
+
+	ShadowShader(bool animated = false, bool multiView = false) : Shader(ShadowShaderClass), animated(animated), multiView(multiView) {
+		const char *vertexTemplate = " \n\
 			#version 130 \n\
+			%s\n\
 			precision highp float; \n\
-			\n\
+			%s\n\
+			%s\n\
 			in vec3 vertexPosition; \n\
 			in vec2 vertexTexCoord; \n\
 			in vec3 vertexNormal; \n\
+			#ifdef MULTI_VIEW\n\
+			uniform mat4 M; \n\
+			#else\n\
 			uniform mat4 M, VP; \n\
+			#endif\n\
 			uniform vec4 worldLightPosition; \n\
+			uniform float groundHeight; \n\
 			\n\
 			void main() { \n\
 			vec4 p = vec4(vertexPosition, 1) * M; \n\
+			#ifdef ANIMATED\n\
+			p = spinAboutOrigin(p, M, spinMatrix()); \n\
+			#endif\n\
+			vec3 light = worldLightPosition.xyz + vec3(0, groundHeight + 1.0, 0); \n\
 			vec3 s; \n\
-			s.y = -0.999; \n\
-			s.x = (p.x - worldLightPosition.x) / (p.y - worldLightPosition.y) * (s.y - worldLightPosition.y) + worldLightPosition.x; \n\
-			s.z = (p.z - worldLightPosition.z) / (p.y - worldLightPosition.y) * (s.y - worldLightPosition.y) + worldLightPosition.z; \n\
+			s.y = groundHeight + 0.001; \n\
+			s.x = (p.x - light.x) / (p.y - light.y) * (s.y - light.y) + light.x; \n\
+			s.z = (p.z - light.z) / (p.y - light.y) * (s.y - light.y) + light.z; \n\
+			#ifdef MULTI_VIEW\n\
+			int view = selectView(); \n\
+			gl_Position = placeInView(vec4(s, 1) * viewVP[view], view); \n\
+			#else\n\
 			gl_Position = vec4(s, 1) * VP; \n\
+			#endif\n\
 			} \n\
 		";
 
@@ -648,172 +2045,164 @@ public:
 			} \n\
 		";
 
-		unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
-		if (!vertexShader) { printf("Error in vertex shader creation\n"); exit(1); }
-
-		glShaderSource(vertexShader, 1, &vertexSource, NULL);
-		glCompileShader(vertexShader);
-		checkShader(vertexShader, "Vertex shader error");
-
-		unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-		if (!fragmentShader) { printf("Error in fragment shader creation\n"); exit(1); }
-
-		glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
-		glCompileShader(fragmentShader);
-		checkShader(fragmentShader, "Fragment shader error");
-
-		shaderProgram = glCreateProgram();
-		if (!shaderProgram) { printf("Error in shader program creation\n"); exit(1); }
-
-		glAttachShader(shaderProgram, vertexShader);
-		glAttachShader(shaderProgram, fragmentShader);
-
-		glBindAttribLocation(shaderProgram, 0, "vertexPosition");
-		glBindAttribLocation(shaderProgram, 1, "vertexTexCoord");
-		glBindAttribLocation(shaderProgram, 2, "vertexNormal");
+		std::string defines;
+		if (animated) defines += "#define ANIMATED\n";
+		if (multiView) defines += multiViewDefines;
 
-		glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
+		char vertexSource[8192];
+		sprintf(vertexSource, vertexTemplate, defines.c_str(), animated ? proceduralAnimationSource : "", multiViewSource);
 
-		glLinkProgram(shaderProgram);
-		checkLinking(shaderProgram);
+		BuildProgram(vertexSource, fragmentSource);
 	}
 
-	void UploadM(mat4& M) {
-		int location = glGetUniformLocation(shaderProgram, "M");
-		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, M);
-		else printf("uniform M cannot be set\n");
+	void UploadViews(int count, mat4* VP, vec4* rect, vec3* eye)
+	{
+		if (multiView) uploadViewUniforms(shaderProgram, count, VP, rect, eye);
 	}
 
 	void UploadVP(mat4& VP)
 	{
+		if (multiView) return;
 		int location = glGetUniformLocation(shaderProgram, "VP");
 		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, VP);
 		else printf("uniform VP cannot be set\n");
 	}
 
-	void UploadLightAttributes(vec3 La, vec3 Le, vec4 worldLightPosition) {
+	void UploadShadowLight(vec4 worldLightPosition) {
 		int location = glGetUniformLocation(shaderProgram, "worldLightPosition");
 		if (location >= 0) glUniform4fv(location, 1, &worldLightPosition.v[0]);
 		else printf("uniform worldLightPosition cannot be set\n");
 	}
 };
 
-class InfiniteQuadShader : public Shader {
+// position-only program for the depth pre-pass; three-component positions get w = 1 from the
+// attribute defaults, so meshes and the infinite quad share it and match the color pass exactly.
+// the animated and multi-view variants repeat the matching mesh shader's position math step by step
+class DepthShader : public Shader {
+	bool animated, multiView;
+
 public:
-	InfiniteQuadShader() {
-		const char *vertexSource = "\n\
+	// MVP for still single-view objects, M for the rest, which transform to world space themselves
+	typedef ParamBlock<DrawUniforms, ModelViewProjectionField, ModelField, SpinAngleField, SpinAxisField, ViewMaskField> DrawParams;
+	typedef ParamBlock<MaterialUniforms> MaterialParams;
+	DrawParams drawParams;
+	MaterialParams materialParams;
+
+	DepthShader(bool animated = false, bool multiView = false) : Shader(DepthShaderClass), animated(animated), multiView(multiView) {
+		const char *vertexTemplate = "\n\
 			#version 130 \n\
+			%s\n\
 			precision highp float; \n\
-			\n\
+			%s\n\
+			%s\n\
 			in vec4 vertexPosition; \n\
-			in vec2 vertexTexCoord; \n\
-			in vec3 vertexNormal; \n\
-			uniform mat4 M, InvM, MVP; \n\
-			\n\
-			out vec2 texCoord; \n\
-			out vec4 worldPosition; \n\
-			out vec3 worldNormal; \n\
+			#ifdef MULTI_VIEW\n\
+			uniform mat4 M; \n\
+			#elif defined(ANIMATED)\n\
+			uniform mat4 M, VP; \n\
+			#else\n\
+			uniform mat4 MVP; \n\
+			#endif\n\
+			invariant gl_Position; \n\
 			\n\
 			void main() { \n\
-			texCoord = vertexTexCoord; \n\
-			worldPosition = vertexPosition * M; \n\
-			worldNormal = (InvM * vec4(vertexNormal, 0.0)).xyz; \n\
+			#ifdef MULTI_VIEW\n\
+			int view = selectView(); \n\
+			vec4 worldPosition = vertexPosition * M; \n\
+			#ifdef ANIMATED\n\
+			worldPosition = spinAboutOrigin(worldPosition, M, spinMatrix()); \n\
+			#endif\n\
+			gl_Position = placeInView(worldPosition * viewVP[view], view); \n\
+			#elif defined(ANIMATED)\n\
+			vec4 worldPosition = vertexPosition * M; \n\
+			worldPosition = spinAboutOrigin(worldPosition, M, spinMatrix()); \n\
+			gl_Position = worldPosition * VP; \n\
+			#else\n\
 			gl_Position = vertexPosition * MVP; \n\
+			#endif\n\
 			} \n\
 		";
 
 		const char *fragmentSource = "\n\
 			#version 130 \n\
 			precision highp float; \n\
-			uniform sampler2D samplerUnit; \n\
-			uniform vec3 La, Le; \n\
-			uniform vec3 ka, kd, ks; \n\
-			uniform float shininess; \n\
-			uniform vec3 worldEyePosition; \n\
-			uniform vec4 worldLightPosition; \n\
-			in vec2 texCoord; \n\
-			in vec4 worldPosition; \n\
-			in vec3 worldNormal; \n\
+			\n\
 			out vec4 fragmentColor; \n\
+			\n\
 			void main() { \n\
-			vec3 N = normalize(worldNormal); \n\
-			vec3 V = normalize(worldEyePosition * worldPosition.w - worldPosition.xyz);\n\
-			vec3 L = normalize(worldLightPosition.xyz * worldPosition.w - worldPosition.xyz * worldLightPosition.w);\n\
-			vec3 H = normalize(V + L); \n\
-			vec2 position = worldPosition.xz / worldPosition.w; \n\
-			vec2 tex = position.xy - floor(position.xy); \n\
-			vec3 texel = texture(samplerUnit, tex).xyz; \n\
-			vec3 color = La * ka + Le * kd * texel* max(0.0, dot(L, N)) + Le * ks * pow(max(0.0, dot(H, N)), shininess); \n\
-			fragmentColor = vec4(color, 1); \n\
+			fragmentColor = vec4(0, 0, 0, 1); \n\
 			} \n\
 		";
 
-		unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
-		if (!vertexShader) { printf("Error in vertex shader creation\n"); exit(1); }
-
-		glShaderSource(vertexShader, 1, &vertexSource, NULL);
-		glCompileShader(vertexShader);
-		checkShader(vertexShader, "Vertex shader error");
-
-		unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-		if (!fragmentShader) { printf("Error in fragment shader creation\n"); exit(1); }
-
-		glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
-		glCompileShader(fragmentShader);
-		checkShader(fragmentShader, "Fragment shader error");
-
-		shaderProgram = glCreateProgram();
-		if (!shaderProgram) { printf("Error in shader program creation\n"); exit(1); }
-
-		glAttachShader(shaderProgram, vertexShader);
-		glAttachShader(shaderProgram, fragmentShader);
-
-		glBindAttribLocation(shaderProgram, 0, "vertexPosition");
-		glBindAttribLocation(shaderProgram, 1, "vertexTexCoord");
-		glBindAttribLocation(shaderProgram, 2, "vertexNormal");
+		std::string defines;
+		if (animated) defines += "#define ANIMATED\n";
+		if (multiView) defines += multiViewDefines;
 
-		glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
+		char vertexSource[8192];
+		sprintf(vertexSource, vertexTemplate, defines.c_str(), animated ? proceduralAnimationSource : "", multiViewSource);
 
-		glLinkProgram(shaderProgram);
-		checkLinking(shaderProgram);
+		BuildProgram(vertexSource, fragmentSource);
 	}
 
-	void UploadMaterialAttributes(vec3 ka, vec3 kd, vec3 ks, float shininess) {
-		int location = glGetUniformLocation(shaderProgram, "ka");
-		if (location >= 0) glUniform3f(location, ka.x, ka.y, ka.z);
-		else printf("uniform ka cannot be set\n");
-
-		location = glGetUniformLocation(shaderProgram, "kd");
-		if (location >= 0) glUniform3f(location, kd.x, kd.y, kd.z);
-		else printf("uniform kd cannot be set\n");
-
-		location = glGetUniformLocation(shaderProgram, "ks");
-		if (location >= 0) glUniform3f(location, ks.x, ks.y, ks.z);
-		else printf("uniform ks cannot be set\n");
-
-		location = glGetUniformLocation(shaderProgram, "shininess");
-		if (location >= 0) glUniform1f(location, shininess);
-		else printf("uniform shininess cannot be set\n");
+	void UploadVP(mat4& VP)
+	{
+		if (!animated || multiView) return;
+		int location = glGetUniformLocation(shaderProgram, "VP");
+		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, VP);
+		else printf("uniform VP cannot be set\n");
 	}
 
-	void UploadEyePosition(vec3 wEye) {
-		int location = glGetUniformLocation(shaderProgram, "worldEyePosition");
-		if (location >= 0) glUniform3f(location, wEye.x, wEye.y, wEye.z);
-		else printf("uniform worldEyePosition cannot be set");
+	void UploadViews(int count, mat4* VP, vec4* rect, vec3* eye)
+	{
+		if (multiView) uploadViewUniforms(shaderProgram, count, VP, rect, eye);
 	}
+};
 
-	void UploadLightAttributes(vec3 La, vec3 Le, vec4 worldLightPosition) {
-		int location = glGetUniformLocation(shaderProgram, "La");
-		if (location >= 0) glUniform3f(location, La.x, La.y, La.z);
-		else printf("uniform La cannot be set\n");
+// draws one triangle covering the screen and samples the scaled-down scene render, optionally with
+// a light unsharp mask to win back some of the detail lost to the bilinear filter
+class UpscaleShader : public Shader {
+public:
+	UpscaleShader() {
+		const char *vertexSource = "\n\
+			#version 130 \n\
+			precision highp float; \n\
+			\n\
+			out vec2 texCoord; \n\
+			\n\
+			void main() { \n\
+			vec2 p = vec2(float((gl_VertexID & 1) * 4 - 1), float((gl_VertexID >> 1) * 4 - 1)); \n\
+			texCoord = p * 0.5 + 0.5; \n\
+			gl_Position = vec4(p, 0, 1); \n\
+			} \n\
+		";
 
-		location = glGetUniformLocation(shaderProgram, "Le");
-		if (location >= 0) glUniform3f(location, Le.x, Le.y, Le.z);
-		else printf("uniform Le cannot be set\n");
+		const char *fragmentSource = "\n\
+			#version 130 \n\
+			precision highp float; \n\
+			\n\
+			uniform sampler2D samplerUnit; \n\
+			uniform vec2 sourceScale; \n\
+			uniform vec2 sourceTexelSize; \n\
+			uniform float sharpness; \n\
+			\n\
+			in vec2 texCoord; \n\
+			out vec4 fragmentColor; \n\
+			\n\
+			void main() { \n\
+			vec2 uv = min(texCoord * sourceScale, sourceScale - 0.5 * sourceTexelSize); \n\
+			vec3 color = texture(samplerUnit, uv).rgb; \n\
+			if (sharpness > 0.0) { \n\
+				vec3 blur = texture(samplerUnit, uv + vec2(sourceTexelSize.x, 0)).rgb \n\
+					+ texture(samplerUnit, uv - vec2(sourceTexelSize.x, 0)).rgb \n\
+					+ texture(samplerUnit, uv + vec2(0, sourceTexelSize.y)).rgb \n\
+					+ texture(samplerUnit, uv - vec2(0, sourceTexelSize.y)).rgb; \n\
+				color = clamp(color + sharpness * (color - blur * 0.25), 0.0, 1.0); \n\
+			} \n\
+			fragmentColor = vec4(color, 1); \n\
+			} \n\
+		";
 
-		location = glGetUniformLocation(shaderProgram, "worldLightPosition");
-		if (location >= 0) glUniform4fv(location, 1, &worldLightPosition.v[0]);
-		else printf("uniform worldLightPosition cannot be set\n");
+		BuildProgram(vertexSource, fragmentSource);
 	}
 
 	void UploadSamplerID()
@@ -824,170 +2213,355 @@ public:
 		glActiveTexture(GL_TEXTURE0 + samplerUnit);
 	}
 
-	void UploadM(mat4& M) {
-		int location = glGetUniformLocation(shaderProgram, "M");
-		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, M);
-		else printf("uniform M cannot be set\n");
-	}
-
-	void UploadInvM(mat4& InvM)
-	{
-		int location = glGetUniformLocation(shaderProgram, "InvM");
-		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, InvM);
-		else printf("uniform InvM cannot be set\n");
-	}
-
-	void UploadMVP(mat4& MVP)
+	void UploadUpscaleAttributes(float scaleX, float scaleY, float texelWidth, float texelHeight, float sharpness)
 	{
-		int location = glGetUniformLocation(shaderProgram, "MVP");
-		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, MVP);
-		else printf("uniform MVP cannot be set\n");
+		int location = glGetUniformLocation(shaderProgram, "sourceScale");
+		if (location >= 0) glUniform2f(location, scaleX, scaleY);
+		location = glGetUniformLocation(shaderProgram, "sourceTexelSize");
+		if (location >= 0) glUniform2f(location, texelWidth, texelHeight);
+		location = glGetUniformLocation(shaderProgram, "sharpness");
+		if (location >= 0) glUniform1f(location, sharpness);
 	}
 };
 
+// hemi-octahedral mapping of the upper hemisphere to the unit square and the view basis of each
+// direction; the impostor atlas is baked with the C++ twins of these, so both must stay in step
+const char *impostorMappingSource = "\n\
+	vec2 encodeHemiOctahedral(vec3 d) { \n\
+		d.y = max(d.y, 0.0); \n\
+		d /= abs(d.x) + abs(d.y) + abs(d.z); \n\
+		return vec2(d.x + d.z, d.x - d.z) * 0.5 + 0.5; \n\
+	} \n\
+	\n\
+	vec3 decodeHemiOctahedral(vec2 uv) { \n\
+		vec2 t = uv * 2.0 - 1.0; \n\
+		vec2 p = vec2(t.x + t.y, t.x - t.y) * 0.5; \n\
+		return normalize(vec3(p.x, 1.0 - abs(p.x) - abs(p.y), p.y)); \n\
+	} \n\
+	\n\
+	void viewBasis(vec3 w, out vec3 u, out vec3 v) { \n\
+		vec3 up = abs(w.y) > 0.999 ? vec3(0, 0, -1) : vec3(0, 1, 0); \n\
+		u = normalize(cross(up, w)); \n\
+		v = cross(w, u); \n\
+	} \n\
+";
+
+// renders a mesh into one cell of an impostor atlas: albedo with coverage in alpha, and the
+// model-space normal with the depth along the view direction, relative to the bounding radius
+class ImpostorBakeShader : public Shader {
+	bool textureArray;
 
-class MeshShader : public Shader
-{
 public:
-	MeshShader()
-	{
+	ImpostorBakeShader(bool textureArray = false) : textureArray(textureArray) {
 		const char *vertexSource = "\n\
 			#version 130 \n\
-    		precision highp float; \n\
+			precision highp float; \n\
 			\n\
 			in vec3 vertexPosition; \n\
 			in vec2 vertexTexCoord; \n\
 			in vec3 vertexNormal; \n\
-			uniform mat4 M, InvM, MVP; \n\
-			uniform vec3 worldEyePosition;\n\
-			uniform vec4 worldLightPosition;\n\
+			uniform mat4 MVP; \n\
+			\n\
 			out vec2 texCoord; \n\
-			out vec3 worldNormal; \n\
-			out vec3 worldView;\n\
-			out vec3 worldLight;\n\
+			out vec3 modelPosition; \n\
+			out vec3 modelNormal; \n\
 			\n\
 			void main() { \n\
-				texCoord = vertexTexCoord; \n\
-				vec4 worldPosition = vec4(vertexPosition, 1) * M;\n\
-				worldLight = worldLightPosition.xyz * worldPosition.w - worldPosition.xyz * worldLightPosition.w;\n\
-				worldView = worldEyePosition - worldPosition.xyz;\n\
-				worldNormal = (InvM * vec4(vertexNormal, 0.0)).xyz;\n\
-				gl_Position = vec4(vertexPosition, 1) * MVP;\n\
+			texCoord = vertexTexCoord; \n\
+			modelPosition = vertexPosition; \n\
+			modelNormal = vertexNormal; \n\
+			gl_Position = vec4(vertexPosition, 1) * MVP; \n\
 			} \n\
 		";
 
-		const char *fragmentSource = "\n\
+		const char *fragmentTemplate = "\n\
 			#version 130 \n\
-    		precision highp float; \n\
-			\n\
+			precision highp float; \n\
+			%s\n\
+			#ifdef TEXTURE_ARRAY\n\
+			uniform sampler2DArray samplerUnit; \n\
+			uniform float textureLayer; \n\
+			#else\n\
 			uniform sampler2D samplerUnit; \n\
-			uniform vec3 La, Le;\n\
-			uniform vec3 ka, kd, ks;\n\
-			uniform float shininess;\n\
+			#endif\n\
+			uniform vec3 kd; \n\
+			uniform vec3 viewDirection; \n\
+			uniform float radius; \n\
+			\n\
 			in vec2 texCoord; \n\
-			in vec3 worldNormal; \n\
-			in vec3 worldView;\n\
-			in vec3 worldLight;\n\
+			in vec3 modelPosition; \n\
+			in vec3 modelNormal; \n\
 			out vec4 fragmentColor; \n\
+			out vec4 fragmentNormalDepth; \n\
 			\n\
 			void main() { \n\
-				vec3 N = normalize(worldNormal);\n\
-				vec3 V = normalize(worldView);\n\
-				vec3 L = normalize(worldLight);\n\
-				vec3 H = normalize(V + L);\n\
-				vec3 texel = texture(samplerUnit, texCoord).xyz;\n\
-				vec3 color = La * ka + Le * kd * texel * max(0.0, dot(L, N)) + Le * ks * pow(max(0.0, dot(H, N)), shininess);\n\
-				fragmentColor = vec4(color, 1);\n\
+			#ifdef TEXTURE_ARRAY\n\
+			vec3 texel = texture(samplerUnit, vec3(texCoord, textureLayer)).xyz; \n\
+			#else\n\
+			vec3 texel = texture(samplerUnit, texCoord).xyz; \n\
+			#endif\n\
+			fragmentColor = vec4(kd * texel, 1); \n\
+			float depth = dot(modelPosition, viewDirection) / radius; \n\
+			fragmentNormalDepth = vec4(normalize(modelNormal) * 0.5 + 0.5, depth * 0.5 + 0.5); \n\
 			} \n\
 		";
 
-		unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
-		if (!vertexShader) { printf("Error in vertex shader creation\n"); exit(1); }
+		char fragmentSource[2048];
+		sprintf(fragmentSource, fragmentTemplate, textureArray ? "#define TEXTURE_ARRAY" : "");
 
-		glShaderSource(vertexShader, 1, &vertexSource, NULL);
-		glCompileShader(vertexShader);
-		checkShader(vertexShader, "Vertex shader error");
+		BuildProgram(vertexSource, fragmentSource);
+	}
 
-		unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-		if (!fragmentShader) { printf("Error in fragment shader creation\n"); exit(1); }
+	void UploadMVP(mat4& MVP)
+	{
+		int location = glGetUniformLocation(shaderProgram, "MVP");
+		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, MVP);
+		else printf("uniform MVP cannot be set\n");
+	}
 
-		glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
-		glCompileShader(fragmentShader);
-		checkShader(fragmentShader, "Fragment shader error");
+	void UploadMaterialAttributes(vec3 ka, vec3 kd, vec3 ks, float shininess) {
+		int location = glGetUniformLocation(shaderProgram, "kd");
+		if (location >= 0) glUniform3f(location, kd.x, kd.y, kd.z);
+		else printf("uniform kd cannot be set\n");
+	}
 
-		shaderProgram = glCreateProgram();
-		if (!shaderProgram) { printf("Error in shader program creation\n"); exit(1); }
+	void UploadSamplerID()
+	{
+		int samplerUnit = 0;
+		int location = glGetUniformLocation(shaderProgram, "samplerUnit");
+		glUniform1i(location, samplerUnit);
+		glActiveTexture(GL_TEXTURE0 + samplerUnit);
+	}
 
-		glAttachShader(shaderProgram, vertexShader);
-		glAttachShader(shaderProgram, fragmentShader);
+	void UploadTextureLayer(int layer)
+	{
+		if (!textureArray) return;
+		int location = glGetUniformLocation(shaderProgram, "textureLayer");
+		if (location >= 0) glUniform1f(location, (float)layer);
+		else printf("uniform textureLayer cannot be set\n");
+	}
 
-		glBindAttribLocation(shaderProgram, 0, "vertexPosition");
-		glBindAttribLocation(shaderProgram, 1, "vertexTexCoord");
-		glBindAttribLocation(shaderProgram, 2, "vertexNormal");
+	void UploadImpostorView(vec3 direction, float radius)
+	{
+		int location = glGetUniformLocation(shaderProgram, "viewDirection");
+		if (location >= 0) glUniform3f(location, direction.x, direction.y, direction.z);
+		location = glGetUniformLocation(shaderProgram, "radius");
+		if (location >= 0) glUniform1f(location, radius);
+	}
+};
 
-		glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
+// draws impostor instances as quads facing the camera, or for shadows the light, each showing the
+// atlas cell baked nearest to that direction; instances are a bounding sphere and a yaw in degrees
+class ImpostorShader : public Shader {
+	bool shadow;
 
-		glLinkProgram(shaderProgram);
-		checkLinking(shaderProgram);
-	}
+public:
+	ImpostorShader(bool shadow = false) : shadow(shadow) {
+		const char *vertexTemplate = "\n\
+			#version 130 \n\
+			precision highp float; \n\
+			%s\n\
+			%s\n\
+			in vec4 instanceSphere; \n\
+			in vec2 instancePlacement; \n\
+			uniform mat4 VP; \n\
+			uniform vec4 worldLightPosition; \n\
+			uniform vec3 worldEyePosition; \n\
+			uniform float gridSize; \n\
+			\n\
+			out vec2 atlasCoord; \n\
+			out vec3 worldPos; \n\
+			out vec3 worldDirection; \n\
+			out vec2 yawSinCos; \n\
+			out float radius; \n\
+			\n\
+			void main() { \n\
+			vec3 center = instanceSphere.xyz; \n\
+			radius = instanceSphere.w; \n\
+			float yaw = radians(instancePlacement.x); \n\
+			float s = sin(yaw), c = cos(yaw); \n\
+			yawSinCos = vec2(s, c); \n\
+			#ifdef SHADOW\n\
+			vec3 toViewer = normalize(worldLightPosition.xyz - center); \n\
+			#else\n\
+			vec3 toViewer = normalize(worldEyePosition - center); \n\
+			#endif\n\
+			vec3 modelDirection = vec3(toViewer.x * c + toViewer.z * s, toViewer.y, toViewer.z * c - toViewer.x * s); \n\
+			vec2 cell = clamp(floor(encodeHemiOctahedral(modelDirection) * gridSize), 0.0, gridSize - 1.0); \n\
+			vec3 w = decodeHemiOctahedral((cell + 0.5) / gridSize); \n\
+			vec3 u, v; \n\
+			viewBasis(w, u, v); \n\
+			vec2 corner = vec2(float(gl_VertexID & 1), float(gl_VertexID >> 1)) * 2.0 - 1.0; \n\
+			atlasCoord = (cell + corner * 0.5 + 0.5) / gridSize; \n\
+			vec3 q = (u * corner.x + v * corner.y) * radius; \n\
+			worldPos = center + vec3(q.x * c - q.z * s, q.y, q.x * s + q.z * c); \n\
+			worldDirection = vec3(w.x * c - w.z * s, w.y, w.x * s + w.z * c); \n\
+			#ifdef SHADOW\n\
+			float ground = instancePlacement.y; \n\
+			vec3 light = worldLightPosition.xyz + vec3(0, ground + 1.0, 0); \n\
+			vec3 p = worldPos; \n\
+			p.y = ground + 0.001; \n\
+			p.x = (worldPos.x - light.x) / (worldPos.y - light.y) * (p.y - light.y) + light.x; \n\
+			p.z = (worldPos.z - light.z) / (worldPos.y - light.y) * (p.y - light.y) + light.z; \n\
+			gl_Position = vec4(p, 1) * VP; \n\
+			#else\n\
+			gl_Position = vec4(worldPos, 1) * VP; \n\
+			#endif\n\
+			} \n\
+		";
 
-	void UploadMaterialAttributes(vec3 ka, vec3 kd, vec3 ks, float shininess) {
-		int location = glGetUniformLocation(shaderProgram, "ka");
-		if (location >= 0) glUniform3f(location, ka.x, ka.y, ka.z);
-		else printf("uniform ka cannot be set\n");
+		const char *fragmentTemplate = "\n\
+			#version 130 \n\
+			precision highp float; \n\
+			%s\n\
+			uniform sampler2D albedoAtlas; \n\
+			uniform sampler2D normalDepthAtlas; \n\
+			uniform mat4 VP; \n\
+			uniform vec3 La, Le; \n\
+			uniform vec3 ka; \n\
+			uniform vec4 worldLightPosition; \n\
+			\n\
+			in vec2 atlasCoord; \n\
+			in vec3 worldPos; \n\
+			in vec3 worldDirection; \n\
+			in vec2 yawSinCos; \n\
+			in float radius; \n\
+			out vec4 fragmentColor; \n\
+			\n\
+			void main() { \n\
+			vec4 albedo = texture(albedoAtlas, atlasCoord); \n\
+			if (albedo.a < 0.5) discard; \n\
+			#ifdef SHADOW\n\
+			fragmentColor = vec4(0.0, 0.1, 0.0, 1); \n\
+			#else\n\
+			vec4 normalDepth = texture(normalDepthAtlas, atlasCoord); \n\
+			vec3 n = normalize(normalDepth.xyz * 2.0 - 1.0); \n\
+			float s = yawSinCos.x, c = yawSinCos.y; \n\
+			vec3 N = vec3(n.x * c - n.z * s, n.y, n.x * s + n.z * c); \n\
+			vec3 L = normalize(worldLightPosition.xyz - worldPos * worldLightPosition.w); \n\
+			fragmentColor = vec4(La * ka + Le * albedo.rgb * max(0.0, dot(L, N)), 1); \n\
+			vec4 clip = vec4(worldPos + worldDirection * (normalDepth.a * 2.0 - 1.0) * radius, 1) * VP; \n\
+			gl_FragDepth = clip.z / clip.w * 0.5 + 0.5; \n\
+			#endif\n\
+			} \n\
+		";
 
-		location = glGetUniformLocation(shaderProgram, "kd");
-		if (location >= 0) glUniform3f(location, kd.x, kd.y, kd.z);
-		else printf("uniform kd cannot be set\n");
+		const char* define = shadow ? "#define SHADOW" : "";
+		char vertexSource[8192], fragmentSource[4096];
+		sprintf(vertexSource, vertexTemplate, define, impostorMappingSource);
+		sprintf(fragmentSource, fragmentTemplate, define);
 
-		location = glGetUniformLocation(shaderProgram, "ks");
-		if (location >= 0) glUniform3f(location, ks.x, ks.y, ks.z);
-		else printf("uniform ks cannot be set\n");
+		BuildProgram(vertexSource, fragmentSource);
+	}
 
-		location = glGetUniformLocation(shaderProgram, "shininess");
-		if (location >= 0) glUniform1f(location, shininess);
-		else printf("uniform shininess cannot be set\n");
+	void UploadVP(mat4& VP)
+	{
+		int location = glGetUniformLocation(shaderProgram, "VP");
+		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, VP);
+		else printf("uniform VP cannot be set\n");
 	}
 
 	void UploadEyePosition(vec3 wEye) {
+		if (shadow) return;
 		int location = glGetUniformLocation(shaderProgram, "worldEyePosition");
 		if (location >= 0) glUniform3f(location, wEye.x, wEye.y, wEye.z);
-		else printf("uniform worldEyePosition cannot be set");
+		else printf("uniform worldEyePosition cannot be set\n");
 	}
 
 	void UploadLightAttributes(vec3 La, vec3 Le, vec4 worldLightPosition) {
-		int location = glGetUniformLocation(shaderProgram, "La");
+		if (shadow) return;
+		int location = glGetUniformLocation(shaderProgram, "worldLightPosition");
+		if (location >= 0) glUniform4fv(location, 1, &worldLightPosition.v[0]);
+		else printf("uniform worldLightPosition cannot be set\n");
+
+		location = glGetUniformLocation(shaderProgram, "La");
 		if (location >= 0) glUniform3f(location, La.x, La.y, La.z);
 		else printf("uniform La cannot be set\n");
 
 		location = glGetUniformLocation(shaderProgram, "Le");
 		if (location >= 0) glUniform3f(location, Le.x, Le.y, Le.z);
 		else printf("uniform Le cannot be set\n");
+	}
 
-		location = glGetUniformLocation(shaderProgram, "worldLightPosition");
+	void UploadShadowLight(vec4 worldLightPosition) {
+		if (!shadow) return;
+		int location = glGetUniformLocation(shaderProgram, "worldLightPosition");
 		if (location >= 0) glUniform4fv(location, 1, &worldLightPosition.v[0]);
 		else printf("uniform worldLightPosition cannot be set\n");
 	}
 
-	void UploadSamplerID()
+	// the atlas textures go to units 0 and 4, clear of the clustered lighting tables
+	void UploadImpostorAttributes(int gridSize, vec3 ka)
 	{
-		int samplerUnit = 0;
-		int location = glGetUniformLocation(shaderProgram, "samplerUnit");
-		glUniform1i(location, samplerUnit);
-		glActiveTexture(GL_TEXTURE0 + samplerUnit);
-	}
+		int location = glGetUniformLocation(shaderProgram, "gridSize");
+		if (location >= 0) glUniform1f(location, (float)gridSize);
+		else printf("uniform gridSize cannot be set\n");
 
-	void UploadM(mat4& M) {
-		int location = glGetUniformLocation(shaderProgram, "M");
-		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, M);
-		else printf("uniform M cannot be set\n");
+		location = glGetUniformLocation(shaderProgram, "albedoAtlas");
+		if (location >= 0) glUniform1i(location, 0);
+		if (shadow) return;
+
+		location = glGetUniformLocation(shaderProgram, "normalDepthAtlas");
+		if (location >= 0) glUniform1i(location, 4);
+
+		location = glGetUniformLocation(shaderProgram, "ka");
+		if (location >= 0) glUniform3f(location, ka.x, ka.y, ka.z);
+		else printf("uniform ka cannot be set\n");
 	}
+};
 
-	void UploadInvM(mat4& InvM)
-	{
-		int location = glGetUniformLocation(shaderProgram, "InvM");
-		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, InvM);
-		else printf("uniform InvM cannot be set\n");
+// top-down minimap drawing: static meshes as flat silhouettes, or markers as round instanced sprites
+// lying on the ground plane
+class MinimapShader : public Shader {
+	bool markers;
+
+public:
+	MinimapShader(bool markers = false) : markers(markers) {
+		const char *vertexTemplate = "\n\
+			#version 130 \n\
+			precision highp float; \n\
+			%s\n\
+			uniform mat4 MVP; \n\
+			uniform vec3 color; \n\
+			in vec3 vertexPosition; \n\
+			in vec3 markerSprite; \n\
+			in vec3 markerColor; \n\
+			\n\
+			out vec3 fragmentTint; \n\
+			out vec2 corner; \n\
+			\n\
+			void main() { \n\
+			#ifdef MARKERS\n\
+			corner = vec2(float(gl_VertexID & 1), float(gl_VertexID >> 1)) * 2.0 - 1.0; \n\
+			fragmentTint = markerColor; \n\
+			gl_Position = vec4(markerSprite.x + corner.x * markerSprite.z, 0, markerSprite.y - corner.y * markerSprite.z, 1) * MVP; \n\
+			#else\n\
+			corner = vec2(0, 0); \n\
+			fragmentTint = color; \n\
+			gl_Position = vec4(vertexPosition, 1) * MVP; \n\
+			#endif\n\
+			} \n\
+		";
+
+		const char *fragmentSource = "\n\
+			#version 130 \n\
+			precision highp float; \n\
+			\n\
+			in vec3 fragmentTint; \n\
+			in vec2 corner; \n\
+			out vec4 fragmentColor; \n\
+			\n\
+			void main() { \n\
+			float r = dot(corner, corner); \n\
+			if (r > 1.0) discard; \n\
+			fragmentColor = vec4(fragmentTint * (r > 0.6 ? 0.3 : 1.0), 1); \n\
+			} \n\
+		";
+
+		char vertexSource[4096];
+		sprintf(vertexSource, vertexTemplate, markers ? "#define MARKERS" : "");
+
+		BuildProgram(vertexSource, fragmentSource);
 	}
 
 	void UploadMVP(mat4& MVP)
@@ -996,754 +2570,6203 @@ public:
 		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, MVP);
 		else printf("uniform MVP cannot be set\n");
 	}
-};
-
 
+	void UploadColor(vec3 color)
+	{
+		if (markers) return;
+		int location = glGetUniformLocation(shaderProgram, "color");
+		if (location >= 0) glUniform3f(location, color.x, color.y, color.z);
+		else printf("uniform color cannot be set\n");
+	}
+};
 
-extern "C" unsigned char* stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp);
-
-class Texture
+// advances every particle by dt and appends the newly emitted ones, all through transform feedback;
+// the geometry shader drops expired particles, so the output buffer stays packed
+class ParticleUpdateShader : public Shader {
+public:
+	ParticleUpdateShader() {
+		const char *vertexSource = "\n\
+			#version 150 \n\
+			\n\
+			in vec4 particlePosition;	// xyz, age \n\
+			in vec4 particleVelocity;	// xyz, lifetime \n\
+			in vec4 particleColor;		// rgb, size \n\
+			uniform float dt; \n\
+			uniform int emitting; \n\
+			uniform uint seed; \n\
+			uniform vec3 emitterPosition, emitterVelocity, emitterColor; \n\
+			uniform float emitterSpread, emitterLifetime, emitterSize; \n\
+			uniform vec3 originShift; \n\
+			uniform float groundHeight; \n\
+			\n\
+			out vec4 position; \n\
+			out vec4 velocity; \n\
+			out vec4 color; \n\
+			\n\
+			float random(uint n) { \n\
+				n = (n ^ 61u) ^ (n >> 16); \n\
+				n *= 9u; \n\
+				n = n ^ (n >> 4); \n\
+				n *= 0x27d4eb2du; \n\
+				n = n ^ (n >> 15); \n\
+				return float(n) / 4294967295.0; \n\
+			} \n\
+			\n\
+			void main() { \n\
+			if (emitting != 0) { \n\
+				uint n = uint(gl_VertexID) * 4u + seed; \n\
+				vec3 r = vec3(random(n), random(n + 1u), random(n + 2u)) * 2.0 - 1.0; \n\
+				position = vec4(emitterPosition, 0); \n\
+				velocity = vec4(emitterVelocity + r * emitterSpread, emitterLifetime * (0.5 + 0.5 * random(n + 3u))); \n\
+				color = vec4(emitterColor, emitterSize); \n\
+				return; \n\
+			} \n\
+			vec3 p = particlePosition.xyz + originShift + particleVelocity.xyz * dt; \n\
+			vec3 v = particleVelocity.xyz * (1.0 - 0.8 * dt) - vec3(0, 2.0, 0) * dt; \n\
+			if (p.y < groundHeight + 0.01 && v.y < 0.0) { \n\
+				p.y = groundHeight + 0.01; \n\
+				v = vec3(v.x * 0.6, -v.y * 0.4, v.z * 0.6); \n\
+			} \n\
+			position = vec4(p, particlePosition.w + dt); \n\
+			velocity = vec4(v, particleVelocity.w); \n\
+			color = particleColor; \n\
+			} \n\
+		";
+
+		const char *geometrySource = "\n\
+			#version 150 \n\
+			\n\
+			layout(points) in; \n\
+			layout(points, max_vertices = 1) out; \n\
+			\n\
+			in vec4 position[]; \n\
+			in vec4 velocity[]; \n\
+			in vec4 color[]; \n\
+			out vec4 feedbackPosition; \n\
+			out vec4 feedbackVelocity; \n\
+			out vec4 feedbackColor; \n\
+			\n\
+			void main() { \n\
+			if (position[0].w >= velocity[0].w) return; \n\
+			feedbackPosition = position[0]; \n\
+			feedbackVelocity = velocity[0]; \n\
+			feedbackColor = color[0]; \n\
+			EmitVertex(); \n\
+			} \n\
+		";
+
+		// never rasterized, the update runs with GL_RASTERIZER_DISCARD
+		const char *fragmentSource = "\n\
+			#version 150 \n\
+			\n\
+			out vec4 fragmentColor; \n\
+			\n\
+			void main() { \n\
+			fragmentColor = vec4(0, 0, 0, 1); \n\
+			} \n\
+		";
+
+		const char* feedbackVaryings[] = { "feedbackPosition", "feedbackVelocity", "feedbackColor" };
+		BuildProgram(vertexSource, fragmentSource, geometrySource, feedbackVaryings, 3);
+	}
+
+	void UploadStep(float dt, unsigned int seed)
+	{
+		int location = glGetUniformLocation(shaderProgram, "dt");
+		if (location >= 0) glUniform1f(location, dt);
+		else printf("uniform dt cannot be set\n");
+
+		location = glGetUniformLocation(shaderProgram, "seed");
+		if (location >= 0) glUniform1ui(location, seed);
+	}
+
+	void UploadEmitting(bool emitting)
+	{
+		int location = glGetUniformLocation(shaderProgram, "emitting");
+		if (location >= 0) glUniform1i(location, emitting ? 1 : 0);
+	}
+
+	void UploadOriginShift(vec3 shift)
+	{
+		int location = glGetUniformLocation(shaderProgram, "originShift");
+		if (location >= 0) glUniform3f(location, shift.x, shift.y, shift.z);
+	}
+
+	void UploadGroundHeight(float height)
+	{
+		int location = glGetUniformLocation(shaderProgram, "groundHeight");
+		if (location >= 0) glUniform1f(location, height);
+	}
+
+	void UploadEmitter(vec3 position, vec3 velocity, vec3 color, float spread, float lifetime, float size)
+	{
+		int location = glGetUniformLocation(shaderProgram, "emitterPosition");
+		if (location >= 0) glUniform3f(location, position.x, position.y, position.z);
+		location = glGetUniformLocation(shaderProgram, "emitterVelocity");
+		if (location >= 0) glUniform3f(location, velocity.x, velocity.y, velocity.z);
+		location = glGetUniformLocation(shaderProgram, "emitterColor");
+		if (location >= 0) glUniform3f(location, color.x, color.y, color.z);
+		location = glGetUniformLocation(shaderProgram, "emitterSpread");
+		if (location >= 0) glUniform1f(location, spread);
+		location = glGetUniformLocation(shaderProgram, "emitterLifetime");
+		if (location >= 0) glUniform1f(location, lifetime);
+		location = glGetUniformLocation(shaderProgram, "emitterSize");
+		if (location >= 0) glUniform1f(location, size);
+	}
+};
+
+// round additive point sprites that fade out over the particle's life
+class ParticleSpriteShader : public Shader {
+public:
+	ParticleSpriteShader() {
+		const char *vertexSource = "\n\
+			#version 130 \n\
+			precision highp float; \n\
+			\n\
+			in vec4 particlePosition; \n\
+			in vec4 particleVelocity; \n\
+			in vec4 particleColor; \n\
+			uniform mat4 VP; \n\
+			uniform float pixelsPerUnit; \n\
+			\n\
+			out vec4 color; \n\
+			\n\
+			void main() { \n\
+			gl_Position = vec4(particlePosition.xyz, 1) * VP; \n\
+			gl_PointSize = max(particleColor.w * pixelsPerUnit / gl_Position.w, 1.0); \n\
+			color = vec4(particleColor.rgb, 1.0 - particlePosition.w / particleVelocity.w); \n\
+			} \n\
+		";
+
+		const char *fragmentSource = "\n\
+			#version 130 \n\
+			precision highp float; \n\
+			\n\
+			in vec4 color; \n\
+			out vec4 fragmentColor; \n\
+			\n\
+			void main() { \n\
+			float d = length(gl_PointCoord * 2.0 - 1.0); \n\
+			if (d > 1.0) discard; \n\
+			fragmentColor = vec4(color.rgb, color.a * (1.0 - d * d)); \n\
+			} \n\
+		";
+
+		BuildProgram(vertexSource, fragmentSource);
+	}
+
+	void UploadVP(mat4& VP)
+	{
+		int location = glGetUniformLocation(shaderProgram, "VP");
+		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, VP);
+		else printf("uniform VP cannot be set\n");
+	}
+
+	void UploadPixelsPerUnit(float pixelsPerUnit)
+	{
+		int location = glGetUniformLocation(shaderProgram, "pixelsPerUnit");
+		if (location >= 0) glUniform1f(location, pixelsPerUnit);
+		else printf("uniform pixelsPerUnit cannot be set\n");
+	}
+};
+
+class InfiniteQuadShader : public Shader {
+	bool clustered, multiView;
+
+public:
+	typedef ParamBlock<DrawUniforms, ModelField, InverseModelField, ModelViewProjectionField, ViewMaskField> DrawParams;
+	typedef ParamBlock<MaterialUniforms, AmbientField, DiffuseField, SpecularField, ShininessField, SamplerField> MaterialParams;
+	DrawParams drawParams;
+	MaterialParams materialParams;
+
+	InfiniteQuadShader(bool clustered = false, bool multiView = false) : Shader(InfiniteQuadShaderClass), clustered(clustered), multiView(multiView) {
+		const char *vertexTemplate = "\n\
+			#version 130 \n\
+			%s\n\
+			precision highp float; \n\
+			%s\n\
+			in vec4 vertexPosition; \n\
+			in vec2 vertexTexCoord; \n\
+			in vec3 vertexNormal; \n\
+			#ifdef MULTI_VIEW\n\
+			uniform mat4 M, InvM; \n\
+			#else\n\
+			uniform mat4 M, InvM, MVP; \n\
+			#endif\n\
+			invariant gl_Position; \n\
+			\n\
+			out vec2 texCoord; \n\
+			out vec4 worldPosition; \n\
+			out vec3 worldNormal; \n\
+			\n\
+			void main() { \n\
+			texCoord = vertexTexCoord; \n\
+			worldPosition = vertexPosition * M; \n\
+			worldNormal = (InvM * vec4(vertexNormal, 0.0)).xyz; \n\
+			#ifdef MULTI_VIEW\n\
+			int view = selectView(); \n\
+			fragmentView = view; \n\
+			gl_Position = placeInView(worldPosition * viewVP[view], view); \n\
+			#else\n\
+			gl_Position = vertexPosition * MVP; \n\
+			#endif\n\
+			} \n\
+		";
+
+		const char *fragmentTemplate = "\n\
+			#version 130 \n\
+			%s\n\
+			precision highp float; \n\
+			%s\n\
+			%s\n\
+			uniform sampler2D samplerUnit; \n\
+			uniform vec3 La, Le; \n\
+			uniform vec3 ka, kd, ks; \n\
+			uniform float shininess; \n\
+			#ifdef MULTI_VIEW\n\
+			#define worldEyePosition viewEye[fragmentView]\n\
+			#else\n\
+			uniform vec3 worldEyePosition; \n\
+			#endif\n\
+			uniform vec4 worldLightPosition; \n\
+			in vec2 texCoord; \n\
+			in vec4 worldPosition; \n\
+			in vec3 worldNormal; \n\
+			out vec4 fragmentColor; \n\
+			void main() { \n\
+			vec3 N = normalize(worldNormal); \n\
+			vec3 V = normalize(worldEyePosition * worldPosition.w - worldPosition.xyz);\n\
+			vec3 L = normalize(worldLightPosition.xyz * worldPosition.w - worldPosition.xyz * worldLightPosition.w);\n\
+			vec3 H = normalize(V + L); \n\
+			vec2 position = worldPosition.xz / worldPosition.w; \n\
+			vec2 tex = position.xy - floor(position.xy); \n\
+			vec3 texel = texture(samplerUnit, tex).xyz; \n\
+			vec3 color = La * ka + Le * kd * texel* max(0.0, dot(L, N)) + Le * ks * pow(max(0.0, dot(H, N)), shininess); \n\
+			#ifdef CLUSTERED\n\
+			color += clusteredLighting(worldPosition.xyz / worldPosition.w, N, kd * texel); \n\
+			#endif\n\
+			fragmentColor = vec4(color, 1); \n\
+			} \n\
+		";
+
+		std::string defines;
+		if (clustered) defines += "#define CLUSTERED\n";
+		if (multiView) defines += multiViewDefines;
+
+		char vertexSource[8192], fragmentSource[8192];
+		sprintf(vertexSource, vertexTemplate, defines.c_str(), multiViewSource);
+		sprintf(fragmentSource, fragmentTemplate, defines.c_str(), multiViewFragmentSource, clusteredLightingSource);
+
+		BuildProgram(vertexSource, fragmentSource);
+	}
+
+	void UploadClusterAttributes(int dimX, int dimY, int dimZ, float tileWidth, float tileHeight, float nearPlane, float farPlane)
+	{
+		if (!clustered) return;
+		uploadClusterUniforms(shaderProgram, dimX, dimY, dimZ, tileWidth, tileHeight, nearPlane, farPlane);
+	}
+
+	void UploadViews(int count, mat4* VP, vec4* rect, vec3* eye)
+	{
+		if (multiView) uploadViewUniforms(shaderProgram, count, VP, rect, eye);
+	}
+
+	void UploadEyePosition(vec3 wEye) {
+		if (multiView) return;
+		int location = glGetUniformLocation(shaderProgram, "worldEyePosition");
+		if (location >= 0) glUniform3f(location, wEye.x, wEye.y, wEye.z);
+		else printf("uniform worldEyePosition cannot be set");
+	}
+
+	void UploadLightAttributes(vec3 La, vec3 Le, vec4 worldLightPosition) {
+		int location = glGetUniformLocation(shaderProgram, "La");
+		if (location >= 0) glUniform3f(location, La.x, La.y, La.z);
+		else printf("uniform La cannot be set\n");
+
+		location = glGetUniformLocation(shaderProgram, "Le");
+		if (location >= 0) glUniform3f(location, Le.x, Le.y, Le.z);
+		else printf("uniform Le cannot be set\n");
+
+		location = glGetUniformLocation(shaderProgram, "worldLightPosition");
+		if (location >= 0) glUniform4fv(location, 1, &worldLightPosition.v[0]);
+		else printf("uniform worldLightPosition cannot be set\n");
+	}
+};
+
+
+// when set, point lights are binned into view-frustum clusters and shaded per fragment
+bool useClusteredLighting = true;
+
+// mesh shader features; each combination compiles to its own program variant
+enum MeshShaderFeature
+{
+	MeshTextured = 1,
+	MeshTextureArray = 2,
+	MeshSpecular = 4,
+	MeshInstanced = 8,
+	MeshClustered = 16,
+	MeshAnimated = 32,
+	MeshMultiView = 64,
+	MeshFeatureCombinations = 128
+};
+
+// a texture array variant must also be textured; animation is per draw and multi-view instances
+// are views, so neither combines with per-object instancing
+constexpr bool validMeshFeatures(unsigned int features)
+{
+	return features < MeshFeatureCombinations && (!(features & MeshTextureArray) || (features & MeshTextured))
+		&& (!(features & MeshAnimated) || !(features & MeshInstanced)) && (!(features & MeshMultiView) || !(features & MeshInstanced));
+}
+
+// whether a variant's programs declare the uniform a field uploads; MeshShader's GLSL declares
+// them under the same conditions
+template<class Field> constexpr bool meshDeclares(unsigned int features) { return false; }
+template<> constexpr bool meshDeclares<NoField>(unsigned int features) { return true; }
+template<> constexpr bool meshDeclares<ModelField>(unsigned int features) { return !(features & MeshInstanced); }
+template<> constexpr bool meshDeclares<InverseModelField>(unsigned int features) { return !(features & MeshInstanced); }
+template<> constexpr bool meshDeclares<ModelViewProjectionField>(unsigned int features)
+{
+	return !(features & (MeshInstanced | MeshAnimated | MeshMultiView));
+}
+template<> constexpr bool meshDeclares<SpinAngleField>(unsigned int features) { return (features & MeshAnimated) != 0; }
+template<> constexpr bool meshDeclares<SpinAxisField>(unsigned int features) { return (features & MeshAnimated) != 0; }
+template<> constexpr bool meshDeclares<ViewMaskField>(unsigned int features) { return (features & MeshMultiView) != 0; }
+template<> constexpr bool meshDeclares<AmbientField>(unsigned int features) { return true; }
+template<> constexpr bool meshDeclares<DiffuseField>(unsigned int features) { return true; }
+template<> constexpr bool meshDeclares<SpecularField>(unsigned int features) { return (features & MeshSpecular) != 0; }
+template<> constexpr bool meshDeclares<ShininessField>(unsigned int features) { return (features & MeshSpecular) != 0; }
+template<> constexpr bool meshDeclares<TextureLayerField>(unsigned int features) { return (features & MeshTextureArray) != 0; }
+template<> constexpr bool meshDeclares<SamplerField>(unsigned int features) { return (features & MeshTextured) != 0; }
+
+template<unsigned int Features>
+constexpr bool meshDeclaresAll() { return true; }
+
+template<unsigned int Features, class Field, class... Rest>
+constexpr bool meshDeclaresAll() { return meshDeclares<Field>(Features) && meshDeclaresAll<Features, Rest...>(); }
+
+// the field if the variant declares its uniform, otherwise nothing
+template<unsigned int Features, class Field>
+using MeshField = typename std::conditional<meshDeclares<Field>(Features), Field, NoField>::type;
+
+// a variant's parameter block, which may only list uniforms the variant declares
+template<unsigned int Features, class Source, class... Fields>
+class MeshParamBlock : public ParamBlock<Source, Fields...>
+{
+	static_assert(meshDeclaresAll<Features, Fields...>(), "the mesh variant does not declare a uniform its parameter block lists");
+};
+
+// the program of one feature set; MeshVariant adds the parameter blocks of its features
+class MeshShader : public Shader
+{
+	unsigned int features;
+
+protected:
+	MeshShader(unsigned int features) : Shader(MeshShaderClass), features(features)
+	{
+		const char *vertexTemplate = "\n\
+			#version 130 \n\
+			%s\n\
+    		precision highp float; \n\
+			%s\n\
+			%s\n\
+			in vec4 vertexPosition; \n\
+			in vec2 vertexTexCoord; \n\
+			in vec3 vertexNormal; \n\
+			invariant gl_Position; \n\
+			#ifdef INSTANCED\n\
+			in vec4 instanceM0, instanceM1, instanceM2, instanceM3; \n\
+			in vec4 instanceInvM0, instanceInvM1, instanceInvM2, instanceInvM3; \n\
+			uniform mat4 VP; \n\
+			#elif defined(MULTI_VIEW)\n\
+			uniform mat4 M, InvM; \n\
+			#define worldEyePosition viewEye[view]\n\
+			#elif defined(ANIMATED)\n\
+			uniform mat4 M, InvM, VP; \n\
+			#else\n\
+			uniform mat4 M, InvM, MVP; \n\
+			#endif\n\
+			#ifndef MULTI_VIEW\n\
+			uniform vec3 worldEyePosition;\n\
+			#endif\n\
+			uniform vec4 worldLightPosition;\n\
+			out vec2 texCoord; \n\
+			out vec3 worldNormal; \n\
+			out vec3 worldView;\n\
+			out vec3 worldLight;\n\
+			#ifdef CLUSTERED\n\
+			out vec3 worldPos;\n\
+			#endif\n\
+			\n\
+			void main() { \n\
+				#ifdef INSTANCED\n\
+				mat4 M = transpose(mat4(instanceM0, instanceM1, instanceM2, instanceM3));\n\
+				mat4 InvM = transpose(mat4(instanceInvM0, instanceInvM1, instanceInvM2, instanceInvM3));\n\
+				mat4 MVP = M * VP;\n\
+				#endif\n\
+				#ifdef MULTI_VIEW\n\
+				int view = selectView();\n\
+				fragmentView = view;\n\
+				#endif\n\
+				texCoord = vertexTexCoord; \n\
+				vec4 worldPosition = vertexPosition * M;\n\
+				#ifdef ANIMATED\n\
+				mat3 spin = spinMatrix();\n\
+				worldPosition = spinAboutOrigin(worldPosition, M, spin);\n\
+				#endif\n\
+				worldLight = worldLightPosition.xyz * worldPosition.w - worldPosition.xyz * worldLightPosition.w;\n\
+				worldView = worldEyePosition - worldPosition.xyz;\n\
+				worldNormal = (InvM * vec4(vertexNormal, 0.0)).xyz;\n\
+				#ifdef CLUSTERED\n\
+				worldPos = worldPosition.xyz;\n\
+				#endif\n\
+				#ifdef ANIMATED\n\
+				worldNormal = spin * worldNormal;\n\
+				#endif\n\
+				#ifdef MULTI_VIEW\n\
+				gl_Position = placeInView(worldPosition * viewVP[view], view);\n\
+				#elif defined(ANIMATED)\n\
+				gl_Position = worldPosition * VP;\n\
+				#else\n\
+				gl_Position = vertexPosition * MVP;\n\
+				#endif\n\
+			} \n\
+		";
+
+		const char *fragmentTemplate = "\n\
+			#version 130 \n\
+			%s\n\
+    		precision highp float; \n\
+			%s\n\
+			%s\n\
+			#ifdef TEXTURE_ARRAY\n\
+			uniform sampler2DArray samplerUnit; \n\
+			uniform float textureLayer; \n\
+			#elif defined(TEXTURED)\n\
+			uniform sampler2D samplerUnit; \n\
+			#endif\n\
+			uniform vec3 La, Le;\n\
+			uniform vec3 ka, kd;\n\
+			#ifdef SPECULAR\n\
+			uniform vec3 ks;\n\
+			uniform float shininess;\n\
+			#endif\n\
+			in vec2 texCoord; \n\
+			in vec3 worldNormal; \n\
+			in vec3 worldView;\n\
+			in vec3 worldLight;\n\
+			#ifdef CLUSTERED\n\
+			in vec3 worldPos;\n\
+			#endif\n\
+			out vec4 fragmentColor; \n\
+			\n\
+			void main() { \n\
+				vec3 N = normalize(worldNormal);\n\
+				vec3 L = normalize(worldLight);\n\
+				#ifdef TEXTURE_ARRAY\n\
+				vec3 texel = texture(samplerUnit, vec3(texCoord, textureLayer)).xyz;\n\
+				#elif defined(TEXTURED)\n\
+				vec3 texel = texture(samplerUnit, texCoord).xyz;\n\
+				#else\n\
+				vec3 texel = vec3(1, 1, 1);\n\
+				#endif\n\
+				vec3 color = La * ka + Le * kd * texel * max(0.0, dot(L, N));\n\
+				#ifdef SPECULAR\n\
+				vec3 V = normalize(worldView);\n\
+				vec3 H = normalize(V + L);\n\
+				color += Le * ks * pow(max(0.0, dot(H, N)), shininess);\n\
+				#endif\n\
+				#ifdef CLUSTERED\n\
+				color += clusteredLighting(worldPos, N, kd * texel);\n\
+				#endif\n\
+				fragmentColor = vec4(color, 1);\n\
+			} \n\
+		";
+
+		std::string defines;
+		if (features & MeshTextured) defines += "#define TEXTURED\n";
+		if (features & MeshTextureArray) defines += "#define TEXTURE_ARRAY\n";
+		if (features & MeshSpecular) defines += "#define SPECULAR\n";
+		if (features & MeshInstanced) defines += "#define INSTANCED\n";
+		if (features & MeshClustered) defines += "#define CLUSTERED\n";
+		if (features & MeshAnimated) defines += "#define ANIMATED\n";
+		if (features & MeshMultiView) defines += multiViewDefines;
+
+		char vertexSource[8192], fragmentSource[8192];
+		sprintf(vertexSource, vertexTemplate, defines.c_str(), features & MeshAnimated ? proceduralAnimationSource : "", multiViewSource);
+		sprintf(fragmentSource, fragmentTemplate, defines.c_str(), multiViewFragmentSource, clusteredLightingSource);
+
+		BuildProgram(vertexSource, fragmentSource);
+	}
+
+public:
+	unsigned int GetFeatures() { return features; }
+
+	// only the specular term looks at the view direction, which multi-view variants take per view
+	void UploadEyePosition(vec3 wEye) {
+		if (!(features & MeshSpecular) || (features & MeshMultiView)) return;
+		int location = glGetUniformLocation(shaderProgram, "worldEyePosition");
+		if (location >= 0) glUniform3f(location, wEye.x, wEye.y, wEye.z);
+		else printf("uniform worldEyePosition cannot be set");
+	}
+
+	void UploadLightAttributes(vec3 La, vec3 Le, vec4 worldLightPosition) {
+		int location = glGetUniformLocation(shaderProgram, "La");
+		if (location >= 0) glUniform3f(location, La.x, La.y, La.z);
+		else printf("uniform La cannot be set\n");
+
+		location = glGetUniformLocation(shaderProgram, "Le");
+		if (location >= 0) glUniform3f(location, Le.x, Le.y, Le.z);
+		else printf("uniform Le cannot be set\n");
+
+		location = glGetUniformLocation(shaderProgram, "worldLightPosition");
+		if (location >= 0) glUniform4fv(location, 1, &worldLightPosition.v[0]);
+		else printf("uniform worldLightPosition cannot be set\n");
+	}
+
+	void UploadClusterAttributes(int dimX, int dimY, int dimZ, float tileWidth, float tileHeight, float nearPlane, float farPlane)
+	{
+		if (!(features & MeshClustered)) return;
+		uploadClusterUniforms(shaderProgram, dimX, dimY, dimZ, tileWidth, tileHeight, nearPlane, farPlane);
+	}
+
+	// instanced and animated variants need VP, multi-view ones have a VP per view instead
+	void UploadVP(mat4& VP)
+	{
+		if (!(features & (MeshInstanced | MeshAnimated)) || (features & MeshMultiView)) return;
+		int location = glGetUniformLocation(shaderProgram, "VP");
+		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, VP);
+		else printf("uniform VP cannot be set\n");
+	}
+
+	void UploadViews(int count, mat4* VP, vec4* rect, vec3* eye)
+	{
+		if (features & MeshMultiView) uploadViewUniforms(shaderProgram, count, VP, rect, eye);
+	}
+};
+
+// a mesh shader variant typed by its feature set: a set no variant exists for does not compile, and
+// its parameter blocks hold exactly the uniforms its programs declare. instanced variants take M
+// and InvM from instance attributes, animated and multi-view ones transform to world space
+// themselves, so only plain variants keep MVP
+template<unsigned int Features>
+class MeshVariant : public MeshShader
+{
+	static_assert(validMeshFeatures(Features), "no mesh shader variant has this feature set");
+
+public:
+	typedef MeshParamBlock<Features, DrawUniforms, MeshField<Features, ModelField>, MeshField<Features, InverseModelField>,
+		MeshField<Features, ModelViewProjectionField>, MeshField<Features, SpinAngleField>, MeshField<Features, SpinAxisField>,
+		MeshField<Features, ViewMaskField>> DrawParams;
+	typedef MeshParamBlock<Features, MaterialUniforms, AmbientField, DiffuseField, MeshField<Features, SpecularField>,
+		MeshField<Features, ShininessField>, MeshField<Features, TextureLayerField>, MeshField<Features, SamplerField>> MaterialParams;
+	DrawParams drawParams;
+	MaterialParams materialParams;
+
+	MeshVariant() : MeshShader(Features) { }
+
+	static MeshShader* Create() { return new MeshVariant<Features>(); }
+};
+
+// a feature set's entry in a table indexed by feature set; invalid slots stay empty, so nothing is
+// instantiated for them
+template<unsigned int Features, bool Valid = validMeshFeatures(Features)>
+struct MeshVariantSlot
+{
+	template<class Table>
+	static typename Table::Entry Get() { return Table::template Make<Features>(); }
+};
+
+template<unsigned int Features>
+struct MeshVariantSlot<Features, false>
+{
+	template<class Table>
+	static typename Table::Entry Get() { return 0; }
+};
+
+template<class Table, unsigned int... Features>
+const typename Table::Entry* meshVariantTable(std::integer_sequence<unsigned int, Features...>)
+{
+	static const typename Table::Entry entries[] = { MeshVariantSlot<Features>::template Get<Table>()... };
+	return entries;
+}
+
+// compiles each mesh shader variant the first time a material asks for it
+class MeshShaderCache
+{
+	MeshShader* variants[MeshFeatureCombinations];
+
+	struct Factories
+	{
+		typedef MeshShader* (*Entry)();
+		template<unsigned int Features>
+		static Entry Make() { return MeshVariant<Features>::Create; }
+	};
+
+public:
+	MeshShaderCache()
+	{
+		for (int i = 0; i < MeshFeatureCombinations; i++) variants[i] = 0;
+	}
+
+	~MeshShaderCache()
+	{
+		for (int i = 0; i < MeshFeatureCombinations; i++) if (variants[i]) delete variants[i];
+	}
+
+	// runtime feature sets index a table with the factory of every valid variant, generated at compile time
+	MeshShader* Get(unsigned int features)
+	{
+		static const Factories::Entry* factories = meshVariantTable<Factories>(std::make_integer_sequence<unsigned int, MeshFeatureCombinations>());
+		if (!validMeshFeatures(features)) { printf("Mesh shader features %u have no variant\n", features); exit(1); }
+		if (!variants[features]) variants[features] = factories[features]();
+		return variants[features];
+	}
+
+	// the cheapest variant that still renders the material's parameters
+	MeshShader* Select(bool textured, bool textureArray, vec3 ks, float shininess)
+	{
+		unsigned int features = 0;
+		if (textured || textureArray) features |= MeshTextured;
+		if (textureArray) features |= MeshTextureArray;
+		if ((ks.x > 0 || ks.y > 0 || ks.z > 0) && shininess > 0) features |= MeshSpecular;
+		if (useClusteredLighting) features |= MeshClustered;
+		return Get(features);
+	}
+
+	// the same variant with procedural animation, for meshes that declare one
+	MeshShader* Animated(MeshShader* shader)
+	{
+		return Get(shader->GetFeatures() | MeshAnimated);
+	}
+
+	// the same variant drawing every split-screen view in one instanced draw
+	MeshShader* MultiView(MeshShader* shader)
+	{
+		return Get(shader->GetFeatures() | MeshMultiView);
+	}
+
+};
+
+
+
+extern "C" unsigned char* stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp);
+extern "C" void stbi_image_free(void *retval_from_stbi_load);
+extern "C" int stbi_info(char const *filename, int *x, int *y, int *comp);
+
+// when set, textures are block-compressed on the CPU once and cached in cacheDirectory
+bool textureCompressionCache = false;
+// when set, mip levels are box-filtered on the CPU instead of with glGenerateMipmap
+bool textureCpuMipmaps = false;
+// when set, textures start with their small levels only and stream the finer ones on demand;
+// off by default, since every texture then needs its level file written on first run
+bool textureStreaming = false;
+// levels up to this size are never evicted, so a streamed texture always has something to sample
+int streamTailSize = 64;
+// budget for the levels of streamed textures, the tails included
+unsigned int textureBudgetBytes = 48 << 20;
+// most anisotropic filtering asked of the driver, which clamps it to its own limit; 1 turns it off
+float textureAnisotropy = 16;
+// counts streaming updates; a texture remembers the last one in which it was drawn
+std::atomic<unsigned int> textureStreamFrame(0);
+
+// the cache file for an image, with path separators flattened so every cache sits in one directory
+std::string textureCacheFileName(const std::string& inputFileName, const char* extension)
+{
+	std::string name = inputFileName;
+	for (int i = 0; i < name.size(); i++)
+		if (name[i] == '/' || name[i] == '\\' || name[i] == ':') name[i] = '_';
+	return cacheFileName(name + extension);
+}
+
+int mipLevelCount(int width, int height)
+{
+	int levels = 1;
+	while (width > 1 || height > 1)
+	{
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
+		levels++;
+	}
+	return levels;
+}
+
+// 2x2 box filter, clamping at the edges so odd sizes work
+unsigned char* downsampleBox(const unsigned char* src, int width, int height, int nComponents, int& outWidth, int& outHeight)
+{
+	outWidth = width > 1 ? width / 2 : 1;
+	outHeight = height > 1 ? height / 2 : 1;
+	unsigned char* dst = new unsigned char[outWidth * outHeight * nComponents];
+
+	for (int y = 0; y < outHeight; y++)
+	{
+		int y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+		for (int x = 0; x < outWidth; x++)
+		{
+			int x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+			for (int c = 0; c < nComponents; c++)
+			{
+				int sum = src[(y0 * width + x0) * nComponents + c] + src[(y0 * width + x1) * nComponents + c]
+					+ src[(y1 * width + x0) * nComponents + c] + src[(y1 * width + x1) * nComponents + c];
+				dst[(y * outWidth + x) * nComponents + c] = (unsigned char)((sum + 2) / 4);
+			}
+		}
+	}
+	return dst;
+}
+
+unsigned short packColor565(const unsigned char* c)
+{
+	return (unsigned short)(((c[0] >> 3) << 11) | ((c[1] >> 2) << 5) | (c[2] >> 3));
+}
+
+void unpackColor565(unsigned short p, int* c)
+{
+	c[0] = ((p >> 11) & 31) * 255 / 31;
+	c[1] = ((p >> 5) & 63) * 255 / 63;
+	c[2] = (p & 31) * 255 / 31;
+}
+
+// BC1 color block from 16 RGBA texels: bounding box endpoints, nearest of the four palette entries
+void encodeBC1Block(const unsigned char block[16][4], unsigned char* out)
+{
+	unsigned char lo[3] = { 255, 255, 255 }, hi[3] = { 0, 0, 0 };
+	for (int i = 0; i < 16; i++)
+		for (int c = 0; c < 3; c++)
+		{
+			lo[c] = std::min(lo[c], block[i][c]);
+			hi[c] = std::max(hi[c], block[i][c]);
+		}
+
+	unsigned short c0 = packColor565(hi), c1 = packColor565(lo);
+	if (c0 < c1) std::swap(c0, c1);
+
+	int palette[4][3];
+	unpackColor565(c0, palette[0]);
+	unpackColor565(c1, palette[1]);
+	for (int c = 0; c < 3; c++)
+	{
+		palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+		palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+	}
+
+	unsigned int indices = 0;
+	if (c0 != c1)
+	{
+		for (int i = 0; i < 16; i++)
+		{
+			int best = 0, bestDist = INT_MAX;
+			for (int p = 0; p < 4; p++)
+			{
+				int dr = block[i][0] - palette[p][0], dg = block[i][1] - palette[p][1], db = block[i][2] - palette[p][2];
+				int dist = dr * dr + dg * dg + db * db;
+				if (dist < bestDist) { bestDist = dist; best = p; }
+			}
+			indices |= best << (2 * i);
+		}
+	}
+
+	out[0] = c0 & 255; out[1] = c0 >> 8;
+	out[2] = c1 & 255; out[3] = c1 >> 8;
+	out[4] = indices & 255; out[5] = (indices >> 8) & 255; out[6] = (indices >> 16) & 255; out[7] = indices >> 24;
+}
+
+// BC3 alpha block: 8-value interpolated ramp between the block's min and max alpha
+void encodeBC3AlphaBlock(const unsigned char block[16][4], unsigned char* out)
+{
+	int a0 = 0, a1 = 255;
+	for (int i = 0; i < 16; i++)
+	{
+		a0 = std::max(a0, (int)block[i][3]);
+		a1 = std::min(a1, (int)block[i][3]);
+	}
+
+	int ramp[8] = { a0, a1 };
+	for (int i = 1; i < 7; i++) ramp[i + 1] = ((7 - i) * a0 + i * a1) / 7;
+
+	unsigned long long indices = 0;
+	if (a0 != a1)
+	{
+		for (int i = 0; i < 16; i++)
+		{
+			int best = 0, bestDist = INT_MAX;
+			for (int p = 0; p < 8; p++)
+			{
+				int dist = abs(block[i][3] - ramp[p]);
+				if (dist < bestDist) { bestDist = dist; best = p; }
+			}
+			indices |= (unsigned long long)best << (3 * i);
+		}
+	}
+
+	out[0] = (unsigned char)a0;
+	out[1] = (unsigned char)a1;
+	for (int i = 0; i < 6; i++) out[2 + i] = (indices >> (8 * i)) & 255;
+}
+
+// compresses one mip level; returns the size in bytes written to out
+int encodeBlockCompressed(const unsigned char* data, int width, int height, int nComponents, bool alpha, std::vector<unsigned char>& out)
+{
+	int blockBytes = alpha ? 16 : 8;
+	int start = (int)out.size();
+	out.resize(start + ((width + 3) / 4) * ((height + 3) / 4) * blockBytes);
+	unsigned char* dst = &out[start];
+
+	for (int by = 0; by < height; by += 4)
+	{
+		for (int bx = 0; bx < width; bx += 4)
+		{
+			unsigned char block[16][4];
+			for (int i = 0; i < 16; i++)
+			{
+				int x = std::min(bx + i % 4, width - 1), y = std::min(by + i / 4, height - 1);
+				const unsigned char* texel = &data[(y * width + x) * nComponents];
+				block[i][0] = texel[0]; block[i][1] = texel[1]; block[i][2] = texel[2];
+				block[i][3] = nComponents == 4 ? texel[3] : 255;
+			}
+			if (alpha)
+			{
+				encodeBC3AlphaBlock(block, dst);
+				dst += 8;
+			}
+			encodeBC1Block(block, dst);
+			dst += 8;
+		}
+	}
+	return (int)out.size() - start;
+}
+
+class Texture
+{
+	GLTexture textureId;
+	int width, height, levels;
+	unsigned int vramBytes;
+	std::string fileName;
+
+	// the source's size and modification time are stored so an edited image rebuilds its cache
+	struct CacheHeader
+	{
+		char magic[4];
+		int format, width, height, levels;
+		long long sourceSize, sourceTime;
+	};
+
+	// streaming state; the level file holds the whole chain, the GL texture only levels from
+	// residentLevel down, which is also its base level
+	bool streamed;
+	std::string streamFileName;
+	CacheHeader streamHeader;
+	std::vector<long> levelOffsets;
+	int residentLevel, tailLevel;
+	bool loading;
+	std::atomic<int> requestedLevel;
+	std::atomic<unsigned int> lastUsedFrame;
+
+	void StampSource(CacheHeader& header)
+	{
+		struct stat info;
+		header.sourceSize = header.sourceTime = -1;
+		if (stat(fileName.c_str(), &info) == 0)
+		{
+			header.sourceSize = (long long)info.st_size;
+			header.sourceTime = (long long)info.st_mtime;
+		}
+	}
+
+	// bytes of the whole chain the header describes, or -1 if it describes no valid chain
+	static long ChainBytes(const CacheHeader& header)
+	{
+		int blockBytes, texelBytes;
+		switch (header.format)
+		{
+		case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT: blockBytes = 16; texelBytes = 0; break;
+		case GL_COMPRESSED_RGB_S3TC_DXT1_EXT: blockBytes = 8; texelBytes = 0; break;
+		case GL_RGBA8: blockBytes = 0; texelBytes = 4; break;
+		case GL_RGB8: blockBytes = 0; texelBytes = 3; break;
+		default: return -1;
+		}
+		if (header.width <= 0 || header.height <= 0 || header.width > 16384 || header.height > 16384) return -1;
+		if (header.levels < 1 || header.levels > mipLevelCount(header.width, header.height)) return -1;
+
+		long bytes = 0;
+		int w = header.width, h = header.height;
+		for (int level = 0; level < header.levels; level++)
+		{
+			if (blockBytes) bytes += (long)((w + 3) / 4) * ((h + 3) / 4) * blockBytes;
+			else bytes += (long)w * h * texelBytes;
+			w = w > 1 ? w / 2 : 1;
+			h = h > 1 ? h / 2 : 1;
+		}
+		return bytes;
+	}
+
+	// a cache file is used only if it was built from the current source and holds exactly the chain
+	// its header describes
+	bool CheckCache(FILE* file, const CacheHeader& header, long& payload)
+	{
+		CacheHeader source;
+		StampSource(source);
+		if (memcmp(header.magic, "BCTX", 4) != 0 || header.sourceSize != source.sourceSize || header.sourceTime != source.sourceTime) return false;
+
+		payload = ChainBytes(header);
+		fseek(file, 0, SEEK_END);
+		long size = ftell(file) - (long)sizeof(header);
+		fseek(file, sizeof(header), SEEK_SET);
+		if (payload <= 0 || size != payload)
+		{
+			printf("Texture cache for %s does not match its header, rebuilding\n", fileName.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	bool LoadCompressedCache(const std::string& cacheFileName, std::vector<unsigned char>& blocks, CacheHeader& header)
+	{
+		FILE* file = fopen(cacheFileName.c_str(), "rb");
+		if (!file) return false;
+
+		long size = 0;
+		bool ok = fread(&header, sizeof(header), 1, file) == 1 && CheckCache(file, header, size);
+		if (ok)
+		{
+			blocks.resize(size);
+			ok = fread(&blocks[0], size, 1, file) == 1;
+		}
+		fclose(file);
+		return ok;
+	}
+
+	void UploadCompressed(const CacheHeader& header, const std::vector<unsigned char>& blocks)
+	{
+		int blockBytes = header.format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT ? 16 : 8;
+		int w = header.width, h = header.height;
+		size_t offset = 0;
+
+		if (GLEW_ARB_texture_storage) glTexStorage2D(GL_TEXTURE_2D, header.levels, header.format, w, h);
+		for (int level = 0; level < header.levels; level++)
+		{
+			int size = ((w + 3) / 4) * ((h + 3) / 4) * blockBytes;
+			if (GLEW_ARB_texture_storage) glCompressedTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, w, h, header.format, size, &blocks[offset]);
+			else glCompressedTexImage2D(GL_TEXTURE_2D, level, header.format, w, h, 0, size, &blocks[offset]);
+			offset += size;
+			w = w > 1 ? w / 2 : 1;
+			h = h > 1 ? h / 2 : 1;
+		}
+		vramBytes = (unsigned int)offset;
+	}
+
+	// the whole mip chain, block-compressed or raw, laid out level after level as in the cache files
+	void EncodeLevels(unsigned char* data, int nComponents, bool compressed, CacheHeader& header, std::vector<unsigned char>& blocks)
+	{
+		header.magic[0] = 'B'; header.magic[1] = 'C'; header.magic[2] = 'T'; header.magic[3] = 'X';
+		if (compressed) header.format = nComponents == 4 ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+		else header.format = nComponents == 4 ? GL_RGBA8 : GL_RGB8;
+		header.width = width; header.height = height; header.levels = levels;
+		StampSource(header);
+
+		unsigned char* level = data;
+		int w = width, h = height;
+		for (int i = 0; i < levels; i++)
+		{
+			if (compressed) encodeBlockCompressed(level, w, h, nComponents, nComponents == 4, blocks);
+			else blocks.insert(blocks.end(), level, level + w * h * nComponents);
+			if (i + 1 < levels)
+			{
+				unsigned char* next = downsampleBox(level, w, h, nComponents, w, h);
+				if (level != data) delete[] level;
+				level = next;
+			}
+		}
+		if (level != data) delete[] level;
+	}
+
+	void WriteCache(const std::string& cacheFileName, const CacheHeader& header, const std::vector<unsigned char>& blocks)
+	{
+		FILE* file = fopen(cacheFileName.c_str(), "wb");
+		if (file)
+		{
+			fwrite(&header, sizeof(header), 1, file);
+			fwrite(&blocks[0], blocks.size(), 1, file);
+			fclose(file);
+		}
+	}
+
+	bool ReadStreamHeader()
+	{
+		FILE* file = fopen(streamFileName.c_str(), "rb");
+		if (!file) return false;
+		long size = 0;
+		bool ok = fread(&streamHeader, sizeof(streamHeader), 1, file) == 1 && CheckCache(file, streamHeader, size);
+		fclose(file);
+		return ok;
+	}
+
+	bool IsBlockCompressed() { return streamHeader.format != GL_RGBA8 && streamHeader.format != GL_RGB8; }
+
+	int LevelBytes(int level)
+	{
+		int w = std::max(1, width >> level), h = std::max(1, height >> level);
+		if (IsBlockCompressed()) return ((w + 3) / 4) * ((h + 3) / 4) * (streamHeader.format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT ? 16 : 8);
+		return w * h * (streamHeader.format == GL_RGBA8 ? 4 : 3);
+	}
+
+	// streamed textures read their levels from a file holding the whole chain, written on first use;
+	// only the tail of small levels is loaded here
+	bool InitializeStreaming(const std::string& inputFileName, bool compressed)
+	{
+		streamFileName = textureCacheFileName(inputFileName, compressed ? ".bctx" : ".mips");
+		if (!ReadStreamHeader())
+		{
+			int nComponents = 4;
+			unsigned char* data = stbi_load(inputFileName.c_str(), &width, &height, &nComponents, 0);
+			if (data == NULL) return false;
+			levels = mipLevelCount(width, height);
+
+			std::vector<unsigned char> blocks;
+			EncodeLevels(data, nComponents, compressed, streamHeader, blocks);
+			stbi_image_free(data);
+			WriteCache(streamFileName, streamHeader, blocks);
+		}
+		width = streamHeader.width; height = streamHeader.height; levels = streamHeader.levels;
+
+		long offset = sizeof(CacheHeader);
+		for (int level = 0; level <= levels; level++)
+		{
+			levelOffsets.push_back(offset);
+			if (level < levels) offset += LevelBytes(level);
+		}
+
+		tailLevel = 0;
+		while (tailLevel < levels - 1 && std::max(width >> tailLevel, height >> tailLevel) > streamTailSize) tailLevel++;
+
+		std::vector<unsigned char> tail(levelOffsets[levels] - levelOffsets[tailLevel]);
+		FILE* file = fopen(streamFileName.c_str(), "rb");
+		if (!file) return false;
+		fseek(file, levelOffsets[tailLevel], SEEK_SET);
+		bool ok = fread(&tail[0], tail.size(), 1, file) == 1;
+		fclose(file);
+		if (!ok) return false;
+
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+		residentLevel = levels;
+		for (int level = levels - 1; level >= tailLevel; level--) UploadLevel(level, &tail[levelOffsets[level] - levelOffsets[tailLevel]]);
+		streamed = true;
+		return true;
+	}
+
+public:
+	Texture(const std::string& inputFileName) : fileName(inputFileName)
+	{
+		unsigned char* data;
+		int nComponents = 4;
+		width = height = levels = 0;
+		vramBytes = 0;
+		streamed = loading = false;
+		residentLevel = tailLevel = 0;
+		requestedLevel = INT_MAX;
+		lastUsedFrame = 0;
+
+		textureId.Create();
+		glBindTexture(GL_TEXTURE_2D, textureId);
+
+		std::vector<unsigned char> blocks;
+		CacheHeader header;
+		bool compressed = textureCompressionCache && GLEW_EXT_texture_compression_s3tc;
+		std::string cacheFileName = compressed ? textureCacheFileName(inputFileName, ".bctx") : "";
+
+		if (textureStreaming && InitializeStreaming(inputFileName, compressed)) { }
+		else if (compressed && LoadCompressedCache(cacheFileName, blocks, header))
+		{
+			width = header.width; height = header.height; levels = header.levels;
+			UploadCompressed(header, blocks);
+		}
+		else
+		{
+			data = stbi_load(inputFileName.c_str(), &width, &height, &nComponents, 0);
+
+			if (data == NULL)
+			{
+				return;
+			}
+
+			levels = mipLevelCount(width, height);
+			unsigned int format = nComponents == 4 ? GL_RGBA : GL_RGB;
+			unsigned int internalFormat = nComponents == 4 ? GL_RGBA8 : GL_RGB8;
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+			if (compressed)
+			{
+				EncodeLevels(data, nComponents, true, header, blocks);
+				WriteCache(cacheFileName, header, blocks);
+				UploadCompressed(header, blocks);
+			}
+			else
+			{
+				if (GLEW_ARB_texture_storage)
+				{
+					glTexStorage2D(GL_TEXTURE_2D, levels, internalFormat, width, height);
+					glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, GL_UNSIGNED_BYTE, data);
+				}
+				else glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, GL_UNSIGNED_BYTE, data);
+
+				if (textureCpuMipmaps)
+				{
+					unsigned char* level = data;
+					int w = width, h = height;
+					for (int i = 1; i < levels; i++)
+					{
+						unsigned char* next = downsampleBox(level, w, h, nComponents, w, h);
+						if (level != data) delete[] level;
+						level = next;
+						if (GLEW_ARB_texture_storage) glTexSubImage2D(GL_TEXTURE_2D, i, 0, 0, w, h, format, GL_UNSIGNED_BYTE, level);
+						else glTexImage2D(GL_TEXTURE_2D, i, internalFormat, w, h, 0, format, GL_UNSIGNED_BYTE, level);
+					}
+					if (level != data) delete[] level;
+				}
+				else glGenerateMipmap(GL_TEXTURE_2D);
+
+				// drivers pad RGB8 to four bytes per texel
+				unsigned int w = width, h = height;
+				for (int i = 0; i < levels; i++)
+				{
+					vramBytes += w * h * 4;
+					w = w > 1 ? w / 2 : 1;
+					h = h > 1 ? h / 2 : 1;
+				}
+			}
+
+			stbi_image_free(data);
+		}
+
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+		if (GLEW_EXT_texture_filter_anisotropic)
+		{
+			float maxAnisotropy = 1;
+			glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &maxAnisotropy);
+			glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, std::max(1.0f, std::min(maxAnisotropy, textureAnisotropy)));
+		}
+
+		// the old path uploaded level 0 only, padded to four bytes per texel
+		printf("Texture %s: %dx%d, %d levels%s, VRAM %.1f KB (level 0 only: %.1f KB)\n", inputFileName.c_str(),
+			width, height, levels, compressed ? " (block compressed)" : streamed ? " (streamed)" : "", vramBytes / 1024.0f, width * height * 4 / 1024.0f);
+	}
+
+	unsigned int GetVramBytes() { return vramBytes; }
+
+	bool IsStreamed() { return streamed; }
+	const std::string& GetFileName() { return fileName; }
+	int GetResidentLevel() { return residentLevel; }
+	int GetTailLevel() { return tailLevel; }
+	bool IsLoading() { return loading; }
+	void SetLoading(bool value) { loading = value; }
+	unsigned int GetLastUsedFrame() { return lastUsedFrame; }
+	const std::string& GetStreamFileName() { return streamFileName; }
+	long GetLevelOffset(int level) { return levelOffsets[level]; }
+
+	// drivers pad RGB8 to four bytes per texel
+	unsigned int LevelVramBytes(int level)
+	{
+		if (IsBlockCompressed()) return LevelBytes(level);
+		return std::max(1, width >> level) * std::max(1, height >> level) * 4;
+	}
+
+	// called from the draw recorder's workers with the on-screen size of an object using this texture;
+	// keeps the finest level asked for since the last streaming update
+	void RequestDetail(float pixels)
+	{
+		int level = 0;
+		float size = (float)std::max(width, height);
+		while (level < levels - 1 && size > 2 * pixels) { size *= 0.5f; level++; }
+
+		int current = requestedLevel;
+		while (level < current && !requestedLevel.compare_exchange_weak(current, level)) { }
+		lastUsedFrame = textureStreamFrame.load();
+	}
+
+	// the finest level wanted since the last call, or the tail if the texture was not drawn
+	int TakeRequestedLevel()
+	{
+		int level = requestedLevel.exchange(INT_MAX);
+		return level == INT_MAX ? tailLevel : level;
+	}
+
+	// adds the next finer level and lets sampling reach it
+	void UploadLevel(int level, const unsigned char* data)
+	{
+		int w = std::max(1, width >> level), h = std::max(1, height >> level);
+		glBindTexture(GL_TEXTURE_2D, textureId);
+		if (IsBlockCompressed()) glCompressedTexImage2D(GL_TEXTURE_2D, level, streamHeader.format, w, h, 0, LevelBytes(level), data);
+		else
+		{
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+			glTexImage2D(GL_TEXTURE_2D, level, streamHeader.format, w, h, 0, streamHeader.format == GL_RGBA8 ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE, data);
+		}
+		residentLevel = level;
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, residentLevel);
+		vramBytes += LevelVramBytes(level);
+	}
+
+	// drops the finest resident level; sampling moves to the next one before its storage goes away
+	void EvictLevel()
+	{
+		int level = residentLevel++;
+		glBindTexture(GL_TEXTURE_2D, textureId);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, residentLevel);
+		glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8, 0, 0, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		vramBytes -= LevelVramBytes(level);
+	}
+
+	void Bind()
+	{
+		glBindTexture(GL_TEXTURE_2D, textureId);
+	}
+};
+
+
+// loads finer levels of streamed textures on loader threads and uploads them one level at a time
+// on the GL thread; when a level does not fit the budget, the least recently drawn textures give up
+// their finest levels first, but never their tails
+class TextureStreamer
+{
+	struct LoadRequest
+	{
+		Texture* texture;
+		int level;
+	};
+
+	struct LoadResult
+	{
+		Texture* texture;
+		int level;
+		std::vector<unsigned char> data;
+	};
+
+	std::vector<Texture*> textures;
+	std::vector<int> wantedLevels;
+
+	std::vector<std::thread> loaders;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::vector<LoadRequest> requests;
+	std::vector<LoadResult> results, finished;
+	bool stopping;
+	int pending;
+
+	void Load()
+	{
+		for (;;)
+		{
+			LoadRequest request;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [this] { return stopping || !requests.empty(); });
+				if (stopping) return;
+				request = requests.front();
+				requests.erase(requests.begin());
+			}
+
+			LoadResult result;
+			result.texture = request.texture;
+			result.level = request.level;
+			long offset = request.texture->GetLevelOffset(request.level);
+			result.data.resize(request.texture->GetLevelOffset(request.level + 1) - offset);
+
+			FILE* file = fopen(request.texture->GetStreamFileName().c_str(), "rb");
+			bool ok = file != NULL;
+			if (ok) {
+				fseek(file, offset, SEEK_SET);
+				ok = fread(&result.data[0], result.data.size(), 1, file) == 1;
+				fclose(file);
+			}
+			if (!ok) result.data.clear();
+
+			std::lock_guard<std::mutex> lock(mutex);
+			results.push_back(std::move(result));
+		}
+	}
+
+	// evicts from textures drawn less recently than the one that needs room, or from ones holding
+	// more detail than they were last asked for
+	bool MakeRoom(unsigned int bytes, int keep)
+	{
+		while (residentBytes + bytes > textureBudgetBytes)
+		{
+			int victim = -1;
+			for (int i = 0; i < textures.size(); i++)
+			{
+				Texture* t = textures[i];
+				if (i == keep || t->IsLoading() || t->GetResidentLevel() >= t->GetTailLevel()) continue;
+				bool older = t->GetLastUsedFrame() < textures[keep]->GetLastUsedFrame();
+				bool overDetailed = t->GetResidentLevel() < wantedLevels[i];
+				if (!older && !overDetailed) continue;
+				if (victim < 0 || t->GetLastUsedFrame() < textures[victim]->GetLastUsedFrame()) victim = i;
+			}
+			if (victim < 0) return false;
+
+			residentBytes -= textures[victim]->LevelVramBytes(textures[victim]->GetResidentLevel());
+			textures[victim]->EvictLevel();
+			renderStats.textureEvictions++;
+		}
+		return true;
+	}
+
+public:
+	unsigned int residentBytes;
+
+	TextureStreamer(int loaderCount = 2)
+	{
+		stopping = false;
+		pending = 0;
+		residentBytes = 0;
+		for (int i = 0; i < loaderCount; i++) loaders.push_back(std::thread(&TextureStreamer::Load, this));
+	}
+
+	~TextureStreamer()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (int i = 0; i < loaders.size(); i++) loaders[i].join();
+	}
+
+	void Add(Texture* texture)
+	{
+		if (!texture->IsStreamed()) return;
+		textures.push_back(texture);
+		wantedLevels.push_back(texture->GetTailLevel());
+		residentBytes += texture->GetVramBytes();
+	}
+
+	int GetPendingCount() { return pending; }
+
+	// once per frame, after the draw recorder has gathered the levels visible objects need
+	void Update()
+	{
+		textureStreamFrame++;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			finished.swap(results);
+		}
+		for (int i = 0; i < finished.size(); i++)
+		{
+			LoadResult& result = finished[i];
+			Texture* texture = result.texture;
+			int index = (int)(std::find(textures.begin(), textures.end(), texture) - textures.begin());
+			unsigned int bytes = texture->LevelVramBytes(result.level);
+			texture->SetLoading(false);
+			pending--;
+			if (result.data.empty() || !MakeRoom(bytes, index)) continue;
+			texture->UploadLevel(result.level, &result.data[0]);
+			residentBytes += bytes;
+			renderStats.textureLoads++;
+		}
+		finished.clear();
+
+		bool queued = false;
+		for (int i = 0; i < textures.size(); i++)
+		{
+			Texture* texture = textures[i];
+			wantedLevels[i] = texture->TakeRequestedLevel();
+			if (texture->IsLoading() || wantedLevels[i] >= texture->GetResidentLevel()) continue;
+
+			// one level at a time, so the resident chain never has holes; room is made before reading
+			// so a level that cannot fit is not read from disk again every frame
+			if (!MakeRoom(texture->LevelVramBytes(texture->GetResidentLevel() - 1), i)) continue;
+			LoadRequest request;
+			request.texture = texture;
+			request.level = texture->GetResidentLevel() - 1;
+			texture->SetLoading(true);
+			pending++;
+			queued = true;
+
+			std::lock_guard<std::mutex> lock(mutex);
+			requests.push_back(request);
+		}
+		if (queued) wake.notify_all();
+
+		renderStats.textureResidentBytes = residentBytes;
+		renderStats.textureBudgetBytes = textureBudgetBytes;
+		renderStats.texturePending = pending;
+	}
+};
+
+TextureStreamer* textureStreamer;
+
+
+// when set, mesh materials whose images have the same size and format sample layers of one texture
+// array instead of separate textures
+bool useTextureArray = false;
+
+class TextureArray
+{
+	GLTexture textureId;
+	int width, height, nComponents;
+	std::vector<unsigned char*> layers;
+	std::vector<std::string> layerFileNames;
+
+	static unsigned int boundTextureId;
+
+public:
+	TextureArray(int width, int height, int nComponents) : width(width), height(height), nComponents(nComponents) { }
+
+	~TextureArray()
+	{
+		for (unsigned int i = 0; i < layers.size(); i++) delete[] layers[i];
+		if (boundTextureId == textureId) boundTextureId = 0;
+	}
+
+	// whether an image of this size and format can be a layer, uploaded as it is
+	bool Matches(int w, int h, int components) { return w == width && h == height && components == nComponents; }
+
+	// loads an image whose size and format match the array's; returns its layer index
+	int AddLayer(const std::string& inputFileName)
+	{
+		layerFileNames.push_back(inputFileName);
+		int w, h, components;
+		unsigned char* data = stbi_load(inputFileName.c_str(), &w, &h, &components, 0);
+		unsigned char* layer = new unsigned char[width * height * nComponents]();
+		if (data != NULL && Matches(w, h, components)) memcpy(layer, data, width * height * nComponents);
+		else printf("Texture array layer %s could not be loaded as %dx%d\n", inputFileName.c_str(), width, height);
+		if (data != NULL) stbi_image_free(data);
+
+		layers.push_back(layer);
+		return (int)layers.size() - 1;
+	}
+
+	void Finalize()
+	{
+		int levels = mipLevelCount(width, height);
+		int depth = (int)layers.size();
+		unsigned int format = nComponents == 4 ? GL_RGBA : GL_RGB;
+		unsigned int internalFormat = nComponents == 4 ? GL_RGBA8 : GL_RGB8;
+
+		textureId.Create();
+		glBindTexture(GL_TEXTURE_2D_ARRAY, textureId);
+		boundTextureId = textureId;
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+		if (GLEW_ARB_texture_storage) glTexStorage3D(GL_TEXTURE_2D_ARRAY, levels, internalFormat, width, height, depth);
+		else glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, internalFormat, width, height, depth, 0, format, GL_UNSIGNED_BYTE, NULL);
+
+		for (int i = 0; i < depth; i++)
+		{
+			glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, i, width, height, 1, format, GL_UNSIGNED_BYTE, layers[i]);
+			delete[] layers[i];
+		}
+		layers.clear();
+
+		glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+		printf("Texture array: %d layers of %dx%d, %s\n", depth, width, height, nComponents == 4 ? "RGBA" : "RGB");
+	}
+
+	const std::string& GetLayerFileName(int layer) { return layerFileNames[layer]; }
+
+	int FindLayer(const std::string& inputFileName)
+	{
+		for (int i = 0; i < layerFileNames.size(); i++) if (layerFileNames[i] == inputFileName) return i;
+		return -1;
+	}
+
+	// materials of the same array share its binding, so only the first draw after a switch binds
+	void Bind()
+	{
+		if (boundTextureId == textureId) return;
+		glBindTexture(GL_TEXTURE_2D_ARRAY, textureId);
+		boundTextureId = textureId;
+	}
+};
+
+unsigned int TextureArray::boundTextureId = 0;
+
+
+class Light {
+	vec3 La;
+	vec3 Le;
+	vec4 worldLightPosition;
+	
+
+public:
+	Light() :
+		La(1.0, 1.0, 1.0),
+		Le(1.0, 1.0, 1.0),
+		worldLightPosition(0, 0, 2.0, 1.0)
+	{}
+
+	Light(vec3 La, vec3 Le, vec4 worldLightPosition) {
+		this->La = La;
+		this->Le = Le;
+		this->worldLightPosition = worldLightPosition;
+	}
+
+	void UploadAttributes(Shader* shader) {
+		shader->UploadLightAttributes(La, Le, worldLightPosition);
+	}
+
+	void SetPointLightSource(vec3& pos) {
+		worldLightPosition.v[0] = pos.x;
+		worldLightPosition.v[1] = pos.y;
+		worldLightPosition.v[2] = pos.z;
+		worldLightPosition.v[3] = 1.0;
+	}
+
+	vec4 GetWorldPosition() { return worldLightPosition; }
+	vec3 GetLa() { return La; }
+	vec3 GetLe() { return Le; }
+
+	void SetDirectionalLightSource(vec3& dir) {
+		worldLightPosition.v[0] = dir.x;
+		worldLightPosition.v[1] = dir.y;
+		worldLightPosition.v[2] = dir.z;
+		worldLightPosition.v[3] = 0.0;
+	}
+};
+
+class Material
+{
+	Shader* shader;
+	Texture* texture;
+	TextureArray* textureArray;
+	int textureLayer;
+	vec3 ka;
+	vec3 kd;
+	vec3 ks;
+	float shininess;
+
+
+public:
+	Material(Shader* s, vec3 ka, vec3 kd, vec3 ks, float shininess, Texture* t = 0)
+	{
+		shader = s;
+		texture = t;
+		textureArray = 0;
+		textureLayer = -1;
+		this->ka = ka;
+		this->kd = kd;
+		this->ks = ks;
+		this->shininess = shininess;
+	}
+
+	Material(Shader* s, vec3 ka, vec3 kd, vec3 ks, float shininess, TextureArray* a, int layer)
+	{
+		shader = s;
+		texture = 0;
+		textureArray = a;
+		textureLayer = layer;
+		this->ka = ka;
+		this->kd = kd;
+		this->ks = ks;
+		this->shininess = shininess;
+	}
+
+	// mesh materials pick the cheapest mesh shader variant for their parameters
+	Material(MeshShaderCache* shaders, vec3 ka, vec3 kd, vec3 ks, float shininess, Texture* t = 0)
+	{
+		shader = shaders->Select(t != 0, false, ks, shininess);
+		texture = t;
+		textureArray = 0;
+		textureLayer = -1;
+		this->ka = ka;
+		this->kd = kd;
+		this->ks = ks;
+		this->shininess = shininess;
+	}
+
+	Material(MeshShaderCache* shaders, vec3 ka, vec3 kd, vec3 ks, float shininess, TextureArray* a, int layer)
+	{
+		shader = shaders->Select(true, true, ks, shininess);
+		texture = 0;
+		textureArray = a;
+		textureLayer = layer;
+		this->ka = ka;
+		this->kd = kd;
+		this->ks = ks;
+		this->shininess = shininess;
+	}
+
+	Shader* GetShader() { return shader; }
+
+	void RequestTextureDetail(float pixels)
+	{
+		if (texture && texture->IsStreamed()) texture->RequestDetail(pixels);
+	}
+
+	vec3 GetAmbient() { return ka; }
+	vec3 GetDiffuse() { return kd; }
+	vec3 GetSpecular() { return ks; }
+	float GetShininess() { return shininess; }
+	bool UsesTextureArray() { return textureArray != 0; }
+
+	// the image the texture or texture layer was loaded from, empty for untextured materials
+	std::string GetTextureFileName()
+	{
+		if (texture) return texture->GetFileName();
+		if (textureArray) return textureArray->GetLayerFileName(textureLayer);
+		return std::string();
+	}
+
+	// the typed draw path: the program's material block, then the texture on the unit its sampler reads
+	template<class ShaderT>
+	void Bind(ShaderT* target)
+	{
+		MaterialUniforms uniforms = { ka, kd, ks, shininess, (float)textureLayer, 0 };
+		target->materialParams.Upload(uniforms);
+		glActiveTexture(GL_TEXTURE0 + uniforms.samplerUnit);
+		if (texture) texture->Bind();
+		else if (textureArray) textureArray->Bind();
+	}
+
+	// for programs drawn outside the recorder, like the impostor bake
+	void UploadAttributes(Shader* target)
+	{
+		target->UploadMaterialAttributes(ka, kd, ks, shininess);
+		if (texture)
+		{
+			target->UploadSamplerID();
+			texture->Bind();
+		}
+		else if (textureArray)
+		{
+			target->UploadSamplerID();
+			target->UploadTextureLayer(textureLayer);
+			textureArray->Bind();
+		}
+	}
+};
+
+class ImpostorAtlas;
+
+// time-driven motion shared by every object of a mesh, evaluated by the animated shader variants
+struct ProceduralAnimation
+{
+	float spinRate;	// degrees per second about the object's rotation axis
+
+	ProceduralAnimation(float spinRate) : spinRate(spinRate) { }
+};
+
+// the spin in degrees at a time, wrapped in double precision so it stays exact however long the
+// program runs; the shaders and the software renderer get the wrapped angle
+float wrappedSpinAngle(const ProceduralAnimation* animation, float phase, double time)
+{
+	double angle = fmod((double)animation->spinRate * time + phase, 360.0);
+	return (float)(angle < 0 ? angle + 360.0 : angle);
+}
+
+class Mesh
+{
+	// a geometry range drawn with a material of its own, and the programs for it
+	struct RangeMaterial
+	{
+		Material* material;
+		Shader* shader;
+		Shader* multiViewShader;
+	};
+
+	Geometry* geometry;
+	Material* material;
+	ImpostorAtlas* impostor;
+	const ProceduralAnimation* animation;
+	Shader* animatedShader;
+	Shader* multiViewShader;
+	std::vector<RangeMaterial> ranges;
+
+public:
+	Mesh(Geometry* g, Material* m)
+	{
+		geometry = g;
+		material = m;
+		impostor = 0;
+		animation = 0;
+		animatedShader = 0;
+		multiViewShader = 0;
+		RangeMaterial own = { 0, 0, 0 };
+		ranges.resize(g->GetRangeCount(), own);
+	}
+
+	Shader* GetShader() { return animation ? animatedShader : material->GetShader(); }
+	const ProceduralAnimation* GetAnimation() { return animation; }
+
+	// the shader is the animated variant of the material's
+	void SetAnimation(const ProceduralAnimation* a, Shader* shader)
+	{
+		animation = a;
+		animatedShader = shader;
+	}
+
+	// the variant of GetShader's program that draws all split-screen views at once
+	Shader* GetMultiViewShader() { return multiViewShader; }
+	void SetMultiViewShader(Shader* shader) { multiViewShader = shader; }
+
+	Geometry* GetGeometry() { return geometry; }
+	Material* GetMaterial() { return material; }
+	ImpostorAtlas* GetImpostor() { return impostor; }
+	void SetImpostor(ImpostorAtlas* atlas) { impostor = atlas; }
+
+	// ranges without a material of their own are drawn with the mesh's
+	int GetRangeCount() { return (int)ranges.size(); }
+	Material* GetMaterial(int range) { return ranges[range].material ? ranges[range].material : material; }
+	Shader* GetShader(int range) { return ranges[range].material ? ranges[range].shader : GetShader(); }
+	Shader* GetMultiViewShader(int range) { return ranges[range].material ? ranges[range].multiViewShader : multiViewShader; }
+
+	// the shaders are the material's, or its animated variant when the mesh is animated
+	void SetRangeMaterial(int range, Material* m, Shader* shader, Shader* multiView)
+	{
+		ranges[range].material = m;
+		ranges[range].shader = shader;
+		ranges[range].multiViewShader = multiView;
+	}
+};
+
+bool useImpostors = true;
+// camera distance beyond which objects with an impostor are drawn as one
+float impostorDistance = 4.0f;
+
+// a mesh rendered at load time from gridSize x gridSize directions over the upper hemisphere into
+// an albedo and a normal-depth atlas; distant copies of the mesh are then drawn as one instanced
+// quad each, showing the cell baked nearest to the view
+class ImpostorAtlas
+{
+	static const int gridSize = 8;
+	static const int cellSize = 128;
+
+	GLTexture albedoTexture, normalDepthTexture;
+	GLVertexArray vao;
+	GLBuffer instanceBuffer;
+	float radius;
+	vec3 ambient;
+
+	static GLTexture NewAtlasTexture(int size)
+	{
+		GLTexture texture;
+		texture.Create();
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		return texture;
+	}
+
+	// decodeHemiOctahedral and viewBasis of impostorMappingSource
+	static vec3 CellDirection(int i, int j)
+	{
+		float tx = (i + 0.5f) / gridSize * 2 - 1, ty = (j + 0.5f) / gridSize * 2 - 1;
+		float px = (tx + ty) * 0.5f, pz = (tx - ty) * 0.5f;
+		return vec3(px, 1 - fabs(px) - fabs(pz), pz).normalize();
+	}
+
+	static void ViewBasis(vec3 w, vec3& u, vec3& v)
+	{
+		vec3 up = fabs(w.y) > 0.999f ? vec3(0, 0, -1) : vec3(0, 1, 0);
+		u = cross(up, w).normalize();
+		v = cross(w, u);
+	}
+
+public:
+	// the streamed textures hold only their tail levels this early, which is plenty for cells this small
+	ImpostorAtlas(Mesh* mesh, ImpostorBakeShader* textureBakeShader, ImpostorBakeShader* arrayBakeShader)
+	{
+		Geometry* geometry = mesh->GetGeometry();
+		radius = geometry->GetBoundingRadius();
+		ambient = mesh->GetMaterial()->GetAmbient();
+		int size = gridSize * cellSize;
+
+		albedoTexture = NewAtlasTexture(size);
+		normalDepthTexture = NewAtlasTexture(size);
+
+		int previousFramebuffer, viewport[4];
+		float clearColor[4];
+		glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+		glGetIntegerv(GL_VIEWPORT, viewport);
+		glGetFloatv(GL_COLOR_CLEAR_VALUE, clearColor);
+
+		GLFramebuffer framebuffer;
+		GLRenderbuffer depthBuffer;
+		framebuffer.Create();
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, albedoTexture, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, normalDepthTexture, 0);
+		depthBuffer.Create();
+		glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, size, size);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+		GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+		glDrawBuffers(2, drawBuffers);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) printf("Impostor framebuffer incomplete\n");
+
+		glViewport(0, 0, size, size);
+		glClearColor(0, 0, 0, 0);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+		for (int j = 0; j < gridSize; j++)
+		{
+			for (int i = 0; i < gridSize; i++)
+			{
+				// orthographic view of the bounding sphere along -w, nearer points get the smaller depth
+				vec3 w = CellDirection(i, j), u, v;
+				ViewBasis(w, u, v);
+				mat4 MVP(
+					u.x / radius, v.x / radius, -w.x / radius, 0,
+					u.y / radius, v.y / radius, -w.y / radius, 0,
+					u.z / radius, v.z / radius, -w.z / radius, 0,
+					0, 0, 0, 1);
+
+				glViewport(i * cellSize, j * cellSize, cellSize, cellSize);
+				for (int r = 0; r < mesh->GetRangeCount(); r++) {
+					ImpostorBakeShader* bakeShader = mesh->GetMaterial(r)->UsesTextureArray() ? arrayBakeShader : textureBakeShader;
+					bakeShader->Run();
+					bakeShader->UploadMVP(MVP);
+					bakeShader->UploadImpostorView(w, radius);
+					mesh->GetMaterial(r)->UploadAttributes(bakeShader);
+					geometry->DrawRange(r);
+				}
+			}
+		}
+
+		glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+		glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+		glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+		depthBuffer.Reset();
+		framebuffer.Reset();
+
+		glBindTexture(GL_TEXTURE_2D, albedoTexture);
+		glGenerateMipmap(GL_TEXTURE_2D);
+		glBindTexture(GL_TEXTURE_2D, normalDepthTexture);
+		glGenerateMipmap(GL_TEXTURE_2D);
+
+		// per instance: bounding sphere center and radius, then yaw and the height of the ground below
+		vao.Create();
+		glBindVertexArray(vao);
+		instanceBuffer.Create();
+		glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+		glEnableVertexAttribArray(11);
+		glVertexAttribPointer(11, 4, GL_FLOAT, GL_FALSE, 6 * sizeof(float), NULL);
+		glVertexAttribDivisorARB(11, 1);
+		glEnableVertexAttribArray(12);
+		glVertexAttribPointer(12, 2, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(4 * sizeof(float)));
+		glVertexAttribDivisorARB(12, 1);
+
+		printf("Impostor atlas: %dx%d views of %dx%d\n", gridSize, gridSize, cellSize, cellSize);
+	}
+
+	// instanced arrays are needed to feed the per-instance attributes
+	static bool IsSupported() { return GLEW_ARB_instanced_arrays && GLEW_ARB_draw_instanced; }
+
+	// six floats per instance; the shader has its frame uniforms already
+	void Draw(ImpostorShader* shader, const std::vector<float>& instances)
+	{
+		int count = (int)instances.size() / 6;
+		if (count == 0) return;
+
+		shader->UploadImpostorAttributes(gridSize, ambient);
+		glActiveTexture(GL_TEXTURE4);
+		glBindTexture(GL_TEXTURE_2D, normalDepthTexture);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, albedoTexture);
+
+		glBindVertexArray(vao);
+		glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+		glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(float), &instances[0], GL_STREAM_DRAW);
+
+		glEnable(GL_DEPTH_TEST);
+		glDrawArraysInstancedARB(GL_TRIANGLE_STRIP, 0, 4, count);
+		glDisable(GL_DEPTH_TEST);
+
+		renderStats.draws++;
+		renderStats.impostors += count;
+		renderStats.vertices += 4 * count;
+	}
+};
+
+Light* light;
+Light* spotlight;
+vec3 initialPos;
+vec3 initialHat;
+
+
+class Camera {
+	vec3  wEye, wLookat, wVup;
+	float fov, asp, fp, bp;
+
+	vec3 velocity;
+	vec3 acc;
+	float angularVelocity;
+
+public:
+	Camera()
+	{
+		wEye = vec3(0.0, -0.5, 2.5);
+		wLookat = vec3(0.0, -0.5, 0.0);
+		wVup = vec3(0.0, 1.0, 0.0);
+		fov = M_PI / 4.0; asp = 1.0; fp = 0.01; bp = 10.0;
+		velocity = 0; angularVelocity = 0;
+	}
+
+	void SetAcceleration() {
+		vec3 dif = wLookat - wEye;
+
+		if (keyboardState['w'] || keyboardState['s']) {
+			acc = dif * 0.03;
+		}
+		else {
+			if (velocity.length() > 0) {
+				acc = velocity * -0.01;
+			}
+
+		}
+	}
+
+	void Control() {
+		//the 2 speeds include directions
+		float speed = 1;
+		vec3 dif = wLookat - wEye;
+
+		SetAcceleration();
+
+		if (keyboardState['w'] || keyboardState['s']) {
+			if ((velocity.x*dif.x + velocity.z*dif.z) < 5) {
+				velocity = velocity + acc * (keyboardState['w'] * speed + keyboardState['s'] * -speed);
+			}
+		}
+		else {
+			velocity = velocity + acc * speed;
+		}
+
+
+		float angularSpeed = 1;
+
+		angularVelocity = keyboardState['a'] * -angularSpeed + keyboardState['d'] * angularSpeed;
+	}
+
+	/*void Control() {
+		float speed = 1;
+		vec3 dif = wLookat - wEye;
+		velocity = dif * (keyboardState['w'] * speed + keyboardState['s'] * -speed);
+
+		float angularSpeed = 1;
+		angularVelocity = keyboardState['a'] * -angularSpeed + keyboardState['d'] * angularSpeed;
+
+		
+	}*/
+
+	vec3 GetLookAt()
+	{
+		return wLookat;
+	}
+
+	vec3 GetwEye()
+	{
+		return wEye;
+	}
+
+	void SetwEye(vec3 v)
+	{
+		wEye = v;
+	}
+
+	void setEyeX(float x) {
+		wEye.x = x;
+	}
+
+	void setEyeZ(float z) {
+		wEye.z = z;
+	}
+
+
+	void TrackingShot(float t)
+	{
+		wEye = heart(t);
+	}
+
+	void setVelocity(vec3 v) {
+		velocity = v;
+	}
+
+	vec3 getVelocity() {
+		return velocity;
+	}
+
+	vec3 heart(float t) {
+		vec3 v0 = vec3(0, 0, -2).normalize();
+		vec3 v1 = (wLookat - initialPos).normalize();
+		float co = v0.z*v1.z; // dot product
+		float si = cross(v0, v1).length(); // size of cross product
+
+										   //        vec3 heartToEye = vec3(x(t),0,z(t)) - wEye;
+
+		float heartToEyeX = x(t);
+		float heartToEyeZ = z(t) - 2;
+
+		vec3 eyeToPos = vec3(heartToEyeX*co - heartToEyeZ*si, 0, heartToEyeX*si + heartToEyeZ*co);
+
+		return eyeToPos + initialPos;
+	}
+
+
+	//parametric function scaled down by 17/2
+	float x(float t) {
+		return 16 * sin(t)*sin(t)*sin(t) / 3;
+	}
+
+	float z(float t) {
+		t += M_PI;
+		return -(13 * cos(t) - 5 * cos(2 * t) - 2 * cos(3 * t) - cos(4 * t)) / 3;
+	}
+
+	void Move(float dt) {
+		wEye = wEye + velocity*dt;
+		wLookat = wLookat + velocity * dt;
+
+		vec3 w = (wLookat - wEye).normalize();
+		vec3 v = wVup.normalize();
+		vec3 u = cross(w, v);
+
+		vec3 wPrime = (w*cos(angularVelocity*dt) + u * sin(angularVelocity*dt)) * (wLookat - wEye).length();
+		//wLookat = wPrime + wEye;
+		//wEye = wLookat - wPrime;
+
+		if (keyboardState['t']) {
+			wPrime = (w*cos(dt) + u * sin(dt)) * (wLookat - wEye).length();
+		}
+			wEye = wLookat - wPrime;
+		
+
+		
+
+	}
+
+
+	void UploadAttribtes(Shader* shader) {
+		shader->UploadEyePosition(wEye);
+	}
+
+	// cameras that are not driven by the keyboard are put in place directly
+	void Place(vec3 eye, vec3 lookat)
+	{
+		wEye = eye;
+		wLookat = lookat;
+	}
+
+	void SetAspectRatio(float a) { asp = a; }
+	void SetFarPlane(float f) { bp = f; }
+
+	float GetFov() { return fov; }
+	float GetAspectRatio() { return asp; }
+	float GetNearPlane() { return fp; }
+	float GetFarPlane() { return bp; }
+
+	// right, up and backward, the view matrix's axes
+	void GetBasis(vec3& u, vec3& v, vec3& w)
+	{
+		w = (wEye - wLookat).normalize();
+		u = cross(wVup, w).normalize();
+		v = cross(w, u);
+	}
+
+	mat4 GetViewMatrix()
+	{
+		vec3 u, v, w;
+		GetBasis(u, v, w);
+
+		return
+			mat4(
+				1.0f, 0.0f, 0.0f, 0.0f,
+				0.0f, 1.0f, 0.0f, 0.0f,
+				0.0f, 0.0f, 1.0f, 0.0f,
+				-wEye.x, -wEye.y, -wEye.z, 1.0f) *
+			mat4(
+				u.x, v.x, w.x, 0.0f,
+				u.y, v.y, w.y, 0.0f,
+				u.z, v.z, w.z, 0.0f,
+				0.0f, 0.0f, 0.0f, 1.0f);
+	}
+
+	mat4 GetProjectionMatrix()
+	{
+		float sy = 1 / tan(fov / 2);
+		return mat4(
+			sy / asp, 0.0f, 0.0f, 0.0f,
+			0.0f, sy, 0.0f, 0.0f,
+			0.0f, 0.0f, -(fp + bp) / (bp - fp), -1.0f,
+			0.0f, 0.0f, -2 * fp*bp / (bp - fp), 0.0f);
+	}
+};
+
+Camera* camera;
+
+const int maxSplitScreenViews = 4;
+// players sharing the screen; player one is camera
+int splitScreenViews = 1;
+// the views are drawn as instances, which needs ARB_draw_instanced
+bool splitScreenSupported = false;
+std::vector<Camera*> playerCameras;
+
+// one player's part of the screen, as x, y, width and height fractions of the render target
+struct FrameView
+{
+	Camera camera;
+	mat4 VP;
+	vec4 rect;
+};
+
+// two players get the top and bottom halves, three or four a quarter each, player one top left
+vec4 splitScreenRect(int view, int count)
+{
+	if (count <= 1) return vec4(0, 0, 1, 1);
+	if (count == 2) return vec4(0, view == 0 ? 0.5f : 0.0f, 1, 0.5f);
+	return vec4(view % 2 * 0.5f, view < 2 ? 0.5f : 0.0f, 0.5f, 0.5f);
+}
+
+// the part of the target viewport a view covers, for passes that draw each view on its own
+void setViewViewport(const int* target, const vec4& rect)
+{
+	glViewport(target[0] + (int)(rect.v[0] * target[2]), target[1] + (int)(rect.v[1] * target[3]),
+		(int)(rect.v[2] * target[2]), (int)(rect.v[3] * target[3]));
+}
+
+struct PointLight
+{
+	vec3 position;
+	vec3 color;
+	float radius;
+
+	PointLight(vec3 position = vec3(), vec3 color = vec3(1, 1, 1), float radius = 1) : position(position), color(color), radius(radius) {}
+};
+
+// splits the view frustum into a grid of clusters (exponential depth slices), assigns point lights
+// to the clusters they touch on the CPU, one job per depth slice, and uploads the lists as textures
+class ClusteredLighting
+{
+	static const int dimX = 16, dimY = 16, dimZ = 16;
+	static const int tilesPerSlice = dimX * dimY;
+	static const int textureWidth = 1024;
+
+	// view-space cluster bounds, structure of arrays so four clusters are tested at once
+	float minX[dimZ][tilesPerSlice], minY[dimZ][tilesPerSlice], minZ[dimZ][tilesPerSlice];
+	float maxX[dimZ][tilesPerSlice], maxY[dimZ][tilesPerSlice], maxZ[dimZ][tilesPerSlice];
+	float sliceNear[dimZ + 1];
+	float boundsFov, boundsAspect, nearPlane, farPlane;
+
+	int viewportWidth, viewportHeight;
+	// split-screen views are all the same size, this fraction of the viewport
+	float viewWidth, viewHeight;
+
+	std::vector<float> viewLights;
+	std::vector<float> lightData;
+	std::vector<unsigned int> sliceIndices[dimZ];
+	std::vector<unsigned int> sliceCounts[dimZ];
+	std::vector<unsigned int> grid;
+	std::vector<unsigned int> indices;
+
+	GLTexture textures[3];
+	int indexRows, lightRows;
+
+	void UpdateBounds(float fov, float aspect, float n, float f)
+	{
+		if (fov == boundsFov && aspect == boundsAspect && n == nearPlane && f == farPlane) return;
+		boundsFov = fov; boundsAspect = aspect; nearPlane = n; farPlane = f;
+
+		float tanY = tan(fov / 2), tanX = tanY * aspect;
+		for (int z = 0; z <= dimZ; z++) sliceNear[z] = n * pow(f / n, (float)z / dimZ);
+
+		for (int z = 0; z < dimZ; z++)
+		{
+			float d0 = sliceNear[z], d1 = sliceNear[z + 1];
+			for (int y = 0; y < dimY; y++)
+			{
+				float y0 = -1 + 2.0f * y / dimY, y1 = -1 + 2.0f * (y + 1) / dimY;
+				for (int x = 0; x < dimX; x++)
+				{
+					float x0 = -1 + 2.0f * x / dimX, x1 = -1 + 2.0f * (x + 1) / dimX;
+					int i = y * dimX + x;
+					minX[z][i] = std::min(x0 * tanX * d0, x0 * tanX * d1);
+					maxX[z][i] = std::max(x1 * tanX * d0, x1 * tanX * d1);
+					minY[z][i] = std::min(y0 * tanY * d0, y0 * tanY * d1);
+					maxY[z][i] = std::max(y1 * tanY * d0, y1 * tanY * d1);
+					minZ[z][i] = -d1;
+					maxZ[z][i] = -d0;
+				}
+			}
+		}
+	}
+
+	void AssignSlice(int z)
+	{
+		std::vector<unsigned int>& counts = sliceCounts[z];
+		std::vector<unsigned int>& list = sliceIndices[z];
+		counts.assign(tilesPerSlice, 0);
+		list.clear();
+
+		// bucket per cluster first, then flatten, so each cluster's lights end up contiguous
+		static thread_local std::vector<unsigned int> buckets[tilesPerSlice];
+		for (int i = 0; i < tilesPerSlice; i++) buckets[i].clear();
+
+		int lightCount = (int)viewLights.size() / 4;
+		for (int l = 0; l < lightCount; l++)
+		{
+			const float* light = &viewLights[l * 4];
+			float r = light[3];
+			if (-light[2] + r < sliceNear[z] || -light[2] - r > sliceNear[z + 1]) continue;
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE__)
+			__m128 cx = _mm_set1_ps(light[0]), cy = _mm_set1_ps(light[1]), cz = _mm_set1_ps(light[2]);
+			__m128 r2 = _mm_set1_ps(r * r), zero = _mm_setzero_ps();
+			for (int i = 0; i < tilesPerSlice; i += 4)
+			{
+				__m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&minX[z][i]), cx), _mm_sub_ps(cx, _mm_loadu_ps(&maxX[z][i]))), zero);
+				__m128 dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&minY[z][i]), cy), _mm_sub_ps(cy, _mm_loadu_ps(&maxY[z][i]))), zero);
+				__m128 dz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&minZ[z][i]), cz), _mm_sub_ps(cz, _mm_loadu_ps(&maxZ[z][i]))), zero);
+				__m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+				int mask = _mm_movemask_ps(_mm_cmple_ps(d2, r2));
+				for (int k = 0; mask; k++, mask >>= 1)
+					if (mask & 1) buckets[i + k].push_back(l);
+			}
+#else
+			for (int i = 0; i < tilesPerSlice; i++)
+			{
+				float dx = std::max(std::max(minX[z][i] - light[0], light[0] - maxX[z][i]), 0.0f);
+				float dy = std::max(std::max(minY[z][i] - light[1], light[1] - maxY[z][i]), 0.0f);
+				float dz = std::max(std::max(minZ[z][i] - light[2], light[2] - maxZ[z][i]), 0.0f);
+				if (dx * dx + dy * dy + dz * dz <= r * r) buckets[i].push_back(l);
+			}
+#endif
+		}
+
+		for (int i = 0; i < tilesPerSlice; i++)
+		{
+			counts[i] = (unsigned int)buckets[i].size();
+			list.insert(list.end(), buckets[i].begin(), buckets[i].end());
+		}
+	}
+
+	// grows the texture to the rows needed and uploads the data padded to whole rows
+	template<typename T>
+	void UploadRows(unsigned int texture, std::vector<T>& data, int texelSize, int& rows, unsigned int internalFormat, unsigned int format, unsigned int type)
+	{
+		int texels = (int)data.size() / texelSize;
+		int needed = std::max(1, (texels + textureWidth - 1) / textureWidth);
+		data.resize(needed * textureWidth * texelSize);
+
+		glBindTexture(GL_TEXTURE_2D, texture);
+		if (needed > rows)
+		{
+			rows = needed;
+			glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, textureWidth, rows, 0, format, type, &data[0]);
+		}
+		else glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, textureWidth, needed, format, type, &data[0]);
+	}
+
+public:
+	ClusteredLighting()
+	{
+		boundsFov = boundsAspect = nearPlane = farPlane = 0;
+		viewportWidth = viewportHeight = 1;
+		viewWidth = viewHeight = 1;
+		indexRows = lightRows = 0;
+
+		for (int i = 0; i < 3; i++)
+		{
+			textures[i].Create();
+			glBindTexture(GL_TEXTURE_2D, textures[i]);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		}
+		// one grid after another for split-screen views
+		int gridRows = (dimX * dimY * dimZ + textureWidth - 1) / textureWidth;
+		glBindTexture(GL_TEXTURE_2D, textures[0]);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32UI, textureWidth, gridRows * maxSplitScreenViews, 0, GL_RG_INTEGER, GL_UNSIGNED_INT, NULL);
+	}
+
+	void SetViewport(int width, int height)
+	{
+		viewportWidth = width;
+		viewportHeight = height;
+	}
+
+	// the clusters of each view are assigned in turn and share the index and light textures
+	void Update(std::vector<FrameView>& views, const std::vector<PointLight>& lights)
+	{
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+		lightData.resize(lights.size() * 8);
+		for (unsigned int l = 0; l < lights.size(); l++)
+		{
+			const PointLight& light = lights[l];
+			float* data = &lightData[l * 8];
+			data[0] = light.position.x; data[1] = light.position.y; data[2] = light.position.z; data[3] = light.radius;
+			data[4] = light.color.x; data[5] = light.color.y; data[6] = light.color.z; data[7] = 1;
+		}
+
+		int clusterCount = dimX * dimY * dimZ;
+		grid.resize(clusterCount * 2 * views.size());
+		indices.clear();
+		viewWidth = views[0].rect.v[2];
+		viewHeight = views[0].rect.v[3];
+
+		for (int v = 0; v < views.size(); v++)
+		{
+			Camera& camera = views[v].camera;
+			UpdateBounds(camera.GetFov(), camera.GetAspectRatio(), camera.GetNearPlane(), camera.GetFarPlane());
+
+			mat4 V = camera.GetViewMatrix();
+			viewLights.resize(lights.size() * 4);
+			for (unsigned int l = 0; l < lights.size(); l++)
+			{
+				const PointLight& light = lights[l];
+				vec4 p = vec4(light.position.x, light.position.y, light.position.z, 1) * V;
+				viewLights[l * 4] = p.v[0]; viewLights[l * 4 + 1] = p.v[1]; viewLights[l * 4 + 2] = p.v[2];
+				viewLights[l * 4 + 3] = light.radius;
+			}
+
+			threadPool->ParallelFor(dimZ, [this](int z) { AssignSlice(z); });
+
+			unsigned int* viewGrid = &grid[clusterCount * 2 * v];
+			for (int z = 0; z < dimZ; z++)
+			{
+				unsigned int offset = (unsigned int)indices.size();
+				for (int i = 0; i < tilesPerSlice; i++)
+				{
+					viewGrid[(z * tilesPerSlice + i) * 2] = offset;
+					viewGrid[(z * tilesPerSlice + i) * 2 + 1] = sliceCounts[z][i];
+					offset += sliceCounts[z][i];
+				}
+				indices.insert(indices.end(), sliceIndices[z].begin(), sliceIndices[z].end());
+			}
+		}
+		int entries = (int)indices.size();
+
+		glBindTexture(GL_TEXTURE_2D, textures[0]);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, textureWidth, (int)grid.size() / 2 / textureWidth, GL_RG_INTEGER, GL_UNSIGNED_INT, &grid[0]);
+		UploadRows(textures[1], indices, 1, indexRows, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT);
+		UploadRows(textures[2], lightData, 4, lightRows, GL_RGBA32F, GL_RGBA, GL_FLOAT);
+
+		renderStats.lights += (int)lights.size();
+		renderStats.lightIndices += entries;
+		renderStats.lightAssignMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	void UploadAttributes(Shader* shader)
+	{
+		shader->UploadClusterAttributes(dimX, dimY, dimZ, viewportWidth * viewWidth / dimX, viewportHeight * viewHeight / dimY, nearPlane, farPlane);
+		for (int i = 0; i < 3; i++)
+		{
+			glActiveTexture(GL_TEXTURE1 + i);
+			glBindTexture(GL_TEXTURE_2D, textures[i]);
+		}
+		glActiveTexture(GL_TEXTURE0);
+	}
+};
+
+ClusteredLighting* clusteredLighting;
+
+// one object as of a simulation step; the matrices are built from these by the draw recorder's
+// workers, mesh and shader do not change after initialization
+// the world is simulated and drawn relative to an origin that jumps in whole sectors to stay near
+// player one, so float positions stay small however far the world reaches. sectors are whole units,
+// which keeps the ground texture, tiled once per unit, continuous across a jump
+const double worldSectorSize = 64;
+bool useFloatingOrigin = true;
+// how far along x or z the car may get from the origin before it moves; past half a sector, so the
+// car has to travel before the origin can move back
+float recenterDistance = 64;
+// where in the world the level is built, to try the precision far from zero
+double worldStartX = 0, worldStartZ = 0;
+
+class WorldOrigin
+{
+	long long sectorX, sectorZ;
+
+public:
+	WorldOrigin() : sectorX(0), sectorZ(0) { }
+
+	double GetX() const { return sectorX * worldSectorSize; }
+	double GetZ() const { return sectorZ * worldSectorSize; }
+
+	// the difference is taken in double, so only the small remainder is rounded to float
+	vec3 ToLocal(double x, double y, double z) const { return vec3((float)(x - GetX()), (float)y, (float)(z - GetZ())); }
+
+	// added to a position relative to this origin to make it relative to another
+	vec3 Offset(const WorldOrigin& to) const
+	{
+		return vec3((float)((sectorX - to.sectorX) * worldSectorSize), 0, (float)((sectorZ - to.sectorZ) * worldSectorSize));
+	}
+
+	// to the sector holding a world position
+	void MoveTo(double x, double z)
+	{
+		sectorX = (long long)floor(x / worldSectorSize + 0.5);
+		sectorZ = (long long)floor(z / worldSectorSize + 0.5);
+	}
+};
+
+// the simulation's origin; the renderer has the one of the snapshot it draws
+WorldOrigin worldOrigin;
+
+// heightfield terrain instead of the flat infinite ground
+bool useTerrain = true;
+// terrain is streamed in and drawn this far around the cameras, which see no further
+float terrainViewDistance = 256;
+
+// hashed from the lattice point, so any part of the world can be sampled without a table
+double terrainLattice(long long x, long long z)
+{
+	unsigned long long h = (unsigned long long)x * 0x9E3779B97F4A7C15ULL ^ (unsigned long long)z * 0xC2B2AE3D27D4EB4FULL;
+	h ^= h >> 29;
+	h *= 0xBF58476D1CE4E5B9ULL;
+	h ^= h >> 32;
+	return (h >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// smoothly interpolated value noise in 0..1
+double terrainNoise(double x, double z)
+{
+	double cellX = floor(x), cellZ = floor(z);
+	double tx = x - cellX, tz = z - cellZ;
+	tx = tx * tx * (3 - 2 * tx);
+	tz = tz * tz * (3 - 2 * tz);
+	long long ix = (long long)cellX, iz = (long long)cellZ;
+	double top = terrainLattice(ix, iz) + (terrainLattice(ix + 1, iz) - terrainLattice(ix, iz)) * tx;
+	double bottom = terrainLattice(ix, iz + 1) + (terrainLattice(ix + 1, iz + 1) - terrainLattice(ix, iz + 1)) * tx;
+	return top + (bottom - top) * tz;
+}
+
+// the heightmap at a world position: hills of a few octaves, flat at y = -1 around the level, which
+// is played on a plane, and rising within a ring around it. the terrain meshes sample it at whole units
+double terrainSample(double x, double z)
+{
+	double hills = 0, amplitude = 1, total = 0, frequency = 1 / 192.0;
+	for (int octave = 0; octave < 5; octave++)
+	{
+		hills += terrainNoise(x * frequency, z * frequency) * amplitude;
+		total += amplitude;
+		amplitude *= 0.5;
+		frequency *= 2;
+	}
+	hills /= total;
+
+	double dx = x - worldStartX, dz = z - worldStartZ;
+	double rise = std::min(std::max((sqrt(dx * dx + dz * dz) - 24) / 40, 0.0), 1.0);
+	return -1 + 24 * hills * hills * rise * rise * (3 - 2 * rise);
+}
+
+// the ground as the finest terrain level draws it: the samples at the corners of the unit cell,
+// split along the same diagonal as the chunk grids
+double terrainHeight(double x, double z)
+{
+	double cellX = floor(x), cellZ = floor(z);
+	double tx = x - cellX, tz = z - cellZ;
+	double h00 = terrainSample(cellX, cellZ), h11 = terrainSample(cellX + 1, cellZ + 1);
+	if (tx >= tz) {
+		double h10 = terrainSample(cellX + 1, cellZ);
+		return h00 + (h10 - h00) * tx + (h11 - h10) * tz;
+	}
+	double h01 = terrainSample(cellX, cellZ + 1);
+	return h00 + (h01 - h00) * tz + (h11 - h01) * tx;
+}
+
+// under a point relative to the simulation's origin; without terrain the ground is the plane y = -1
+float groundHeight(float x, float z)
+{
+	return useTerrain ? (float)terrainHeight(worldOrigin.GetX() + x, worldOrigin.GetZ() + z) : -1.0f;
+}
+
+struct ObjectSnapshot
+{
+	Mesh* mesh;
+	Shader* shader;
+	vec3 position;
+	vec3 scaling;
+	float orientation;
+	float rotation;
+	vec3 rotationAxis;
+	float radius;
+	// height of the ground under the object, where its planar shadow falls
+	float ground;
+	const ProceduralAnimation* animation;
+	float animationPhase;
+	int ID;
+	bool destroy;
+
+	void BuildTransform(mat4& M, mat4& InvM) const
+	{
+		mat4 T = mat4(
+			1.0, 0.0, 0.0, 0.0,
+			0.0, 1.0, 0.0, 0.0,
+			0.0, 0.0, 1.0, 0.0,
+			position.x, position.y, position.z, 1.0);
+
+		mat4 InvT = mat4(
+			1.0, 0.0, 0.0, 0.0,
+			0.0, 1.0, 0.0, 0.0,
+			0.0, 0.0, 1.0, 0.0,
+			-position.x, -position.y, -position.z, 1.0);
+
+		mat4 S = mat4(
+			scaling.x, 0.0, 0.0, 0.0,
+			0.0, scaling.y, 0.0, 0.0,
+			0.0, 0.0, scaling.z, 0.0,
+			0.0, 0.0, 0.0, 1.0);
+
+		mat4 InvS = mat4(
+			1.0 / scaling.x, 0.0, 0.0, 0.0,
+			0.0, 1.0 / scaling.y, 0.0, 0.0,
+			0.0, 0.0, 1.0 / scaling.z, 0.0,
+			0.0, 0.0, 0.0, 1.0);
+
+		float alpha = orientation / 180.0 * M_PI;
+		float beta = rotation / 180.0 * M_PI;
+
+		mat4 R = mat4(
+			cos(alpha), 0.0, sin(alpha), 0.0,
+			0.0, 1.0, 0.0, 0.0,
+			-sin(alpha), 0.0, cos(alpha), 0.0,
+			0.0, 0.0, 0.0, 1.0);
+
+		mat4 InvR = mat4(
+			cos(alpha), 0.0, -sin(alpha), 0.0,
+			0.0, 1.0, 0.0, 0.0,
+			sin(alpha), 0.0, cos(alpha), 0.0,
+			0.0, 0.0, 0.0, 1.0);
+
+		const vec3& u = rotationAxis;
+
+		mat4 Rz =
+			mat4(cos(beta) + u.x*u.x*(1 - cos(beta)), -u.z*sin(beta), u.x*u.z*(1 - cos(beta)), 0,
+				u.z*sin(beta), cos(beta), -u.x*sin(beta), 0,
+				u.z*u.x*(1 - cos(beta)), u.x*sin(beta), cos(beta) + u.z*u.z*(1 - cos(beta)), 0,
+				0, 0, 0, 1
+			);
+
+		mat4 InvRz =
+			mat4(cos(beta) + u.x*u.x*(1 - cos(beta)), u.z*sin(beta), u.z*u.x*(1 - cos(beta)), 0,
+				-u.z*sin(beta), cos(beta), u.x*sin(beta), 0,
+				u.x*u.z*(1 - cos(beta)), -u.x*sin(beta), cos(beta) + u.z*u.z*(1 - cos(beta)), 0,
+				0, 0, 0, 1
+			);
+
+		M = S * R * Rz * T;
+		InvM = InvT * InvRz * InvR *  InvS;
+	}
+};
+
+// everything a frame is drawn from, copied out at the end of a simulation step so the renderer
+// never reads state the simulation is changing
+struct FrameSnapshot
+{
+	double time;
+	Camera camera;
+	Light light, spotlight;
+	mat4 VP;
+	// camera and VP above are player one's, the first view
+	std::vector<FrameView> views;
+	WorldOrigin origin;
+	// shadows are cast from the sun's position as a point that stays put in the world, while
+	// shading uses it as a direction
+	vec4 shadowLightPosition;
+	vec3 carPosition;
+	float carGround;
+	std::vector<ObjectSnapshot> objects;
+};
+
+
+// size and internal format of a frame graph texture, GL_RGBA8 or GL_DEPTH_COMPONENT24
+struct FrameResourceDesc
+{
+	int width, height;
+	unsigned int format;
+
+	FrameResourceDesc(int width = 1, int height = 1, unsigned int format = GL_RGBA8) : width(width), height(height), format(format) { }
+
+	bool IsDepth() const { return format == GL_DEPTH_COMPONENT24; }
+	unsigned int Bytes() const { return (unsigned int)width * height * 4; }
+	bool operator==(const FrameResourceDesc& d) const { return width == d.width && height == d.height && format == d.format; }
+};
+
+// how a pass writes a resource; storage writes are incoherent and need a barrier before the next use
+enum FrameAccess { FrameAttachment, FrameStorage };
+
+// the frame as a list of passes that declare the textures they read and write. every write makes a
+// new version of the resource, and passes are ordered by the versions they consume rather than by
+// the order they were added in. passes that contribute nothing to an imported resource are culled,
+// and transient textures come from a pool, where resources whose lifetimes do not overlap share one
+class FrameGraph
+{
+	static const int evictAfterFrames = 120;
+
+	struct Resource
+	{
+		std::string name;
+		FrameResourceDesc desc;
+		int importedFramebuffer;	// -1 for transient textures
+		int physical;
+		int firstPass, lastPass;	// positions in the execution order
+	};
+
+	// one version of a resource; handles given out by the graph index these
+	struct Version
+	{
+		int resource;
+		int writer;					// -1 for the initial contents
+		FrameAccess access;
+	};
+
+	struct Pass
+	{
+		std::string name;
+		std::function<void()> execute;
+		std::vector<int> reads, writes, consumed;	// consumed holds the versions written over
+		bool culled;
+		unsigned int barrier;
+	};
+
+	struct PhysicalTexture
+	{
+		FrameResourceDesc desc;
+		GLTexture texture;
+		int lastUsedFrame;
+		bool busy;
+	};
+
+	std::vector<Resource> resources;
+	std::vector<Version> versions;
+	std::vector<Pass> passes;
+	std::vector<int> order;
+	std::vector<PhysicalTexture> pool;
+	std::map<std::vector<unsigned int>, GLFramebuffer> framebuffers;
+	int frame;
+	unsigned int peakBytes, virtualBytes;
+
+	int AddVersion(int resource, int writer, FrameAccess access)
+	{
+		Version version = { resource, writer, access };
+		versions.push_back(version);
+		return (int)versions.size() - 1;
+	}
+
+	int Acquire(const FrameResourceDesc& desc)
+	{
+		for (int i = 0; i < pool.size(); i++)
+		{
+			if (!pool[i].busy && pool[i].desc == desc) { pool[i].busy = true; return i; }
+		}
+
+		PhysicalTexture physical;
+		physical.desc = desc;
+		physical.busy = true;
+		physical.lastUsedFrame = frame;
+		physical.texture.Create();
+		glBindTexture(GL_TEXTURE_2D, physical.texture);
+		if (desc.IsDepth()) glTexImage2D(GL_TEXTURE_2D, 0, desc.format, desc.width, desc.height, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+		else glTexImage2D(GL_TEXTURE_2D, 0, desc.format, desc.width, desc.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		pool.push_back(std::move(physical));
+		return (int)pool.size() - 1;
+	}
+
+	// the framebuffers the texture is attached to; the texture goes with its pool entry
+	void ReleaseFramebuffers(unsigned int texture)
+	{
+		for (std::map<std::vector<unsigned int>, GLFramebuffer>::iterator i = framebuffers.begin(); i != framebuffers.end();)
+		{
+			if (std::find(i->first.begin(), i->first.end(), texture) != i->first.end()) framebuffers.erase(i++);
+			else i++;
+		}
+	}
+
+	// the attachments a pass writes, color first and depth last, as one cached framebuffer
+	unsigned int Framebuffer(const Pass& pass)
+	{
+		std::vector<unsigned int> colors;
+		unsigned int depth = 0;
+		for (int i = 0; i < pass.writes.size(); i++)
+		{
+			Resource& resource = resources[versions[pass.writes[i]].resource];
+			if (resource.importedFramebuffer >= 0) return resource.importedFramebuffer;
+			if (versions[pass.writes[i]].access != FrameAttachment) continue;
+			unsigned int texture = pool[resource.physical].texture;
+			if (resource.desc.IsDepth()) depth = texture;
+			else colors.push_back(texture);
+		}
+
+		std::vector<unsigned int> key = colors;
+		key.push_back(depth);
+		std::map<std::vector<unsigned int>, GLFramebuffer>::iterator cached = framebuffers.find(key);
+		if (cached != framebuffers.end()) return cached->second;
+
+		GLFramebuffer framebuffer;
+		framebuffer.Create();
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		std::vector<GLenum> drawBuffers;
+		for (int i = 0; i < colors.size(); i++)
+		{
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, colors[i], 0);
+			drawBuffers.push_back(GL_COLOR_ATTACHMENT0 + i);
+		}
+		if (depth) glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth, 0);
+		if (drawBuffers.empty()) glDrawBuffer(GL_NONE);
+		else glDrawBuffers((int)drawBuffers.size(), &drawBuffers[0]);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) printf("Frame graph framebuffer for %s incomplete\n", pass.name.c_str());
+		unsigned int id = framebuffer;
+		framebuffers[key] = std::move(framebuffer);
+		return id;
+	}
+
+	// a storage write is only visible to later reads after a memory barrier for that kind of read
+	unsigned int Barrier(int version, bool sampled)
+	{
+		if (versions[version].writer < 0 || versions[version].access != FrameStorage) return 0;
+		return sampled ? GL_TEXTURE_FETCH_BARRIER_BIT : GL_FRAMEBUFFER_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT;
+	}
+
+public:
+	FrameGraph() : frame(0), peakBytes(0), virtualBytes(0) { }
+
+	// starts a new frame; pooled textures stay allocated until they go unused for a while
+	void Reset()
+	{
+		frame++;
+		resources.clear();
+		versions.clear();
+		passes.clear();
+		order.clear();
+
+		for (int i = 0; i < pool.size(); i++)
+		{
+			pool[i].busy = false;
+			if (frame - pool[i].lastUsedFrame < evictAfterFrames) continue;
+			ReleaseFramebuffers(pool[i].texture);
+			pool.erase(pool.begin() + i);
+			i--;
+		}
+	}
+
+	// a framebuffer owned outside the graph, such as the window; its handle is the current contents
+	int Import(const std::string& name, int framebuffer, const FrameResourceDesc& desc)
+	{
+		Resource resource = { name, desc, framebuffer, -1, -1, -1 };
+		resources.push_back(resource);
+		return AddVersion((int)resources.size() - 1, -1, FrameAttachment);
+	}
+
+	// a texture that lives only for this frame, with undefined contents until a pass writes it
+	int Create(const std::string& name, const FrameResourceDesc& desc)
+	{
+		Resource resource = { name, desc, -1, -1, -1, -1 };
+		resources.push_back(resource);
+		return AddVersion((int)resources.size() - 1, -1, FrameAttachment);
+	}
+
+	int AddPass(const std::string& name, std::function<void()> execute)
+	{
+		Pass pass;
+		pass.name = name;
+		pass.execute = execute;
+		pass.culled = false;
+		pass.barrier = 0;
+		passes.push_back(pass);
+		return (int)passes.size() - 1;
+	}
+
+	// the pass samples this version of the resource
+	void Read(int pass, int handle)
+	{
+		passes[pass].reads.push_back(handle);
+	}
+
+	// the pass renders on top of this version; returns the handle of the version it produces
+	int Write(int pass, int handle, FrameAccess access = FrameAttachment)
+	{
+		passes[pass].consumed.push_back(handle);
+		int version = AddVersion(versions[handle].resource, pass, access);
+		passes[pass].writes.push_back(version);
+		return version;
+	}
+
+	unsigned int GetTexture(int handle)
+	{
+		Resource& resource = resources[versions[handle].resource];
+		return resource.physical >= 0 ? pool[resource.physical].texture : 0;
+	}
+
+	// culls, orders and assigns textures; a pass runs once everything it consumes has been written
+	void Compile()
+	{
+		// anything that writes an imported resource is needed, and so is whatever feeds a needed pass
+		std::vector<bool> needed(passes.size(), false);
+		std::vector<int> stack;
+		for (int p = 0; p < passes.size(); p++)
+		{
+			for (int i = 0; i < passes[p].writes.size(); i++)
+				if (resources[versions[passes[p].writes[i]].resource].importedFramebuffer >= 0 && !needed[p]) { needed[p] = true; stack.push_back(p); }
+		}
+		while (!stack.empty())
+		{
+			Pass& pass = passes[stack.back()];
+			stack.pop_back();
+			for (int k = 0; k < 2; k++)
+			{
+				std::vector<int>& inputs = k == 0 ? pass.reads : pass.consumed;
+				for (int i = 0; i < inputs.size(); i++)
+				{
+					int writer = versions[inputs[i]].writer;
+					if (writer >= 0 && !needed[writer]) { needed[writer] = true; stack.push_back(writer); }
+				}
+			}
+		}
+		for (int p = 0; p < passes.size(); p++) passes[p].culled = !needed[p];
+
+		// earliest added pass first among those whose inputs are ready
+		std::vector<bool> done(passes.size(), false);
+		bool progress = true;
+		while (progress)
+		{
+			progress = false;
+			for (int p = 0; p < passes.size(); p++)
+			{
+				if (done[p] || passes[p].culled) continue;
+				bool ready = true;
+				for (int k = 0; k < 2 && ready; k++)
+				{
+					std::vector<int>& inputs = k == 0 ? passes[p].reads : passes[p].consumed;
+					for (int i = 0; i < inputs.size() && ready; i++)
+					{
+						int writer = versions[inputs[i]].writer;
+						if (writer >= 0 && !done[writer]) ready = false;
+					}
+				}
+				if (!ready) continue;
+				done[p] = true;
+				order.push_back(p);
+				progress = true;
+				break;
+			}
+		}
+		for (int p = 0; p < passes.size(); p++)
+			if (!passes[p].culled && !done[p]) printf("Frame graph pass %s has a dependency cycle and is skipped\n", passes[p].name.c_str());
+
+		// lifetimes over the execution order, and barriers for reads of storage writes
+		for (int o = 0; o < order.size(); o++)
+		{
+			Pass& pass = passes[order[o]];
+			for (int k = 0; k < 2; k++)
+			{
+				std::vector<int>& handles = k == 0 ? pass.reads : pass.writes;
+				for (int i = 0; i < handles.size(); i++)
+				{
+					Resource& resource = resources[versions[handles[i]].resource];
+					if (resource.firstPass < 0) resource.firstPass = o;
+					resource.lastPass = o;
+				}
+			}
+			for (int i = 0; i < pass.reads.size(); i++) pass.barrier |= Barrier(pass.reads[i], true);
+			for (int i = 0; i < pass.consumed.size(); i++) pass.barrier |= Barrier(pass.consumed[i], false);
+		}
+
+		// a texture goes back to the pool after its last pass, ready for the next resource to start
+		unsigned int liveBytes = 0;
+		peakBytes = virtualBytes = 0;
+		for (int o = 0; o < order.size(); o++)
+		{
+			for (int r = 0; r < resources.size(); r++)
+			{
+				Resource& resource = resources[r];
+				if (resource.importedFramebuffer >= 0 || resource.firstPass != o) continue;
+				resource.physical = Acquire(resource.desc);
+				pool[resource.physical].lastUsedFrame = frame;
+				liveBytes += resource.desc.Bytes();
+				virtualBytes += resource.desc.Bytes();
+			}
+			peakBytes = std::max(peakBytes, liveBytes);
+			for (int r = 0; r < resources.size(); r++)
+			{
+				Resource& resource = resources[r];
+				if (resource.importedFramebuffer >= 0 || resource.lastPass != o) continue;
+				pool[resource.physical].busy = false;
+				liveBytes -= resource.desc.Bytes();
+			}
+		}
+	}
+
+	// binds each pass's targets at their full size; passes rendering to a part of a target set
+	// their own viewport, and the framebuffer bound before the graph is bound again afterwards
+	void Execute()
+	{
+		int previous;
+		glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous);
+
+		for (int o = 0; o < order.size(); o++)
+		{
+			Pass& pass = passes[order[o]];
+			if (pass.barrier && GLEW_ARB_shader_image_load_store) glMemoryBarrier(pass.barrier);
+			if (!pass.writes.empty())
+			{
+				glBindFramebuffer(GL_FRAMEBUFFER, Framebuffer(pass));
+				const FrameResourceDesc& desc = resources[versions[pass.writes[0]].resource].desc;
+				glViewport(0, 0, desc.width, desc.height);
+			}
+			pass.execute();
+		}
+
+		glBindFramebuffer(GL_FRAMEBUFFER, previous);
+	}
+
+	// peak bytes of transient textures alive at once, and what they would take without sharing
+	unsigned int GetPeakTransientBytes() { return peakBytes; }
+	unsigned int GetVirtualTransientBytes() { return virtualBytes; }
+
+	// passes as boxes, culled ones dashed, and one edge per version handed from pass to pass
+	void WriteDot(FILE* file)
+	{
+		fprintf(file, "digraph FrameGraph {\n");
+		fprintf(file, "\t// peak transient memory %.2f MB, %.2f MB without aliasing\n", peakBytes / 1048576.0, virtualBytes / 1048576.0);
+		fprintf(file, "\trankdir=LR;\n");
+		for (int p = 0; p < passes.size(); p++)
+		{
+			int position = (int)(std::find(order.begin(), order.end(), p) - order.begin());
+			if (passes[p].culled) fprintf(file, "\tpass%d [shape=box, style=dashed, label=\"%s\\nculled\"];\n", p, passes[p].name.c_str());
+			else fprintf(file, "\tpass%d [shape=box, label=\"%d: %s%s\"];\n", p, position, passes[p].name.c_str(), passes[p].barrier ? "\\nbarrier" : "");
+		}
+		for (int r = 0; r < resources.size(); r++)
+		{
+			Resource& resource = resources[r];
+			const char* kind = resource.importedFramebuffer >= 0 ? "imported" : resource.desc.IsDepth() ? "depth" : "color";
+			fprintf(file, "\tresource%d [shape=ellipse, label=\"%s\\n%dx%d %s", r, resource.name.c_str(), resource.desc.width, resource.desc.height, kind);
+			if (resource.physical >= 0) fprintf(file, ", texture %u", (unsigned int)pool[resource.physical].texture);
+			fprintf(file, "\"];\n");
+		}
+		for (int p = 0; p < passes.size(); p++)
+		{
+			for (int i = 0; i < passes[p].writes.size(); i++)
+				fprintf(file, "\tpass%d -> resource%d [color=red];\n", p, versions[passes[p].writes[i]].resource);
+			for (int i = 0; i < passes[p].reads.size(); i++)
+				fprintf(file, "\tresource%d -> pass%d [color=green];\n", versions[passes[p].reads[i]].resource, p);
+		}
+		fprintf(file, "}\n");
+	}
+};
+
+FrameGraph* frameGraph;
+
+bool useDynamicResolution = true;
+float targetFrameMs = 16.7f;
+float minResolutionScale = 0.5f;
+float upscaleSharpness = 0.25f;
+
+struct ResolutionSample
+{
+	float frameMs;
+	float scale;
+
+	ResolutionSample(float frameMs, float scale) : frameMs(frameMs), scale(scale) { }
+};
+
+// renders the scene into an offscreen target at a fraction of the window size and upscales it to
+// the back buffer; every few frames the fraction is nudged towards the target frame time
+class DynamicResolution
+{
+	static const int adjustInterval = 8;
+	static const int historyLength = 120;
+
+	UpscaleShader* shader;
+	GLVertexArray vao;
+
+	int windowWidth, windowHeight;
+	int renderWidth, renderHeight;
+	float scale;
+
+	double sampleMs;
+	int sampleFrames;
+	std::vector<ResolutionSample> history;
+
+	void Resize()
+	{
+		renderWidth = std::max(1, (int)(windowWidth * scale + 0.5f));
+		renderHeight = std::max(1, (int)(windowHeight * scale + 0.5f));
+	}
+
+public:
+	bool enabled;
+
+	DynamicResolution(UpscaleShader* shader) : shader(shader)
+	{
+		vao.Create();
+		enabled = true;
+		windowWidth = windowHeight = 1;
+		scale = 1;
+		sampleMs = 0;
+		sampleFrames = 0;
+		Resize();
+	}
+
+	// the scene targets come from the frame graph at full window size, so a scale change only
+	// moves the viewport and the pooled textures are reused from frame to frame
+	void SetWindowSize(int width, int height)
+	{
+		windowWidth = std::max(1, width);
+		windowHeight = std::max(1, height);
+		Resize();
+	}
+
+	bool IsActive() { return enabled; }
+
+	float GetScale() { return IsActive() ? scale : 1.0f; }
+	int GetRenderWidth() { return IsActive() ? renderWidth : windowWidth; }
+	int GetRenderHeight() { return IsActive() ? renderHeight : windowHeight; }
+
+	// oldest first, one entry per adjustment
+	const std::vector<ResolutionSample>& GetHistory() { return history; }
+
+	// draws the rendered part of the source texture over the bound framebuffer
+	void Upscale(unsigned int sourceTexture)
+	{
+		glDisable(GL_DEPTH_TEST);
+
+		shader->Run();
+		shader->UploadSamplerID();
+		shader->UploadUpscaleAttributes((float)renderWidth / windowWidth, (float)renderHeight / windowHeight,
+			1.0f / windowWidth, 1.0f / windowHeight, scale < 1 ? upscaleSharpness : 0);
+		glBindTexture(GL_TEXTURE_2D, sourceTexture);
+		glBindVertexArray(vao);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+	}
+
+	void FrameTime(double frameMs)
+	{
+		if (!IsActive()) return;
+
+		sampleMs += frameMs;
+		if (++sampleFrames < adjustInterval) return;
+
+		double average = sampleMs / sampleFrames;
+		sampleMs = 0;
+		sampleFrames = 0;
+
+		// the cost of a frame is mostly per pixel, so the scale follows the square root of the
+		// budget ratio; a dead band and half steps keep it from oscillating around the target
+		double ratio = targetFrameMs / average;
+		if (ratio < 0.95 || ratio > 1.1)
+		{
+			float wanted = scale * (float)sqrt(ratio);
+			scale = std::min(1.0f, std::max(minResolutionScale, scale + (wanted - scale) * 0.5f));
+			Resize();
+		}
+
+		history.push_back(ResolutionSample((float)average, scale));
+		if (history.size() > historyLength) history.erase(history.begin());
+	}
+};
+
+DynamicResolution* dynamicResolution;
+
+enum CaptureFormat { CapturePng, CaptureY4m };
+
+int captureRingSize = 3;
+int captureQueueLimit = 8;
+int captureFrameRate = 60;
+// frames drawn per captured frame; above 1 keeps the readback off most frames where it is not cheap,
+// as with a software GL that converts the pixels on the CPU
+int captureFrameInterval = 1;
+
+static unsigned int crcTable[256];
+
+unsigned int crc32(const unsigned char* data, size_t length, unsigned int crc = 0)
+{
+	if (crcTable[1] == 0)
+	{
+		for (unsigned int n = 0; n < 256; n++)
+		{
+			unsigned int c = n;
+			for (int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			crcTable[n] = c;
+		}
+	}
+	crc = ~crc;
+	for (size_t i = 0; i < length; i++) crc = crcTable[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+void writeBigEndian(std::vector<unsigned char>& out, unsigned int value)
+{
+	out.push_back(value >> 24);
+	out.push_back(value >> 16);
+	out.push_back(value >> 8);
+	out.push_back(value);
+}
+
+void writePngChunk(FILE* file, const char* type, const std::vector<unsigned char>& data)
+{
+	std::vector<unsigned char> chunk;
+	writeBigEndian(chunk, (unsigned int)data.size());
+	chunk.insert(chunk.end(), type, type + 4);
+	chunk.insert(chunk.end(), data.begin(), data.end());
+	writeBigEndian(chunk, crc32(&chunk[4], chunk.size() - 4));
+	fwrite(&chunk[0], chunk.size(), 1, file);
+}
+
+// rgb rows top to bottom; the deflate stream uses stored blocks, which trades file size for an
+// encoder that keeps up with the frame rate
+bool writePng(const char* fileName, const unsigned char* rgb, int width, int height)
+{
+	FILE* file = fopen(fileName, "wb");
+	if (!file) return false;
+
+	static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+	fwrite(signature, 8, 1, file);
+
+	std::vector<unsigned char> header;
+	writeBigEndian(header, width);
+	writeBigEndian(header, height);
+	header.push_back(8);	// bits per channel
+	header.push_back(2);	// rgb
+	header.push_back(0);
+	header.push_back(0);
+	header.push_back(0);
+	writePngChunk(file, "IHDR", header);
+
+	// every row starts with filter type 0
+	std::vector<unsigned char> raw;
+	raw.reserve((size_t)(width * 3 + 1) * height);
+	for (int y = 0; y < height; y++)
+	{
+		raw.push_back(0);
+		raw.insert(raw.end(), rgb + (size_t)y * width * 3, rgb + (size_t)(y + 1) * width * 3);
+	}
+
+	std::vector<unsigned char> zlib;
+	zlib.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+	zlib.push_back(0x78);
+	zlib.push_back(0x01);
+	unsigned int a = 1, b = 0;
+	for (size_t offset = 0; offset < raw.size() || offset == 0; offset += 65535)
+	{
+		unsigned int length = (unsigned int)std::min<size_t>(65535, raw.size() - offset);
+		zlib.push_back(offset + length >= raw.size() ? 1 : 0);
+		zlib.push_back(length & 0xff);
+		zlib.push_back(length >> 8);
+		zlib.push_back(~length & 0xff);
+		zlib.push_back((~length >> 8) & 0xff);
+		zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + length);
+		for (unsigned int i = 0; i < length; i++)
+		{
+			a = (a + raw[offset + i]) % 65521;
+			b = (b + a) % 65521;
+		}
+		if (length == 0) break;
+	}
+	writeBigEndian(zlib, (b << 16) | a);
+	writePngChunk(file, "IDAT", zlib);
+	writePngChunk(file, "IEND", std::vector<unsigned char>());
+
+	bool ok = !ferror(file);
+	fclose(file);
+	return ok;
+}
+
+// reads finished frames into a ring of pixel buffer objects and maps each one a few frames later,
+// once its fence has signaled, so the readback never waits for the GPU; a writer thread turns the
+// frames into numbered PNG files or a Y4M stream that ffmpeg reads directly
+class FrameCapture
+{
+	struct Slot
+	{
+		GLBuffer buffer;
+		unsigned int bytes;
+		GLSync fence;
+		int width, height;
+	};
+
+	// empty pixels mark the end of a session
+	struct CapturedFrame
+	{
+		std::vector<unsigned char> pixels;
+		int width, height;
+		int session, frame;
+		CaptureFormat format;
+	};
+
+	std::vector<Slot> ring;
+	int oldest, inFlight;
+
+	bool recording;
+	int framesLeft;
+	int framesToSkip;
+	CaptureFormat format;
+	int session, frame;
+	bool sessionOpen;
+
+	std::thread writer;
+	std::mutex mutex;
+	std::condition_variable wake, drained;
+	std::vector<CapturedFrame> queue;
+	bool stopping;
+
+	// writer thread state
+	FILE* stream;
+	int streamWidth, streamHeight;
+
+	void Write()
+	{
+		std::vector<unsigned char> rgb;
+		for (;;)
+		{
+			CapturedFrame captured;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [this] { return stopping || !queue.empty(); });
+				if (queue.empty()) break;
+				captured = std::move(queue.front());
+				queue.erase(queue.begin());
+			}
+			drained.notify_all();
+
+			if (captured.pixels.empty()) {
+				CloseStream();
+				continue;
+			}
+
+			// rows arrive bottom up
+			int w = captured.width, h = captured.height;
+			rgb.resize((size_t)w * h * 3);
+			for (int y = 0; y < h; y++)
+			{
+				const unsigned char* src = &captured.pixels[(size_t)(h - 1 - y) * w * 4];
+				unsigned char* dst = &rgb[(size_t)y * w * 3];
+				for (int x = 0; x < w; x++, src += 4, dst += 3)
+				{
+					dst[0] = src[0];
+					dst[1] = src[1];
+					dst[2] = src[2];
+				}
+			}
+
+			if (captured.format == CapturePng) {
+				char fileName[64];
+				sprintf(fileName, "capture_%d_%06d.png", captured.session, captured.frame);
+				if (!writePng(fileName, &rgb[0], w, h)) printf("Cannot write %s\n", fileName);
+			}
+			else WriteY4m(rgb, w, h, captured.session);
+		}
+		CloseStream();
+	}
+
+	// full range BT.601 with 2x2 averaged chroma, the layout ffmpeg reads as C420jpeg; a new file
+	// starts when the window size changes, since a stream cannot change size
+	void WriteY4m(const std::vector<unsigned char>& rgb, int w, int h, int streamSession)
+	{
+		if (stream && (streamWidth != w || streamHeight != h)) CloseStream();
+		if (!stream) {
+			static int part = 0;
+			char fileName[64];
+			sprintf(fileName, "capture_%d_%d.y4m", streamSession, part++);
+			stream = fopen(fileName, "wb");
+			if (!stream) {
+				printf("Cannot write %s\n", fileName);
+				return;
+			}
+			fprintf(stream, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C420jpeg\n", w, h, captureFrameRate, std::max(1, captureFrameInterval));
+			streamWidth = w;
+			streamHeight = h;
+		}
+
+		int cw = (w + 1) / 2, ch = (h + 1) / 2;
+		std::vector<unsigned char> planes((size_t)w * h + (size_t)cw * ch * 2);
+		unsigned char* luma = &planes[0];
+		unsigned char* cb = luma + (size_t)w * h;
+		unsigned char* cr = cb + (size_t)cw * ch;
+		for (size_t i = 0; i < (size_t)w * h; i++)
+			luma[i] = (unsigned char)(0.299f * rgb[i * 3] + 0.587f * rgb[i * 3 + 1] + 0.114f * rgb[i * 3 + 2] + 0.5f);
+		for (int y = 0; y < ch; y++)
+		{
+			for (int x = 0; x < cw; x++)
+			{
+				float r = 0, g = 0, b = 0;
+				for (int k = 0; k < 4; k++)
+				{
+					size_t i = ((size_t)std::min(y * 2 + k / 2, h - 1) * w + std::min(x * 2 + k % 2, w - 1)) * 3;
+					r += rgb[i];
+					g += rgb[i + 1];
+					b += rgb[i + 2];
+				}
+				r *= 0.25f; g *= 0.25f; b *= 0.25f;
+				cb[y * cw + x] = (unsigned char)std::min(255.0f, std::max(0.0f, 128 - 0.168736f * r - 0.331264f * g + 0.5f * b + 0.5f));
+				cr[y * cw + x] = (unsigned char)std::min(255.0f, std::max(0.0f, 128 + 0.5f * r - 0.418688f * g - 0.081312f * b + 0.5f));
+			}
+		}
+		fputs("FRAME\n", stream);
+		fwrite(&planes[0], planes.size(), 1, stream);
+	}
+
+	void CloseStream()
+	{
+		if (stream) fclose(stream);
+		stream = 0;
+	}
+
+	// copies the oldest frame out of its buffer; without wait it gives up if the GPU is not done yet
+	bool Retire(bool wait)
+	{
+		Slot& slot = ring[oldest];
+		if (glClientWaitSync(slot.fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+			if (!wait) return false;
+			renderStats.captureStalls++;
+			glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+		}
+		slot.fence.Reset();
+
+		CapturedFrame captured;
+		captured.width = slot.width;
+		captured.height = slot.height;
+		captured.session = session;
+		captured.frame = frame++;
+		captured.format = format;
+		captured.pixels.resize((size_t)slot.width * slot.height * 4);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+		void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, captured.pixels.size(), GL_MAP_READ_BIT);
+		if (mapped) {
+			memcpy(&captured.pixels[0], mapped, captured.pixels.size());
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		oldest = (oldest + 1) % ring.size();
+		inFlight--;
+		if (mapped) Queue(std::move(captured));
+		renderStats.captureFrames++;
+		return true;
+	}
+
+	// a writer that falls behind holds back the render thread rather than dropping frames
+	void Queue(CapturedFrame&& captured)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (queue.size() >= captureQueueLimit) {
+			renderStats.captureStalls++;
+			drained.wait(lock, [this] { return queue.size() < captureQueueLimit; });
+		}
+		queue.push_back(std::move(captured));
+		wake.notify_one();
+	}
+
+	void EndSession()
+	{
+		while (inFlight > 0) Retire(true);
+		if (!sessionOpen) return;
+		sessionOpen = false;
+		Queue(CapturedFrame());
+	}
+
+public:
+	FrameCapture() : oldest(0), inFlight(0), recording(false), framesLeft(0), framesToSkip(0), format(CapturePng), session(0), frame(0),
+		sessionOpen(false), stopping(false), stream(0), streamWidth(0), streamHeight(0)
+	{
+		ring.resize(std::max(1, captureRingSize));
+		for (int i = 0; i < ring.size(); i++)
+		{
+			ring[i].buffer.Create();
+			ring[i].bytes = 0;
+		}
+		writer = std::thread(&FrameCapture::Write, this);
+	}
+
+	~FrameCapture()
+	{
+		EndSession();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		writer.join();
+	}
+
+	static bool IsSupported() { return GLEW_ARB_sync != 0; }
+
+	bool IsRecording() { return recording; }
+
+	// frameCount below zero records until Stop
+	void Start(CaptureFormat captureFormat, int frameCount = -1)
+	{
+		EndSession();
+		format = captureFormat;
+		framesLeft = frameCount;
+		framesToSkip = 0;
+		session++;
+		frame = 0;
+		recording = true;
+		sessionOpen = true;
+		printf("Capturing %s as session %d\n", format == CapturePng ? "PNG frames" : "a Y4M stream", session);
+	}
+
+	void Stop()
+	{
+		recording = false;
+		EndSession();
+	}
+
+	// after the frame is drawn and before the swap, with the finished image in the read buffer
+	void Capture(int width, int height)
+	{
+		if (!recording && inFlight == 0) return;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		while (inFlight > 0 && Retire(false));
+
+		bool read = recording && framesToSkip-- == 0;
+		if (read) {
+			framesToSkip = std::max(1, captureFrameInterval) - 1;
+			if (inFlight == ring.size()) Retire(true);
+
+			Slot& slot = ring[(oldest + inFlight) % ring.size()];
+			unsigned int bytes = (unsigned int)width * height * 4;
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+			if (slot.bytes != bytes) {
+				glBufferData(GL_PIXEL_PACK_BUFFER, bytes, NULL, GL_STREAM_READ);
+				slot.bytes = bytes;
+			}
+			glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			slot.fence.Create();
+			slot.width = width;
+			slot.height = height;
+			inFlight++;
+
+			if (framesLeft > 0 && --framesLeft == 0) recording = false;
+		}
+
+		// the last frames of a finished session are retired as their fences signal
+		if (!recording && inFlight == 0 && sessionOpen) {
+			sessionOpen = false;
+			Queue(CapturedFrame());
+		}
+
+		renderStats.captureMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+};
+
+FrameCapture* frameCapture;
+
+bool useMinimap = true;
+// how often a second the markers are redrawn; the terrain layer only when it changes
+float minimapRefreshRate = 10.0f;
+int minimapSize = 256;
+
+// a top-down map in the corner of the screen. ground and trees go into a cached terrain layer that
+// is rendered again only when they change; a few times a second the layer is copied into the map and
+// the coins, tigger and the car are drawn on top as one instanced sprite batch. in between, frames
+// only draw the finished map
+class Minimap
+{
+	MinimapShader* terrainShader;
+	MinimapShader* markerShader;
+	UpscaleShader* copyShader;
+	GLTexture terrainTexture, mapTexture;
+	GLFramebuffer terrainFramebuffer, mapFramebuffer;
+	GLVertexArray vao, quadVao;
+	GLBuffer instanceBuffer;
+	std::vector<ObjectSnapshot> trees;
+	std::vector<float> markers;
+	unsigned long long terrainSignature;
+	bool terrainDirty;
+	double lastRefresh;
+	mat4 VP;
+
+	static GLTexture NewLayer(GLFramebuffer& framebuffer)
+	{
+		GLTexture texture;
+		texture.Create();
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, minimapSize, minimapSize, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+		int previousFramebuffer;
+		glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+		framebuffer.Create();
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) printf("Minimap framebuffer incomplete\n");
+		glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+		return texture;
+	}
+
+	// the source covers the whole target it is drawn into
+	void Copy(unsigned int texture)
+	{
+		copyShader->Run();
+		copyShader->UploadSamplerID();
+		copyShader->UploadUpscaleAttributes(1, 1, 1.0f / minimapSize, 1.0f / minimapSize, 0);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glBindVertexArray(quadVao);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+	}
+
+	void AddMarker(const vec3& position, float size, vec3 color)
+	{
+		markers.push_back(position.x);
+		markers.push_back(position.z);
+		markers.push_back(size);
+		markers.push_back(color.x);
+		markers.push_back(color.y);
+		markers.push_back(color.z);
+	}
+
+public:
+	Minimap(UpscaleShader* copyShader) : copyShader(copyShader), terrainSignature(0), terrainDirty(true), lastRefresh(-1000)
+	{
+		terrainShader = new MinimapShader(false);
+		markerShader = new MinimapShader(true);
+		terrainTexture = NewLayer(terrainFramebuffer);
+		mapTexture = NewLayer(mapFramebuffer);
+		quadVao.Create();
+
+		// per instance: x and z on the ground, half size, then color
+		vao.Create();
+		glBindVertexArray(vao);
+		instanceBuffer.Create();
+		glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+		glEnableVertexAttribArray(11);
+		glVertexAttribPointer(11, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), NULL);
+		glVertexAttribDivisorARB(11, 1);
+		glEnableVertexAttribArray(12);
+		glVertexAttribPointer(12, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(3 * sizeof(float)));
+		glVertexAttribDivisorARB(12, 1);
+	}
+
+	~Minimap()
+	{
+		delete terrainShader;
+		delete markerShader;
+	}
+
+	// the markers are drawn as instances
+	static bool IsSupported() { return GLEW_ARB_instanced_arrays && GLEW_ARB_draw_instanced; }
+
+	unsigned int GetTerrainFramebuffer() { return terrainFramebuffer; }
+	unsigned int GetMapFramebuffer() { return mapFramebuffer; }
+	bool IsTerrainDirty() { return terrainDirty; }
+
+	// gathers the markers once a refresh is due, and marks the terrain for redrawing when a tree
+	// moved; returns whether the map is redrawn this frame
+	bool Update(FrameSnapshot& frame)
+	{
+		if (frame.time >= lastRefresh && frame.time - lastRefresh < 1.0f / minimapRefreshRate) return false;
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		lastRefresh = frame.time;
+
+		trees.clear();
+		unsigned long long signature = 14695981039346656037ULL;
+		float extent = 5;
+		for (int i = 0; i < frame.objects.size(); i++)
+		{
+			const ObjectSnapshot& object = frame.objects[i];
+			if (object.ID != 3) continue;
+			trees.push_back(object);
+			float key[4] = { object.position.x, object.position.z, object.scaling.x, object.orientation };
+			for (int k = 0; k < 4; k++)
+			{
+				unsigned int bits;
+				memcpy(&bits, &key[k], sizeof(bits));
+				signature = (signature ^ bits) * 1099511628211ULL;
+			}
+			extent = std::max(extent, std::max(fabsf(object.position.x), fabsf(object.position.z)) + 1);
+		}
+		if (signature != terrainSignature)
+		{
+			terrainSignature = signature;
+			terrainDirty = true;
+			// north is up, the map is centered on the world's origin
+			VP = mat4(
+				1 / extent, 0, 0, 0,
+				0, 0, 0, 0,
+				0, -1 / extent, 0, 0,
+				0, 0, 0, 1);
+		}
+
+		// sized in world units, so a marker covers the same share of the map at any extent
+		float unit = 1 / VP.m[0][0] * 0.02f;
+		markers.clear();
+		for (int i = 0; i < frame.objects.size(); i++)
+		{
+			const ObjectSnapshot& object = frame.objects[i];
+			if (object.destroy) continue;
+			if (object.ID == 2) AddMarker(object.position, unit, vec3(1, .8, .2));
+			else if (object.ID == 1) AddMarker(object.position, unit * 1.5f, vec3(1, .5, 0));
+			else if (object.ID == 4) AddMarker(object.position, unit * 2, vec3(.9, .1, .1));
+		}
+
+		renderStats.minimapMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		return true;
+	}
+
+	// ground and tree silhouettes, into the bound terrain layer
+	void DrawTerrain()
+	{
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		float clearColor[4];
+		glGetFloatv(GL_COLOR_CLEAR_VALUE, clearColor);
+		glClearColor(.75f, .8f, .85f, 1);
+		glClear(GL_COLOR_BUFFER_BIT);
+		glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+
+		terrainShader->Run();
+		terrainShader->UploadColor(vec3(.1, .4, .1));
+		for (int i = 0; i < trees.size(); i++)
+		{
+			mat4 M, InvM;
+			trees[i].BuildTransform(M, InvM);
+			mat4 MVP = M * VP;
+			terrainShader->UploadMVP(MVP);
+			trees[i].mesh->GetGeometry()->Draw();
+		}
+
+		terrainDirty = false;
+		renderStats.minimapTerrainRenders++;
+		renderStats.minimapMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	// the terrain layer with this refresh's markers on top, into the bound map
+	void DrawMarkers()
+	{
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		glDisable(GL_DEPTH_TEST);
+		Copy(terrainTexture);
+
+		int count = (int)markers.size() / 6;
+		if (count > 0) {
+			markerShader->Run();
+			markerShader->UploadMVP(VP);
+			glBindVertexArray(vao);
+			glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+			glBufferData(GL_ARRAY_BUFFER, markers.size() * sizeof(float), &markers[0], GL_STREAM_DRAW);
+			glDrawArraysInstancedARB(GL_TRIANGLE_STRIP, 0, 4, count);
+		}
+
+		renderStats.minimapRefreshes++;
+		renderStats.minimapMarkers = count;
+		renderStats.minimapMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	// the finished map in the top right corner of the bound target, inside a dark frame
+	void DrawOverlay(int width, int height)
+	{
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		int size = std::min(width, height) / 4, margin = 8, frame = 2;
+		int x = width - size - margin, y = height - size - margin;
+
+		float clearColor[4];
+		glGetFloatv(GL_COLOR_CLEAR_VALUE, clearColor);
+		glEnable(GL_SCISSOR_TEST);
+		glScissor(x - frame, y - frame, size + 2 * frame, size + 2 * frame);
+		glClearColor(0, 0, 0, 1);
+		glClear(GL_COLOR_BUFFER_BIT);
+		glDisable(GL_SCISSOR_TEST);
+		glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+
+		glDisable(GL_DEPTH_TEST);
+		glViewport(x, y, size, size);
+		Copy(mapTexture);
+		glViewport(0, 0, width, height);
+		renderStats.minimapMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+};
+
+Minimap* minimap = 0;
+
+
+class Object
+{
+	Shader* shader;
+	Mesh *mesh;
+
+	vec3 position;
+	vec3 scaling;
+	float orientation;
+	float angularV;
+	float angularA;
+	vec3 velocity = vec3(0, 0, 0);
+	vec3 acceleration; 
+	int ID;
+
+	float rotation;
+	// offset into the mesh's procedural animation, so copies do not move in lockstep
+	float animationPhase;
+	float ground;
+
+public:
+
+	bool destroy = false;
+
+	Object(Mesh *m, int inputID, vec3 position = vec3(0.0, 0.0, 0.0), vec3 scaling = vec3(1.0, 1.0, 1.0), float orientation = 0.0) : position(position), scaling(scaling), orientation(orientation), rotation(0), animationPhase(0), ground(-1)
+	{
+		shader = m->GetShader();
+		mesh = m;
+		ID = inputID;
+	}
+
+	vec3& GetPosition() { return position; }
+	float GetGround() { return ground; }
+
+	// levels are laid out on the plane y = -1; lifts the object by as much as the ground under it
+	// is higher
+	void PlaceOnGround()
+	{
+		float height = groundHeight(position.x, position.z);
+		position = vec3(position.x, position.y + height - ground, position.z);
+		ground = height;
+	}
+
+	void SetAnimationPhase(float phase) { animationPhase = phase; }
+
+	// runs on the simulation side, where the camera and keyboard state may be read
+	ObjectSnapshot Snapshot()
+	{
+		ObjectSnapshot state;
+		state.mesh = mesh;
+		state.shader = shader;
+		state.position = position;
+		state.scaling = scaling;
+		state.orientation = orientation;
+		state.rotation = rotation;
+
+		if (!keyboardState['t']) {
+			state.rotationAxis = (camera->GetLookAt() - camera->GetwEye()).normalize(); //axis from which the obj rotates u.y=0
+		}
+		else {
+			state.rotationAxis = (camera->GetLookAt() - initialPos).normalize(); //axis from which the obj rotates u.y=0
+		}
+
+		float radius = mesh->GetGeometry()->GetBoundingRadius();
+		state.radius = radius < 0 ? -1 : radius * std::max(fabs(scaling.x), std::max(fabs(scaling.y), fabs(scaling.z)));
+		state.animation = mesh->GetAnimation();
+		state.ground = ground;
+		state.animationPhase = animationPhase;
+		state.ID = ID;
+		state.destroy = destroy;
+		return state;
+	}
+
+	float getX()
+	{
+		return position.x;
+	}
+
+	float getY()
+	{
+		return position.y;
+	}
+
+	float getZ()
+	{
+		return position.z;
+	}
+
+	void setX(float x) {
+		position.x = x;
+	}
+
+	void setY(float y) {
+		position.y = y;
+	}
+
+	void setZ(float z) {
+		position.z = z;
+	}
+
+	void movePositionX(float x)
+	{
+		position.x += x;
+	}
+
+	void movePositionY(float y)
+	{
+		position.y += y;
+	}
+
+	void movePositionZ(float z)
+	{
+		position.z += z;
+	}
+
+	int getID()
+	{
+		return ID;
+	}
+
+	void setVelocity(vec3 v) {
+		velocity = v;
+	}
+
+	vec3 getVelocity() {
+		return velocity;
+	}
+
+	bool CollisionCoin(Object *target) {
+		if (target->getID() == 2) {
+			vec3 pos = this->GetPosition();
+			vec3 tarPos = target->GetPosition();
+			return (pos - tarPos).length() < 0.5;
+		}
+		else {
+			return false;
+		}
+		
+	}
+
+	bool CollisionTree(Object *target) {
+		if (target->getID() == 3) {
+			vec3 pos = this->GetPosition();
+			vec3 tarPos = target->GetPosition();
+
+			return (pos - tarPos).length() < 0.7;
+		}
+		else {
+			return false;
+		}
+	}
+
+	/* void MovePosition(vec3 pos, float dt) {
+		
+		vec3 dif = camera->GetLookAt() - camera->GetwEye();
+		velocity = dif * (keyboardState['w'] - keyboardState['s']);
+		position = position + velocity * dt;
+
+		if (keyboardState['a'] || keyboardState['d']) {
+			float angularSpeed = 180 / M_PI;
+			angularV = keyboardState['a'] * -angularSpeed + keyboardState['d'] * angularSpeed;
+			orientation += angularV * dt;
+
+		}
+		position = pos;
+		float angularSpeed = 180 / M_PI;
+		angularV = keyboardState['a'] * -angularSpeed + keyboardState['d'] * angularSpeed;
+		orientation += angularV * dt;
+
+
+
+		
+	}*/
+
+	void MovePosition(float dt) {
+
+		//        vec3 dif = camera.GetLookat()-camera.GetwEye();
+
+		//        velocity = dif * (keyboardState['w'] - keyboardState['s']);
+
+		//        SetAcceleration();
+		//        
+		//        if(keyboardState['w'] or keyboardState['s']){
+		//            velocity = velocity + acceleration * (keyboardState['w'] - keyboardState['s']);
+		//        } else {
+		//            velocity = velocity + acceleration;
+		//        }
+		//        
+
+		//        position = position + velocity * dt;
+
+		vec3 lookat = camera->GetLookAt();
+		ground = groundHeight(lookat.x, lookat.z);
+		position = vec3(lookat.x, ground + 0.2f, lookat.z);
+
+		if (keyboardState['a'] || keyboardState['d']) {
+			float angularSpeed = 180 / M_PI;
+			angularV = keyboardState['a'] * -angularSpeed + keyboardState['d'] * angularSpeed;
+			orientation += angularV * dt;
+
+		}
+	}
+
+	void frenet(float dt) {
+		if (keyboardState['d']) {
+			if (keyboardState['w']) {
+				rotation -= 60 * dt;
+				rotation = fmax(rotation, -5);
+
+			}
+			else if (keyboardState['s']) {
+				rotation += 60 * dt;
+				rotation = fmin(rotation, 5);
+
+			}
+			else {
+				if (rotation>0) {
+					rotation -= 60 * dt;
+					rotation = fmax(rotation, 0);
+
+				}
+				else {
+					rotation += 60 * dt;
+					rotation = fmin(rotation, 0);
+
+				}
+			}
+		}
+		else if (keyboardState['a']) {
+			if (keyboardState['w']) {
+				rotation += 60 * dt;
+				rotation = fmin(rotation, 5);
+
+			}
+			else if (keyboardState['s']) {
+				rotation -= 60 * dt;
+				rotation = fmax(rotation, -5);
+
+			}
+			else {
+				if (rotation>0) {
+					rotation -= 60 * dt;
+					rotation = fmax(rotation, 0);
+
+				}
+				else {
+					rotation += 60 * dt;
+					rotation = fmin(rotation, 0);
+
+				}
+			}
+
+		}
+		else {
+			if (rotation>0) {
+				rotation -= 60 * dt;
+				rotation = fmax(rotation, 0);
+			}
+			else {
+				rotation += 60 * dt;
+				rotation = fmin(rotation, 0);
+
+			}
+		}
+
+	}
+
+	void Rotate(float dt) {
+		rotation += dt * 200;
+	}
+
+	void Spin(float dt)
+	{
+		orientation += 100 * dt;
+	}
+
+	void Move(float dt)
+	{
+		velocity = velocity + acceleration*dt;
+		position = position + velocity *dt;
+		angularV = angularV + angularA * dt;
+		orientation = orientation + angularV * dt;
+	}
+
+	void SetOrientation(vec3 dir) {
+
+		vec3 v1 = dir.normalize();
+		vec3 v2 = vec3(0, 0, -1).normalize();
+
+		float cos = v1.x*v2.x + v1.z*v2.z;
+
+
+		float angle = acosf(cos) * 180 / M_PI;
+
+		if (v1.x < 0) angle = -angle;
+
+
+		orientation = angle + 180;
+	}
+
+	void Falling(float t, float dt) {
+		velocity = vec3(cos(5 * t), -2, sin(5 * t)).normalize();
+		SetOrientation(velocity);
+		position = position + velocity * dt;
+		
+	}
+
+};
+
+/*class Avatar : public Object
+{
+	vec3 position;
+	vec3 scaling;
+	float orientation;
+	float angularV;
+	float angularA;
+	vec3 velocity = vec3(0, 0, 0);
+	vec3 acceleration;
+
+public: Avatar(vec3 position, vec3 scaling, float orientation, vec3 velocity, vec3 acceleration) {
+	
+	
+	void Control(float dt, vec3& avatar position)
+
+	{
+	velocity  = veloctiy * 0.999
+	if (keyboardState['w']) {
+	}
+	}
+	avatar class
+	vec3 getahead()
+	float alpha = (orientation plus 180 ) * pi / 180
+	return vec3(cos(alpha), 0, sin(alpha))
+}
+};*/
+
+enum DepthPrepassMode { DepthPrepassOff, DepthPrepassOn, DepthPrepassAuto };
+DepthPrepassMode depthPrepassMode = DepthPrepassAuto;
+
+// decides per frame whether to lay down depth first; counts the fragments that pass the depth test
+// in the color pass (those are the ones shaded) and periodically probes the other mode to compare
+class DepthPrepassController
 {
-	unsigned int textureId;
+	static const int probeInterval = 60;
+	static const int queryCount = 4;
+
+	GLQuery queries[queryCount];
+	bool queryPrepass[queryCount];
+	bool queryActive[queryCount];
+	int frame;
+	bool querying;
+
+	double fragmentsWith, fragmentsWithout;
 
 public:
-	Texture(const std::string& inputFileName)
+	DepthPrepassController()
 	{
-		unsigned char* data;
-		int width; int height; int nComponents = 4;
-
-		data = stbi_load(inputFileName.c_str(), &width, &height, &nComponents, 0);
+		for (int i = 0; i < queryCount; i++) {
+			queries[i].Create();
+			queryActive[i] = false;
+		}
+		frame = 0;
+		querying = false;
+		fragmentsWith = fragmentsWithout = 0;
+	}
 
-		if (data == NULL)
+	bool Decide()
+	{
+		// results from a few frames back are read without waiting on the GPU
+		for (int i = 0; i < queryCount; i++)
 		{
-			return;
+			if (!queryActive[i]) continue;
+			int available = 0;
+			glGetQueryObjectiv(queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available) continue;
+			unsigned int samples = 0;
+			glGetQueryObjectuiv(queries[i], GL_QUERY_RESULT, &samples);
+			(queryPrepass[i] ? fragmentsWith : fragmentsWithout) = samples;
+			queryActive[i] = false;
 		}
 
-		glGenTextures(1, &textureId);
-		glBindTexture(GL_TEXTURE_2D, textureId);
-
-		if (nComponents == 3) glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-		if (nComponents == 4) glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+		if (depthPrepassMode != DepthPrepassAuto) return depthPrepassMode == DepthPrepassOn;
 
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		// the pre-pass costs a second vertex pass, so it has to save a good share of the shading
+		bool use;
+		if (fragmentsWith == 0) use = true;
+		else if (fragmentsWithout == 0) use = false;
+		else use = fragmentsWithout > 1.3 * fragmentsWith;
 
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		// now and then measure the other mode as well, the view may have changed since
+		if (frame % probeInterval == probeInterval - 1) use = !use;
+		return use;
+	}
 
-		delete data;
+	void BeginColorPass(bool prepass)
+	{
+		int slot = frame % queryCount;
+		querying = !queryActive[slot];
+		if (!querying) return;
+		queryPrepass[slot] = prepass;
+		glBeginQuery(GL_SAMPLES_PASSED, queries[slot]);
 	}
 
-	void Bind()
+	void EndColorPass(bool prepass)
 	{
-		glBindTexture(GL_TEXTURE_2D, textureId);
+		if (querying)
+		{
+			glEndQuery(GL_SAMPLES_PASSED);
+			queryActive[frame % queryCount] = true;
+		}
+		frame++;
+
+		renderStats.fragmentsWithPrepass = fragmentsWith;
+		renderStats.fragmentsWithoutPrepass = fragmentsWithout;
+		if (prepass) renderStats.prepassFrames++;
 	}
 };
 
+// everything the GL thread needs to issue one draw, recorded ahead of time by the workers
+// bounding spheres against the frustums of all of a frame's views, shared by the draw recorder and the
+// software renderer
+struct ViewCulling
+{
+	int viewCount, allViews;
+	float planes[maxSplitScreenViews][6][4];
+	float shadowLight[3];
 
-class Light {
-	vec3 La;
-	vec3 Le;
-	vec4 worldLightPosition;
-	
-
-public:
-	Light() :
-		La(1.0, 1.0, 1.0),
-		Le(1.0, 1.0, 1.0),
-		worldLightPosition(0, 0, 2.0, 1.0)
-	{}
+	void Set(FrameSnapshot& frame)
+	{
+		viewCount = (int)frame.views.size();
+		allViews = (1 << viewCount) - 1;
+		for (int v = 0; v < viewCount; v++) ExtractPlanes(v, frame.views[v].VP);
+		for (int i = 0; i < 3; i++) shadowLight[i] = frame.shadowLightPosition.v[i];
+	}
 
-	Light(vec3 La, vec3 Le, vec4 worldLightPosition) {
-		this->La = La;
-		this->Le = Le;
-		this->worldLightPosition = worldLightPosition;
+	// frustum planes of a row-vector VP: w + x, w - x, w + y, w - y, w + z, w - z
+	void ExtractPlanes(int view, mat4& VP)
+	{
+		for (int p = 0; p < 6; p++)
+		{
+			float* plane = planes[view][p];
+			int axis = p / 2;
+			float sign = p % 2 ? -1.0f : 1.0f;
+			for (int i = 0; i < 4; i++) plane[i] = VP.m[i][3] + sign * VP.m[i][axis];
+			float length = sqrtf(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+			for (int i = 0; i < 4; i++) plane[i] /= length;
+		}
 	}
 
-	void UploadAttributes(Shader* shader) {
-		shader->UploadLightAttributes(La, Le, worldLightPosition);
+	// one bit per view whose frustum the sphere reaches
+	int SphereViews(float x, float y, float z, float radius)
+	{
+		int mask = 0;
+		for (int v = 0; v < viewCount; v++)
+		{
+			int p = 0;
+			while (p < 6 && planes[v][p][0] * x + planes[v][p][1] * y + planes[v][p][2] * z + planes[v][p][3] >= -radius) p++;
+			if (p == 6) mask |= 1 << v;
+		}
+		return mask;
 	}
 
-	void SetPointLightSource(vec3& pos) {
-		worldLightPosition.v[0] = pos.x;
-		worldLightPosition.v[1] = pos.y;
-		worldLightPosition.v[2] = pos.z;
-		worldLightPosition.v[3] = 1.0;
+	int VisibleViews(const ObjectSnapshot& object)
+	{
+		if (object.radius < 0) return allViews;
+		return SphereViews(object.position.x, object.position.y, object.position.z, object.radius);
 	}
 
-	void SetDirectionalLightSource(vec3& dir) {
-		worldLightPosition.v[0] = dir.x;
-		worldLightPosition.v[1] = dir.y;
-		worldLightPosition.v[2] = dir.z;
-		worldLightPosition.v[3] = 0.0;
+	// the shadow shader projects every vertex from the light onto the ground, scaling its offset from
+	// the light by k = (ground - light.y) / (p.y - light.y); the projected sphere stays within
+	// radius * kMax + |center - light| * (kMax - kCenter) of the projected center. the light rises
+	// with the ground under the object
+	int ShadowViews(const ObjectSnapshot& object)
+	{
+		if (object.radius < 0) return allViews;
+		const vec3& c = object.position;
+		float lightY = shadowLight[1] + object.ground + 1;
+		float top = c.y + object.radius - lightY;
+		if (top >= 0) return allViews;
+
+		float ground = object.ground + 0.001f - lightY;
+		float kCenter = ground / (c.y - lightY);
+		float kMax = ground / top;
+		float dx = c.x - shadowLight[0], dy = c.y - lightY, dz = c.z - shadowLight[2];
+		float radius = object.radius * kMax + sqrtf(dx * dx + dy * dy + dz * dz) * (kMax - kCenter);
+		return SphereViews(shadowLight[0] + dx * kCenter, object.ground + 0.001f, shadowLight[2] + dz * kCenter, radius);
 	}
 };
 
-class Material
+struct DrawPacket
 {
 	Shader* shader;
-	Texture* texture;
-	vec3 ka;
-	vec3 kd;
-	vec3 ks;
-	float shininess;
+	GeometryDraw draw;
+	Material* material;	// 0 for passes that need only the geometry
+	float distance;
+	mat4 M, InvM, MVP;
+	const ProceduralAnimation* animation;
+	float animationPhase;
+	vec3 animationAxis;
+	float ground;	// under the object, for its shadow
+	int viewMask;	// split-screen views the draw goes to
+};
 
+// programs for the passes that draw geometry without its material
+struct PassShaders
+{
+	Shader* depth;
+	Shader* shadow;
+};
 
-public:
-	Material(Shader* s, vec3 ka, vec3 kd, vec3 ks, float shininess, Texture* t = 0)
-	{
-		shader = s;
-		texture = t;
-		this->ka = ka;
-		this->kd = kd;
-		this->ks = ks;
-		this->shininess = shininess;
-	}
+enum DrawList { DrawDepthList, DrawMainList, DrawShadowList, DrawListCount };
 
-	Shader* GetShader() { return shader; }
+// a distant object drawn as a quad of its mesh's impostor atlas
+struct ImpostorInstance
+{
+	ImpostorAtlas* atlas;
+	float sphere[4];
+	float yaw;
+	float ground;
+};
+
+enum ImpostorList { ImpostorColorList, ImpostorShadowList, ImpostorListCount };
+
+// linear per-slice storage; cleared every frame but keeps its capacity
+struct CommandBuffer
+{
+	std::vector<DrawPacket> packets[DrawListCount];
+	std::vector<ImpostorInstance> impostors[ImpostorListCount];
+	int culled;
+	double recordMs;	// spent recording this slice
 
-	void UploadAttributes()
+	void Reset()
 	{
-		if (texture)
-		{
-			shader->UploadMaterialAttributes(ka, kd, ks, shininess);
-			shader->UploadSamplerID();
-			texture->Bind();
-		}
+		for (int i = 0; i < DrawListCount; i++) packets[i].clear();
+		for (int i = 0; i < ImpostorListCount; i++) impostors[i].clear();
+		culled = 0;
 	}
 };
 
-class Mesh
+// records the frame's draws on the thread pool, one command buffer per slice of the object list,
+// and replays them on the GL thread in slice order, so the result matches a serial walk. with split
+// screen an object is culled against every view, recorded once and drawn to all views that see it
+class DrawRecorder
 {
-	Geometry* geometry;
-	Material* material;
+	static const int objectsPerSlice = 256;
+
+	std::vector<CommandBuffer> slices;
+	std::vector<const DrawPacket*> depthOrder;
+	std::vector<Shader*> preparedShaders;
+	std::vector<ImpostorAtlas*> impostorAtlases;
+	std::vector<std::vector<float> > impostorBatches;
+	Shader* replayShader;
+	Material* replayMaterial;
+	unsigned int replayVao;
+	ViewCulling culling;
+	int viewCount;
+	mat4 viewVP[maxSplitScreenViews];
+	vec4 viewRect[maxSplitScreenViews];
+	vec3 viewEye[maxSplitScreenViews];
+	int targetViewport[4];
+	float pixelsPerUnit;
+
+	// distance to the nearest eye among the views in the mask
+	float NearestEyeDistance(const vec3& position, int mask)
+	{
+		float nearest = FLT_MAX;
+		for (int v = 0; v < viewCount; v++)
+		{
+			if (!(mask & (1 << v))) continue;
+			float dx = position.x - viewEye[v].x, dy = position.y - viewEye[v].y, dz = position.z - viewEye[v].z;
+			nearest = std::min(nearest, sqrtf(dx * dx + dy * dy + dz * dz));
+		}
+		return nearest;
+	}
 
-public:
-	Mesh(Geometry* g, Material* m)
+	// range is one of the geometry's material ranges, -1 for all of it
+	void Emit(CommandBuffer& buffer, DrawList list, Shader* shader, const ObjectSnapshot& object, Material* material, bool depthOnly, float distance,
+		const mat4& M, const mat4& InvM, const mat4& MVP, int viewMask, int range = -1)
 	{
-		geometry = g;
-		material = m;
+		buffer.packets[list].push_back(DrawPacket());
+		DrawPacket& packet = buffer.packets[list].back();
+		packet.shader = shader;
+		object.mesh->GetGeometry()->GetDraw(range, depthOnly, packet.draw);
+		packet.material = material;
+		packet.distance = distance;
+		packet.M = M;
+		packet.InvM = InvM;
+		packet.MVP = MVP;
+		packet.animation = object.animation;
+		packet.animationPhase = object.animationPhase;
+		packet.animationAxis = object.rotationAxis;
+		packet.ground = object.ground;
+		packet.viewMask = viewMask;
 	}
 
-	Shader* GetShader() { return material->GetShader(); }
+	// a color packet per material range; passes without a material draw the whole buffer at once
+	void EmitColor(CommandBuffer& buffer, const ObjectSnapshot& object, const mat4& M, const mat4& InvM, const mat4& MVP, int viewMask)
+	{
+		Mesh* mesh = object.mesh;
+		if (mesh->GetRangeCount() == 1) {
+			Shader* shader = viewCount > 1 ? mesh->GetMultiViewShader() : object.shader;
+			Emit(buffer, DrawMainList, shader, object, mesh->GetMaterial(), false, 0, M, InvM, MVP, viewMask);
+			return;
+		}
+		for (int r = 0; r < mesh->GetRangeCount(); r++) {
+			Shader* shader = viewCount > 1 ? mesh->GetMultiViewShader(r) : mesh->GetShader(r);
+			Emit(buffer, DrawMainList, shader, object, mesh->GetMaterial(r), false, 0, M, InvM, MVP, viewMask, r);
+		}
+	}
 
-	void Draw()
+	void EmitImpostor(CommandBuffer& buffer, ImpostorList list, ImpostorAtlas* atlas, const ObjectSnapshot& object)
 	{
-		material->UploadAttributes();
-		geometry->Draw();
+		buffer.impostors[list].push_back(ImpostorInstance());
+		ImpostorInstance& instance = buffer.impostors[list].back();
+		instance.atlas = atlas;
+		instance.sphere[0] = object.position.x;
+		instance.sphere[1] = object.position.y;
+		instance.sphere[2] = object.position.z;
+		instance.sphere[3] = object.radius;
+		instance.yaw = object.orientation;
+		instance.ground = object.ground;
 	}
 
-	void UploadAttributes() {
-		material->UploadAttributes();
+	// the atlas holds only yaw and uniform scale, so anything tilted keeps its geometry; with split
+	// screen the object has to be far from every view that draws it
+	ImpostorAtlas* ImpostorFor(const ObjectSnapshot& object, int viewMask)
+	{
+		ImpostorAtlas* atlas = object.mesh->GetImpostor();
+		if (!useImpostors || !atlas || object.rotation != 0) return 0;
+		if (object.scaling.x != object.scaling.y || object.scaling.x != object.scaling.z) return 0;
+		return NearestEyeDistance(object.position, viewMask) > impostorDistance ? atlas : 0;
 	}
-};
 
-Light* light;
-Light* spotlight;
-vec3 initialPos;
-vec3 initialHat;
+	void RecordSlice(int slice, FrameSnapshot& frame, bool prepass, const PassShaders& still, const PassShaders& animated)
+	{
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		CommandBuffer& buffer = slices[slice];
+		buffer.Reset();
 
+		std::vector<ObjectSnapshot>& objects = frame.objects;
+		int begin = slice * objectsPerSlice;
+		int end = std::min((int)objects.size(), begin + objectsPerSlice);
 
-class Camera {
-	vec3  wEye, wLookat, wVup;
-	float fov, asp, fp, bp;
+		for (int i = begin; i < end; i++)
+		{
+			// the ground, flat or terrain, casts no shadow
+			const ObjectSnapshot& object = objects[i];
+			int shadowViews = object.ID != 5 && !object.destroy ? culling.ShadowViews(object) : 0;
+			int visibleViews = culling.VisibleViews(object);
+			bool shadowed = shadowViews != 0, visible = visibleViews != 0;
+			if (!visible) buffer.culled++;
+			if (!visible && !shadowed) continue;
+
+			ImpostorAtlas* atlas = ImpostorFor(object, visibleViews | shadowViews);
+			if (atlas) {
+				if (visible) EmitImpostor(buffer, ImpostorColorList, atlas, object);
+				if (shadowed) EmitImpostor(buffer, ImpostorShadowList, atlas, object);
+				continue;
+			}
 
-	vec3 velocity;
-	vec3 acc;
-	float angularVelocity;
+			mat4 M, InvM;
+			object.BuildTransform(M, InvM);
+			mat4 MVP = M * frame.VP;
+			Shader* depthShader = object.animation ? animated.depth : still.depth;
+			Shader* shadowShader = object.animation ? animated.shadow : still.shadow;
+			float distance = object.radius < 0 ? FLT_MAX : NearestEyeDistance(object.position, visibleViews);
 
-public:
-	Camera()
+			if (prepass)
+			{
+				if (visible) {
+					Emit(buffer, DrawDepthList, depthShader, object, 0, true, distance, M, InvM, MVP, visibleViews);
+					EmitColor(buffer, object, M, InvM, MVP, visibleViews);
+				}
+				if (shadowed) Emit(buffer, DrawShadowList, shadowShader, object, 0, false, 0, M, InvM, MVP, shadowViews);
+			}
+			else
+			{
+				if (shadowed) Emit(buffer, DrawMainList, shadowShader, object, 0, false, 0, M, InvM, MVP, shadowViews);
+				if (visible) EmitColor(buffer, object, M, InvM, MVP, visibleViews);
+			}
+
+			// on-screen diameter, which decides how much of the texture has to be streamed in
+			if (visible && textureStreamer) {
+				distance = std::max(distance, frame.camera.GetNearPlane());
+				for (int r = 0; r < object.mesh->GetRangeCount(); r++)
+					object.mesh->GetMaterial(r)->RequestTextureDetail(object.radius < 0 ? FLT_MAX : 2 * object.radius * pixelsPerUnit / distance);
+			}
+		}
+		buffer.recordMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	// view and light uniforms are the same for every draw of a frame, so each program gets them once
+	void PrepareShader(Shader* shader, FrameSnapshot& frame)
 	{
-		wEye = vec3(0.0, -0.5, 2.5);
-		wLookat = vec3(0.0, -0.5, 0.0);
-		wVup = vec3(0.0, 1.0, 0.0);
-		fov = M_PI / 4.0; asp = 1.0; fp = 0.01; bp = 10.0;
-		velocity = 0; angularVelocity = 0;
+		for (int i = 0; i < preparedShaders.size(); i++) if (preparedShaders[i] == shader) return;
+		preparedShaders.push_back(shader);
+
+		shader->UploadVP(frame.VP);
+		frame.camera.UploadAttribtes(shader);
+		frame.light.UploadAttributes(shader);
+		shader->UploadShadowLight(frame.shadowLightPosition);
+		if (clusteredLighting) clusteredLighting->UploadAttributes(shader);
+		if (viewCount > 1) shader->UploadViews(viewCount, viewVP, viewRect, viewEye);
 	}
 
-	void SetAcceleration() {
-		vec3 dif = wLookat - wEye;
+	typedef void (DrawRecorder::*MeshDraw)(MeshShader* shader, const DrawPacket& packet, FrameSnapshot& frame);
 
-		if (keyboardState['w'] || keyboardState['s']) {
-			acc = dif * 0.03;
+	template<unsigned int Features>
+	void DrawMesh(MeshShader* shader, const DrawPacket& packet, FrameSnapshot& frame)
+	{
+		Draw(static_cast<MeshVariant<Features>*>(shader), packet, frame);
+	}
+
+	// the typed draw of every mesh variant, indexed by feature set
+	struct MeshDraws
+	{
+		typedef MeshDraw Entry;
+		template<unsigned int Features>
+		static Entry Make() { return &DrawRecorder::DrawMesh<Features>; }
+	};
+
+	// the program's class, and for mesh programs the feature set, picks its typed draw, so no
+	// virtual call is left per object
+	void Issue(const DrawPacket& packet, FrameSnapshot& frame)
+	{
+		static const MeshDraw* meshDraws = meshVariantTable<MeshDraws>(std::make_integer_sequence<unsigned int, MeshFeatureCombinations>());
+		switch (packet.shader->GetClass())
+		{
+		case MeshShaderClass: {
+			MeshShader* shader = static_cast<MeshShader*>(packet.shader);
+			(this->*meshDraws[shader->GetFeatures()])(shader, packet, frame);
+			break;
 		}
-		else {
-			if (velocity.length() > 0) {
-				acc = velocity * -0.01;
+		case InfiniteQuadShaderClass: Draw(static_cast<InfiniteQuadShader*>(packet.shader), packet, frame); break;
+		case DepthShaderClass: Draw(static_cast<DepthShader*>(packet.shader), packet, frame); break;
+		case ShadowShaderClass: Draw(static_cast<ShadowShader*>(packet.shader), packet, frame); break;
+		default: printf("Shader class %d is not drawn by the recorder\n", (int)packet.shader->GetClass()); break;
+		}
+	}
+
+	// the packet's uniforms go through the program's parameter blocks, located the first time it draws
+	template<class ShaderT>
+	void Draw(ShaderT* shader, const DrawPacket& packet, FrameSnapshot& frame)
+	{
+		if (shader != replayShader) {
+			shader->Run();
+			if (!shader->drawParams.IsLocated()) {
+				shader->drawParams.Locate(shader->GetProgram());
+				shader->materialParams.Locate(shader->GetProgram());
 			}
+			PrepareShader(shader, frame);
+			replayShader = shader;
+			replayMaterial = 0;
+		}
+
+		DrawUniforms uniforms;
+		uniforms.M = &packet.M;
+		uniforms.InvM = &packet.InvM;
+		uniforms.MVP = &packet.MVP;
+		uniforms.spinAngle = packet.animation ? wrappedSpinAngle(packet.animation, packet.animationPhase, frame.time) : 0;
+		uniforms.spinAxis = packet.animationAxis;
+		uniforms.groundHeight = packet.ground;
+		uniforms.viewMask = packet.viewMask;
+		shader->drawParams.Upload(uniforms);
+		int instances = viewCount > 1 ? viewMaskCount(packet.viewMask) : 1;
+
+		// animated meshes draw their material with a variant of its shader
+		if (packet.material && packet.material != replayMaterial) {
+			packet.material->Bind(shader);
+			replayMaterial = packet.material;
+		}
 
+		// the geometry's part was resolved when the packet was recorded
+		const GeometryDraw& draw = packet.draw;
+		if (draw.vao != replayVao) {
+			glBindVertexArray(draw.vao);
+			replayVao = draw.vao;
 		}
+		if (draw.blend) {
+			glEnable(GL_BLEND);
+			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		}
+		if (draw.indexBuffer) {
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, draw.indexBuffer);
+			const void* offset = (const void*)(draw.first * sizeof(unsigned short));
+			if (instances > 1) glDrawElementsInstancedARB(draw.mode, draw.count, GL_UNSIGNED_SHORT, offset, instances);
+			else glDrawElements(draw.mode, draw.count, GL_UNSIGNED_SHORT, offset);
+			if (packet.material) {
+				renderStats.terrainDrawn++;
+				renderStats.terrainTriangles += draw.count / 3 * instances;
+			}
+		}
+		else if (instances > 1) glDrawArraysInstancedARB(draw.mode, draw.first, draw.count, instances);
+		else glDrawArrays(draw.mode, draw.first, draw.count);
+		if (draw.blend) glDisable(GL_BLEND);
+		renderStats.draws++;
+		renderStats.vertices += draw.count * instances;
 	}
 
-	void Control() {
-		//the 2 speeds include directions
-		float speed = 1;
-		vec3 dif = wLookat - wEye;
+public:
+	void Record(FrameSnapshot& frame, bool prepass, const PassShaders& still, const PassShaders& animated)
+	{
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
 
-		SetAcceleration();
+		culling.Set(frame);
+		viewCount = (int)frame.views.size();
+		for (int v = 0; v < viewCount; v++)
+		{
+			FrameView& view = frame.views[v];
+			viewVP[v] = view.VP;
+			viewRect[v] = view.rect;
+			viewEye[v] = view.camera.GetwEye();
+		}
+		glGetIntegerv(GL_VIEWPORT, targetViewport);
+		pixelsPerUnit = targetViewport[3] * viewRect[0].v[3] / (2 * tanf(frame.camera.GetFov() / 2));
+		int sliceCount = ((int)frame.objects.size() + objectsPerSlice - 1) / objectsPerSlice;
+		if (slices.size() < sliceCount) slices.resize(sliceCount);
+		for (int i = sliceCount; i < slices.size(); i++) slices[i].Reset();
+
+		std::chrono::high_resolution_clock::time_point parallelStart = std::chrono::high_resolution_clock::now();
+		threadPool->ParallelFor(sliceCount, [&](int slice) { RecordSlice(slice, frame, prepass, still, animated); });
+		renderStats.recordParallelMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - parallelStart).count();
+		renderStats.recordJobs += sliceCount;
+		for (int i = 0; i < sliceCount; i++) renderStats.recordJobMs += slices[i].recordMs;
+
+		// front to back; the ground is unbounded and sorts last
+		depthOrder.clear();
+		for (int i = 0; i < sliceCount; i++)
+		{
+			std::vector<DrawPacket>& packets = slices[i].packets[DrawDepthList];
+			for (int j = 0; j < packets.size(); j++) depthOrder.push_back(&packets[j]);
+		}
+		std::stable_sort(depthOrder.begin(), depthOrder.end(),
+			[](const DrawPacket* a, const DrawPacket* b) { return a->distance < b->distance; });
 
-		if (keyboardState['w'] || keyboardState['s']) {
-			if ((velocity.x*dif.x + velocity.z*dif.z) < 5) {
-				velocity = velocity + acc * (keyboardState['w'] * speed + keyboardState['s'] * -speed);
-			}
+		preparedShaders.clear();
+
+		renderStats.recordMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		renderStats.objects += (int)frame.objects.size();
+		for (int i = 0; i < sliceCount; i++) renderStats.culled += slices[i].culled;
+	}
+
+	void Replay(DrawList list, FrameSnapshot& frame)
+	{
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+		replayShader = 0;
+		replayMaterial = 0;
+		replayVao = 0;
+		// every recorded draw is depth tested
+		glEnable(GL_DEPTH_TEST);
+		// each view's instances are clipped to its rectangle
+		if (viewCount > 1) for (int i = 0; i < 4; i++) glEnable(GL_CLIP_DISTANCE0 + i);
+		if (list == DrawDepthList) {
+			for (int i = 0; i < depthOrder.size(); i++) Issue(*depthOrder[i], frame);
 		}
 		else {
-			velocity = velocity + acc * speed;
+			for (int i = 0; i < slices.size(); i++) {
+				std::vector<DrawPacket>& packets = slices[i].packets[list];
+				for (int j = 0; j < packets.size(); j++) Issue(packets[j], frame);
+			}
 		}
+		if (viewCount > 1) for (int i = 0; i < 4; i++) glDisable(GL_CLIP_DISTANCE0 + i);
+		glDisable(GL_DEPTH_TEST);
 
+		renderStats.replayMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
 
-		float angularSpeed = 1;
+	// one instanced draw per atlas and view, in slice order
+	void ReplayImpostors(ImpostorList list, ImpostorShader* shader, FrameSnapshot& frame)
+	{
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+		impostorAtlases.clear();
+		for (int i = 0; i < slices.size(); i++) {
+			std::vector<ImpostorInstance>& instances = slices[i].impostors[list];
+			for (int j = 0; j < instances.size(); j++) {
+				if (std::find(impostorAtlases.begin(), impostorAtlases.end(), instances[j].atlas) == impostorAtlases.end())
+					impostorAtlases.push_back(instances[j].atlas);
+			}
+		}
+		if (impostorAtlases.empty()) return;
+
+		impostorBatches.resize(impostorAtlases.size());
+		for (int a = 0; a < impostorAtlases.size(); a++) {
+			std::vector<float>& data = impostorBatches[a];
+			data.clear();
+			for (int i = 0; i < slices.size(); i++) {
+				std::vector<ImpostorInstance>& instances = slices[i].impostors[list];
+				for (int j = 0; j < instances.size(); j++) {
+					if (instances[j].atlas != impostorAtlases[a]) continue;
+					data.insert(data.end(), instances[j].sphere, instances[j].sphere + 4);
+					data.push_back(instances[j].yaw);
+					data.push_back(instances[j].ground);
+				}
+			}
+		}
 
-		angularVelocity = keyboardState['a'] * -angularSpeed + keyboardState['d'] * angularSpeed;
+		shader->Run();
+		frame.light.UploadAttributes(shader);
+		shader->UploadShadowLight(frame.shadowLightPosition);
+		for (int v = 0; v < viewCount; v++) {
+			FrameView& view = frame.views[v];
+			if (viewCount > 1) setViewViewport(targetViewport, view.rect);
+			shader->UploadVP(view.VP);
+			view.camera.UploadAttribtes(shader);
+			for (int a = 0; a < impostorAtlases.size(); a++) impostorAtlases[a]->Draw(shader, impostorBatches[a]);
+		}
+		if (viewCount > 1) glViewport(targetViewport[0], targetViewport[1], targetViewport[2], targetViewport[3]);
+
+		renderStats.replayMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
 	}
+};
 
-	/*void Control() {
-		float speed = 1;
-		vec3 dif = wLookat - wEye;
-		velocity = dif * (keyboardState['w'] * speed + keyboardState['s'] * -speed);
+bool useParticles = true;
 
-		float angularSpeed = 1;
-		angularVelocity = keyboardState['a'] * -angularSpeed + keyboardState['d'] * angularSpeed;
+// a burst of particles leaving one point, queued by the simulation and emitted on the GPU
+struct ParticleEmitter
+{
+	vec3 position;
+	vec3 velocity;
+	vec3 color;
+	float spread;	// random velocity added in every direction
+	float lifetime;	// seconds, each particle gets between half and all of it
+	float size;		// world-space sprite diameter
+	int count;
+
+	ParticleEmitter(vec3 position, vec3 velocity, vec3 color, float spread, float lifetime, float size, int count) :
+		position(position), velocity(velocity), color(color), spread(spread), lifetime(lifetime), size(size), count(count) { }
+};
 
-		
-	}*/
+// particle state lives in two transform feedback buffers that swap roles every frame: the update
+// pass reads one, writes the survivors and then the new emissions into the other, and the sprite
+// pass draws what was written, so the CPU only hands over emitter events and never sees a count
+class ParticleSystem
+{
+	static const int capacity = 1 << 16;
+	static const int floatsPerParticle = 12;
+	static const int queryCount = 4;
+
+	ParticleUpdateShader* updateShader;
+	ParticleSpriteShader* spriteShader;
+
+	GLBuffer buffers[2];
+	GLTransformFeedback feedbacks[2];
+	GLVertexArray vaos[2];
+	GLVertexArray emitVao;
+	int current;
+	bool primed;
+	unsigned int seed;
+	std::chrono::steady_clock::time_point lastUpdate;
+
+	std::mutex mutex;
+	std::vector<ParticleEmitter> queued, emitting;
+	// the origin particle positions are relative to, guarded by mutex
+	WorldOrigin origin;
+
+	// particles written and GPU time of recent updates, read once available
+	GLQuery countQueries[queryCount], timeQueries[queryCount];
+	bool queryActive[queryCount];
+	int frame;
+	bool timing;
 
-	vec3 GetLookAt()
+public:
+	ParticleSystem()
 	{
-		return wLookat;
-	}
+		updateShader = new ParticleUpdateShader();
+		spriteShader = new ParticleSpriteShader();
 
-	vec3 GetwEye()
-	{
-		return wEye;
+		for (int i = 0; i < 2; i++)
+		{
+			buffers[i].Create();
+			feedbacks[i].Create();
+			vaos[i].Create();
+			glBindBuffer(GL_ARRAY_BUFFER, buffers[i]);
+			glBufferData(GL_ARRAY_BUFFER, capacity * floatsPerParticle * sizeof(float), NULL, GL_DYNAMIC_COPY);
+
+			glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, feedbacks[i]);
+			glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, buffers[i]);
+
+			glBindVertexArray(vaos[i]);
+			for (int a = 0; a < 3; a++)
+			{
+				glEnableVertexAttribArray(13 + a);
+				glVertexAttribPointer(13 + a, 4, GL_FLOAT, GL_FALSE, floatsPerParticle * sizeof(float), (void*)(a * 4 * sizeof(float)));
+			}
+		}
+		glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
+
+		// emission reads no attributes, each new particle is made from gl_VertexID
+		emitVao.Create();
+
+		current = 0;
+		primed = false;
+		seed = 1;
+		lastUpdate = std::chrono::steady_clock::now();
+
+		timing = GLEW_ARB_timer_query != 0;
+		for (int i = 0; i < queryCount; i++) {
+			countQueries[i].Create();
+			if (timing) timeQueries[i].Create();
+			queryActive[i] = false;
+		}
+		frame = 0;
 	}
 
-	void SetwEye(vec3 v)
+	~ParticleSystem()
 	{
-		wEye = v;
+		delete updateShader;
+		delete spriteShader;
 	}
 
-	void setEyeX(float x) {
-		wEye.x = x;
-	}
+	// geometry shaders and drawing straight from a feedback object
+	static bool IsSupported() { return GLEW_VERSION_3_2 && GLEW_ARB_transform_feedback2; }
 
-	void setEyeZ(float z) {
-		wEye.z = z;
+	// may be called from the simulation thread, with a position relative to its origin
+	void Emit(const ParticleEmitter& emitter)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		queued.push_back(emitter);
+		queued.back().position = queued.back().position + worldOrigin.Offset(origin);
 	}
 
+	// particles and emitters follow the origin of the frame being drawn; they bounce off a plane at
+	// the height of the ground under the car, where nearly all of them are thrown up
+	void Update(const WorldOrigin& frameOrigin, float ground)
+	{
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		float dt = std::min(std::chrono::duration<float>(now - lastUpdate).count(), 0.1f);
+		lastUpdate = now;
+
+		vec3 shift;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			emitting.swap(queued);
+			shift = origin.Offset(frameOrigin);
+			origin = frameOrigin;
+		}
+		for (int i = 0; i < emitting.size(); i++) emitting[i].position = emitting[i].position + shift;
 
-	void TrackingShot(float t)
-	{
-		wEye = heart(t);
-	}
+		for (int i = 0; i < queryCount; i++)
+		{
+			if (!queryActive[i]) continue;
+			int available = 0;
+			glGetQueryObjectiv(timing ? timeQueries[i] : countQueries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available) continue;
+			unsigned int written = 0;
+			glGetQueryObjectuiv(countQueries[i], GL_QUERY_RESULT, &written);
+			renderStats.particles = written;
+			if (timing) {
+				GLuint64 elapsed = 0;
+				glGetQueryObjectui64v(timeQueries[i], GL_QUERY_RESULT, &elapsed);
+				renderStats.particleUpdateMs = elapsed / 1e6;
+			}
+			queryActive[i] = false;
+		}
 
-	void setVelocity(vec3 v) {
-		velocity = v;
-	}
+		if (!primed && emitting.empty()) return;
 
-	vec3 getVelocity() {
-		return velocity;
-	}
+		int slot = frame++ % queryCount;
+		bool querying = !queryActive[slot];
 
-	vec3 heart(float t) {
-		vec3 v0 = vec3(0, 0, -2).normalize();
-		vec3 v1 = (wLookat - initialPos).normalize();
-		float co = v0.z*v1.z; // dot product
-		float si = cross(v0, v1).length(); // size of cross product
+		int source = current, target = 1 - current;
+		updateShader->Run();
+		updateShader->UploadStep(dt, seed);
 
-										   //        vec3 heartToEye = vec3(x(t),0,z(t)) - wEye;
+		glEnable(GL_RASTERIZER_DISCARD);
+		glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, feedbacks[target]);
+		if (querying) {
+			glBeginQuery(GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN, countQueries[slot]);
+			if (timing) glBeginQuery(GL_TIME_ELAPSED, timeQueries[slot]);
+		}
+		glBeginTransformFeedback(GL_POINTS);
+
+		if (primed) {
+			updateShader->UploadEmitting(false);
+			updateShader->UploadOriginShift(shift);
+			updateShader->UploadGroundHeight(ground);
+			glBindVertexArray(vaos[source]);
+			glDrawTransformFeedback(GL_POINTS, feedbacks[source]);
+		}
 
-		float heartToEyeX = x(t);
-		float heartToEyeZ = z(t) - 2;
+		// whatever does not fit in the buffer is dropped by the feedback stage
+		updateShader->UploadEmitting(true);
+		glBindVertexArray(emitVao);
+		for (int i = 0; i < emitting.size(); i++)
+		{
+			ParticleEmitter& e = emitting[i];
+			updateShader->UploadStep(dt, seed);
+			updateShader->UploadEmitter(e.position, e.velocity, e.color, e.spread, e.lifetime, e.size);
+			glDrawArrays(GL_POINTS, 0, std::min(e.count, capacity));
+			seed += 4 * e.count;
+		}
+		emitting.clear();
 
-		vec3 eyeToPos = vec3(heartToEyeX*co - heartToEyeZ*si, 0, heartToEyeX*si + heartToEyeZ*co);
+		glEndTransformFeedback();
+		if (querying) {
+			glEndQuery(GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN);
+			if (timing) glEndQuery(GL_TIME_ELAPSED);
+			queryActive[slot] = true;
+		}
+		glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
+		glDisable(GL_RASTERIZER_DISCARD);
 
-		return eyeToPos + initialPos;
+		current = target;
+		primed = true;
+		renderStats.particleSubmitMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - now).count();
 	}
 
+	// additive and without depth writes, so the order of particles does not matter
+	void Draw(FrameView& view)
+	{
+		if (!primed) return;
 
-	//parametric function scaled down by 17/2
-	float x(float t) {
-		return 16 * sin(t)*sin(t)*sin(t) / 3;
-	}
+		int viewport[4];
+		glGetIntegerv(GL_VIEWPORT, viewport);
+		spriteShader->Run();
+		spriteShader->UploadVP(view.VP);
+		spriteShader->UploadPixelsPerUnit(viewport[3] / (2 * tanf(view.camera.GetFov() / 2)));
 
-	float z(float t) {
-		t += M_PI;
-		return -(13 * cos(t) - 5 * cos(2 * t) - 2 * cos(3 * t) - cos(4 * t)) / 3;
-	}
+		glEnable(GL_DEPTH_TEST);
+		glDepthMask(GL_FALSE);
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+		glEnable(GL_PROGRAM_POINT_SIZE);
+		glEnable(GL_POINT_SPRITE);
 
-	void Move(float dt) {
-		wEye = wEye + velocity*dt;
-		wLookat = wLookat + velocity * dt;
+		glBindVertexArray(vaos[current]);
+		glDrawTransformFeedback(GL_POINTS, feedbacks[current]);
 
-		vec3 w = (wLookat - wEye).normalize();
-		vec3 v = wVup.normalize();
-		vec3 u = cross(w, v);
+		glDisable(GL_POINT_SPRITE);
+		glDisable(GL_PROGRAM_POINT_SIZE);
+		glDisable(GL_BLEND);
+		glDepthMask(GL_TRUE);
+		glDisable(GL_DEPTH_TEST);
+	}
+};
 
-		vec3 wPrime = (w*cos(angularVelocity*dt) + u * sin(angularVelocity*dt)) * (wLookat - wEye).length();
-		//wLookat = wPrime + wEye;
-		//wEye = wLookat - wPrime;
+ParticleSystem* particleSystem = 0;
 
-		if (keyboardState['t']) {
-			wPrime = (w*cos(dt) + u * sin(dt)) * (wLookat - wEye).length();
-		}
-			wEye = wLookat - wPrime;
-		
+// a terrain tile drops to its next level of detail beyond this distance, which doubles for every further level
+float terrainLodDistance = 48;
 
-		
+// heightfield terrain in tiles of chunkCells units around the cameras. worker threads sample the
+// heightmap for tiles coming into view, at the level of detail they are needed at, and the GL thread
+// uploads them. every level halves the grid (geomipmapping); a tile is drawn at the level its
+// distance asks for, or coarser while a finer copy is on its way, and never more than one level
+// from its neighbours. the edge next to a coarser neighbour skips its odd vertices, so the two meet
+// without cracks; that makes one shared index buffer per stored level, drawn level and set of
+// coarser sides. the tiles in view distance join the frame's objects as ground, so the draw recorder
+// culls and draws them like any other mesh
+class Terrain
+{
+	static const int chunkCells = 32;
+	static const int lodCount = 5;
 
-	}
+	typedef std::pair<long long, long long> TileKey;
 
+	struct TileRequest
+	{
+		TileKey key;
+		int level;
+		float distance;
+	};
 
-	void UploadAttribtes(Shader* shader) {
-		shader->UploadEyePosition(wEye);
-	}
+	struct Tile
+	{
+		TileKey key;
+		int level;
+		float centerHeight, radius;
+		std::vector<float> vertices;
+	};
 
-	void SetAspectRatio(float a) { asp = a; }
+	struct Chunk
+	{
+		TileKey key;
+		TerrainChunk* geometry;
+		Mesh* mesh;
+		int storedLevel, drawnLevel;
+		float centerHeight;
+		unsigned int bytes;
+		bool inRange;
+		Chunk* neighbours[4];	// west, east, north, south, when in range
+	};
 
-	mat4 GetViewMatrix()
+	Material* material;
+	Shader* multiViewShader;
+	std::map<TileKey, Chunk> chunks;
+	std::vector<Chunk*> inRange;
+	std::vector<TileRequest> wanted;
+	GLBuffer indexBuffers[lodCount][lodCount][16];
+	// the same lists for the software renderer
+	std::vector<unsigned int> indexLists[lodCount][lodCount][16];
+	unsigned int residentBytes, indexBytes;
+
+	std::vector<std::thread> generators;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::vector<TileRequest> requests;
+	// taken by a generator and not yet uploaded
+	std::vector<TileKey> busy;
+	std::vector<Tile> results, finished;
+	bool stopping;
+
+	// the tile's grid at its level, with the heights one sample past every side for the normals
+	static void BuildTile(const TileRequest& request, Tile& tile)
 	{
-		vec3 w = (wEye - wLookat).normalize();
-		vec3 u = cross(wVup, w).normalize();
-		vec3 v = cross(w, u);
+		int step = 1 << request.level, side = chunkCells / step + 1, border = side + 2;
+		double x0 = (double)request.key.first * chunkCells, z0 = (double)request.key.second * chunkCells;
+		std::vector<float> heights(border * border);
+		float low = FLT_MAX, high = -FLT_MAX;
+		for (int j = 0; j < border; j++)
+		{
+			for (int i = 0; i < border; i++)
+			{
+				float h = (float)terrainSample(x0 + (i - 1) * step, z0 + (j - 1) * step);
+				heights[j * border + i] = h;
+				if (i < 1 || j < 1 || i > side || j > side) continue;
+				low = std::min(low, h);
+				high = std::max(high, h);
+			}
+		}
 
-		return
-			mat4(
-				1.0f, 0.0f, 0.0f, 0.0f,
-				0.0f, 1.0f, 0.0f, 0.0f,
-				0.0f, 0.0f, 1.0f, 0.0f,
-				-wEye.x, -wEye.y, -wEye.z, 1.0f) *
-			mat4(
-				u.x, v.x, w.x, 0.0f,
-				u.y, v.y, w.y, 0.0f,
-				u.z, v.z, w.z, 0.0f,
-				0.0f, 0.0f, 0.0f, 1.0f);
+		float half = chunkCells * 0.5f;
+		tile.key = request.key;
+		tile.level = request.level;
+		tile.centerHeight = (low + high) * 0.5f;
+		tile.radius = sqrtf(2 * half * half + (high - low) * (high - low) * 0.25f);
+		tile.vertices.resize(side * side * 8);
+		for (int j = 0; j < side; j++)
+		{
+			for (int i = 0; i < side; i++)
+			{
+				const float* h = &heights[(j + 1) * border + i + 1];
+				vec3 normal = vec3(h[-1] - h[1], 2.0f * step, h[-border] - h[border]).normalize();
+				float* v = &tile.vertices[(j * side + i) * 8];
+				v[0] = i * step - half;
+				v[1] = h[0] - tile.centerHeight;
+				v[2] = j * step - half;
+				// one repeat of the texture per unit, as on the flat ground
+				v[3] = (float)(i * step);
+				v[4] = (float)(j * step);
+				v[5] = normal.x;
+				v[6] = normal.y;
+				v[7] = normal.z;
+			}
+		}
 	}
 
-	mat4 GetProjectionMatrix()
+	void Generate()
 	{
-		float sy = 1 / tan(fov / 2);
-		return mat4(
-			sy / asp, 0.0f, 0.0f, 0.0f,
-			0.0f, sy, 0.0f, 0.0f,
-			0.0f, 0.0f, -(fp + bp) / (bp - fp), -1.0f,
-			0.0f, 0.0f, -2 * fp*bp / (bp - fp), 0.0f);
-	}
-};
+		for (;;)
+		{
+			TileRequest request;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [this] { return stopping || !requests.empty(); });
+				if (stopping) return;
+				request = requests.front();
+				requests.erase(requests.begin());
+				busy.push_back(request.key);
+			}
 
-Camera* camera;
+			Tile tile;
+			BuildTile(request, tile);
 
-class Object
-{
-	Shader* shader;
-	Mesh *mesh;
+			std::lock_guard<std::mutex> lock(mutex);
+			results.push_back(std::move(tile));
+		}
+	}
 
-	vec3 position;
-	vec3 scaling;
-	float orientation;
-	float angularV;
-	float angularA;
-	vec3 velocity = vec3(0, 0, 0);
-	vec3 acceleration; 
-	int ID;
+	// grid vertex (i, j) of the drawn level, as an index into the stored level's vertices; on the
+	// coarser sides, odd vertices along the edge move onto the even one before them, which leaves only
+	// the neighbour's vertices on the edge, and the triangles there degenerate or fanned
+	static unsigned short GridIndex(int i, int j, int cells, int coarser, int stride, int side)
+	{
+		if ((((coarser & 1) && i == 0) || ((coarser & 2) && i == cells)) && (j & 1)) j--;
+		if ((((coarser & 4) && j == 0) || ((coarser & 8) && j == cells)) && (i & 1)) i--;
+		return (unsigned short)(j * stride * side + i * stride);
+	}
 
-	float rotation;
+	// made on first use; each cell is split along the diagonal terrainHeight assumes
+	unsigned int IndexBuffer(int stored, int drawn, int coarser, int& count)
+	{
+		int cells = chunkCells >> drawn;
+		count = cells * cells * 6;
+		GLBuffer& buffer = indexBuffers[stored][drawn][coarser];
+		if (buffer) return buffer;
+
+		int stride = 1 << (drawn - stored), side = (chunkCells >> stored) + 1;
+		std::vector<unsigned short> indices;
+		indices.reserve(count);
+		for (int j = 0; j < cells; j++)
+		{
+			for (int i = 0; i < cells; i++)
+			{
+				unsigned short v00 = GridIndex(i, j, cells, coarser, stride, side), v10 = GridIndex(i + 1, j, cells, coarser, stride, side);
+				unsigned short v01 = GridIndex(i, j + 1, cells, coarser, stride, side), v11 = GridIndex(i + 1, j + 1, cells, coarser, stride, side);
+				unsigned short cell[] = { v00, v10, v11, v00, v11, v01 };
+				indices.insert(indices.end(), cell, cell + 6);
+			}
+		}
 
-public:
+		// uploaded through the array binding, so no vertex array's element binding changes
+		buffer.Create();
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		glBufferData(GL_ARRAY_BUFFER, indices.size() * sizeof(unsigned short), &indices[0], GL_STATIC_DRAW);
+		indexBytes += (unsigned int)(indices.size() * sizeof(unsigned short));
+		indexLists[stored][drawn][coarser].assign(indices.begin(), indices.end());
+		return buffer;
+	}
 
-	bool destroy = false;
+	static int LevelFor(float distance)
+	{
+		int level = 0;
+		while (level < lodCount - 1 && distance > terrainLodDistance * (1 << level)) level++;
+		return level;
+	}
 
-	Object(Mesh *m, int inputID, vec3 position = vec3(0.0, 0.0, 0.0), vec3 scaling = vec3(1.0, 1.0, 1.0), float orientation = 0.0) : position(position), scaling(scaling), orientation(orientation)
+	void Release(Chunk& chunk)
 	{
-		shader = m->GetShader();
-		mesh = m;
-		ID = inputID;
+		delete chunk.mesh;
+		delete chunk.geometry;
+		residentBytes -= chunk.bytes;
 	}
 
-	vec3& GetPosition() { return position; }
+	// a tile replaces what is resident of it only with more detail
+	void Upload(Tile& tile)
+	{
+		std::map<TileKey, Chunk>::iterator existing = chunks.find(tile.key);
+		if (existing != chunks.end()) {
+			if (existing->second.storedLevel <= tile.level) return;
+			Release(existing->second);
+		}
 
-	void DrawShadow(Shader* shadowShader) {
-		shadowShader->Run();
-		
-		UploadAttributes(shadowShader);
-		
-		light->UploadAttributes(shadowShader);
-		camera->UploadAttribtes(shadowShader);
+		Chunk& chunk = chunks[tile.key];
+		chunk.key = tile.key;
+		chunk.geometry = new TerrainChunk(tile.vertices, tile.radius);
+		chunk.mesh = new Mesh(chunk.geometry, material);
+		chunk.mesh->SetMultiViewShader(multiViewShader);
+		chunk.storedLevel = tile.level;
+		chunk.drawnLevel = tile.level;
+		chunk.centerHeight = tile.centerHeight;
+		chunk.bytes = (unsigned int)(tile.vertices.size() * sizeof(float));
+		chunk.inRange = false;
+		residentBytes += chunk.bytes;
+	}
 
-		mesh->Draw();
+	Chunk* InRange(long long x, long long z)
+	{
+		std::map<TileKey, Chunk>::iterator chunk = chunks.find(TileKey(x, z));
+		return chunk != chunks.end() && chunk->second.inRange ? &chunk->second : 0;
 	}
 
-	void Draw()
+public:
+	Terrain(Material* material, Shader* multiViewShader, int generatorCount = 2) : material(material), multiViewShader(multiViewShader)
 	{
-		shader->Run();
-		camera->UploadAttribtes(shader);
-		light->UploadAttributes(shader);
-		UploadAttributes(shader);
-		mesh->Draw();
+		residentBytes = indexBytes = 0;
+		stopping = false;
+		for (int i = 0; i < generatorCount; i++) generators.push_back(std::thread(&Terrain::Generate, this));
 	}
 
-	void UploadAttributes(Shader* shader)
+	~Terrain()
 	{
-		mat4 T = mat4(
-			1.0, 0.0, 0.0, 0.0,
-			0.0, 1.0, 0.0, 0.0,
-			0.0, 0.0, 1.0, 0.0,
-			position.x, position.y, position.z, 1.0);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (int i = 0; i < generators.size(); i++) generators[i].join();
 
-		mat4 InvT = mat4(
-			1.0, 0.0, 0.0, 0.0,
-			0.0, 1.0, 0.0, 0.0,
-			0.0, 0.0, 1.0, 0.0,
-			-position.x, -position.y, -position.z, 1.0);
+		for (std::map<TileKey, Chunk>::iterator i = chunks.begin(); i != chunks.end(); i++) Release(i->second);
+	}
 
-		mat4 S = mat4(
-			scaling.x, 0.0, 0.0, 0.0,
-			0.0, scaling.y, 0.0, 0.0,
-			0.0, 0.0, scaling.z, 0.0,
-			0.0, 0.0, 0.0, 1.0);
+	// uploads the tiles generated since the last frame, asks for the ones the views need nearest first,
+	// picks every tile's level and adds the tiles in view distance to the frame's objects
+	void Update(FrameSnapshot& frame)
+	{
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
 
-		mat4 InvS = mat4(
-			1.0 / scaling.x, 0.0, 0.0, 0.0,
-			0.0, 1.0 / scaling.y, 0.0, 0.0,
-			0.0, 0.0, 1.0 / scaling.z, 0.0,
-			0.0, 0.0, 0.0, 1.0);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			finished.swap(results);
+			for (int i = 0; i < finished.size(); i++) busy.erase(std::find(busy.begin(), busy.end(), finished[i].key));
+		}
+		for (int i = 0; i < finished.size(); i++) Upload(finished[i]);
+		renderStats.terrainGenerated += (int)finished.size();
+		finished.clear();
 
-		float alpha = orientation / 180.0 * M_PI;
-		float beta = rotation / 180.0 * M_PI;
+		std::vector<TileKey> taken;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			taken = busy;
+		}
 
-		mat4 R = mat4(
-			cos(alpha), 0.0, sin(alpha), 0.0,
-			0.0, 1.0, 0.0, 0.0,
-			-sin(alpha), 0.0, cos(alpha), 0.0,
-			0.0, 0.0, 0.0, 1.0);
+		// tiles reaching into the view distance of any view; distances are taken along the ground
+		float half = chunkCells * 0.5f, reach = terrainViewDistance + half * 1.4143f;
+		double originX = frame.origin.GetX(), originZ = frame.origin.GetZ();
+		float minX = FLT_MAX, maxX = -FLT_MAX, minZ = FLT_MAX, maxZ = -FLT_MAX;
+		for (int v = 0; v < frame.views.size(); v++)
+		{
+			vec3 eye = frame.views[v].camera.GetwEye();
+			minX = std::min(minX, eye.x);
+			maxX = std::max(maxX, eye.x);
+			minZ = std::min(minZ, eye.z);
+			maxZ = std::max(maxZ, eye.z);
+		}
+		long long firstX = (long long)floor((originX + minX - reach) / chunkCells), lastX = (long long)floor((originX + maxX + reach) / chunkCells);
+		long long firstZ = (long long)floor((originZ + minZ - reach) / chunkCells), lastZ = (long long)floor((originZ + maxZ + reach) / chunkCells);
 
-		mat4 InvR = mat4(
-			cos(alpha), 0.0, -sin(alpha), 0.0,
-			0.0, 1.0, 0.0, 0.0,
-			sin(alpha), 0.0, cos(alpha), 0.0,
-			0.0, 0.0, 0.0, 1.0);
+		for (std::map<TileKey, Chunk>::iterator i = chunks.begin(); i != chunks.end(); i++) i->second.inRange = false;
+		inRange.clear();
+		wanted.clear();
+		for (long long z = firstZ; z <= lastZ; z++)
+		{
+			for (long long x = firstX; x <= lastX; x++)
+			{
+				vec3 center = frame.origin.ToLocal((double)x * chunkCells + half, 0, (double)z * chunkCells + half);
+				float distance = FLT_MAX;
+				for (int v = 0; v < frame.views.size(); v++)
+				{
+					vec3 eye = frame.views[v].camera.GetwEye();
+					distance = std::min(distance, sqrtf((center.x - eye.x) * (center.x - eye.x) + (center.z - eye.z) * (center.z - eye.z)));
+				}
+				if (distance > reach) continue;
+
+				TileKey key(x, z);
+				int level = LevelFor(distance);
+				std::map<TileKey, Chunk>::iterator resident = chunks.find(key);
+				if (resident != chunks.end()) {
+					Chunk& chunk = resident->second;
+					chunk.inRange = true;
+					chunk.drawnLevel = std::max(level, chunk.storedLevel);
+					inRange.push_back(&chunk);
+					if (chunk.storedLevel <= level) continue;
+				}
+				if (std::find(taken.begin(), taken.end(), key) != taken.end()) continue;
+				TileRequest request = { key, level, distance };
+				wanted.push_back(request);
+			}
+		}
 
-		vec3 u;
-		if (!keyboardState['t']) {
-			u = (camera->GetLookAt() - camera->GetwEye()).normalize(); //axis from which the obj rotates u.y=0
+		std::sort(wanted.begin(), wanted.end(), [](const TileRequest& a, const TileRequest& b) { return a.distance < b.distance; });
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			requests.clear();
+			for (int i = 0; i < wanted.size(); i++) {
+				if (std::find(busy.begin(), busy.end(), wanted[i].key) == busy.end()) requests.push_back(wanted[i]);
+			}
 		}
-		else {
-			u = (camera->GetLookAt() - initialPos).normalize(); //axis from which the obj rotates u.y=0
+		if (!wanted.empty()) wake.notify_all();
+
+		// out of range by more than a tile, so a tile on the edge is not dropped and asked for again
+		// as the cameras move back and forth
+		for (std::map<TileKey, Chunk>::iterator i = chunks.begin(); i != chunks.end();)
+		{
+			Chunk& chunk = i->second;
+			vec3 center = frame.origin.ToLocal((double)chunk.key.first * chunkCells + half, 0, (double)chunk.key.second * chunkCells + half);
+			bool keep = chunk.inRange;
+			for (int v = 0; v < frame.views.size() && !keep; v++)
+			{
+				vec3 eye = frame.views[v].camera.GetwEye();
+				keep = (center.x - eye.x) * (center.x - eye.x) + (center.z - eye.z) * (center.z - eye.z) < (reach + chunkCells) * (reach + chunkCells);
+			}
+			if (keep) {
+				i++;
+				continue;
+			}
+			Release(chunk);
+			chunks.erase(i++);
 		}
 
+		// neighbours at most one level apart, by coarsening the finer side until nothing changes
+		for (int i = 0; i < inRange.size(); i++)
+		{
+			Chunk* chunk = inRange[i];
+			long long x = chunk->key.first, z = chunk->key.second;
+			chunk->neighbours[0] = InRange(x - 1, z);
+			chunk->neighbours[1] = InRange(x + 1, z);
+			chunk->neighbours[2] = InRange(x, z - 1);
+			chunk->neighbours[3] = InRange(x, z + 1);
+		}
+		for (bool changed = true; changed;)
+		{
+			changed = false;
+			for (int i = 0; i < inRange.size(); i++)
+			{
+				Chunk* chunk = inRange[i];
+				for (int n = 0; n < 4; n++)
+				{
+					if (chunk->neighbours[n] && chunk->neighbours[n]->drawnLevel > chunk->drawnLevel + 1) {
+						chunk->drawnLevel = chunk->neighbours[n]->drawnLevel - 1;
+						changed = true;
+					}
+				}
+			}
+		}
 
-		mat4 Rz =
-			mat4(cos(beta) + u.x*u.x*(1 - cos(beta)), -u.z*sin(beta), u.x*u.z*(1 - cos(beta)), 0,
-				u.z*sin(beta), cos(beta), -u.x*sin(beta), 0,
-				u.z*u.x*(1 - cos(beta)), u.x*sin(beta), cos(beta) + u.z*u.z*(1 - cos(beta)), 0,
-				0, 0, 0, 1
-			);
+		for (int i = 0; i < inRange.size(); i++)
+		{
+			Chunk* chunk = inRange[i];
+			int coarser = 0, count;
+			for (int n = 0; n < 4; n++) {
+				if (chunk->neighbours[n] && chunk->neighbours[n]->drawnLevel > chunk->drawnLevel) coarser |= 1 << n;
+			}
+			unsigned int indices = IndexBuffer(chunk->storedLevel, chunk->drawnLevel, coarser, count);
+			chunk->geometry->SetIndices(indices, &indexLists[chunk->storedLevel][chunk->drawnLevel][coarser][0], count);
+
+			ObjectSnapshot object;
+			object.mesh = chunk->mesh;
+			object.shader = material->GetShader();
+			object.position = frame.origin.ToLocal((double)chunk->key.first * chunkCells + half, chunk->centerHeight, (double)chunk->key.second * chunkCells + half);
+			object.scaling = vec3(1, 1, 1);
+			object.orientation = 0;
+			object.rotation = 0;
+			object.rotationAxis = vec3(0, 1, 0);
+			object.radius = chunk->geometry->GetBoundingRadius();
+			object.ground = object.position.y;
+			object.animation = 0;
+			object.animationPhase = 0;
+			object.ID = 5;
+			object.destroy = false;
+			frame.objects.push_back(object);
+		}
 
-		mat4 InvRz =
-			mat4(cos(beta) + u.x*u.x*(1 - cos(beta)), u.z*sin(beta), u.z*u.x*(1 - cos(beta)), 0,
-				-u.z*sin(beta), cos(beta), u.x*sin(beta), 0,
-				u.x*u.z*(1 - cos(beta)), -u.x*sin(beta), cos(beta) + u.z*u.z*(1 - cos(beta)), 0,
-				0, 0, 0, 1
-			);
+		renderStats.terrainChunks = (int)chunks.size();
+		renderStats.terrainBytes = residentBytes + indexBytes;
+		renderStats.terrainPending = (int)(wanted.size());
+		renderStats.terrainDistance = terrainViewDistance;
+		renderStats.terrainMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+};
 
-		mat4 M = S * R * Rz * T;
-		mat4 InvM = InvT * InvRz * InvR *  InvS;
+// when set, the scene is drawn by the software renderer on the thread pool and GL only shows the image
+bool useSoftwareRenderer = false;
 
-		mat4 MVP = M * camera->GetViewMatrix() * camera->GetProjectionMatrix();
-		mat4 VP = camera->GetViewMatrix() * camera->GetProjectionMatrix();
+// draws the frame on the CPU, for machines without a GPU. objects are culled as for the GL passes,
+// their vertices transformed four at a time, and their triangles and planar shadows clipped to the
+// near plane and binned to screen tiles, one job per slice of the object list. the thread pool then
+// rasterizes the tiles in parallel into a visibility buffer of depth, triangle and barycentrics, and
+// shades each visible pixel once: the mesh shader's Phong model, the tiled infinite ground traced per
+// pixel, and the point lights binned to the tile. rows are bottom up, as GL reads them back
+class SoftwareRenderer
+{
+	static const int tileSize = 32;
+	static const int objectsPerJob = 8;
 
-		shader->UploadVP(VP);
-		shader->UploadInvM(InvM);
-		shader->UploadMVP(MVP);
-		shader->UploadM(M);
-	}
+	// RGBA, with a box-filtered mip chain
+	struct Image
+	{
+		std::vector<std::vector<unsigned char> > levels;
+		std::vector<int> widths, heights;
+	};
 
-	float getX()
+	struct Surface
 	{
-		return position.x;
-	}
+		vec3 ka, kd, ks;
+		float shininess;
+		Image* image;
+	};
 
-	float getY()
+	// interpolated in this order when a triangle is clipped
+	struct Vertex
 	{
-		return position.y;
-	}
+		float clip[4];
+		float world[3];
+		float normal[3];
+		float uv[2];
+	};
 
-	float getZ()
+	// the edge functions are divided by the area, so at a pixel center they are its barycentrics
+	struct Triangle
 	{
-		return position.z;
-	}
+		float edge[3][3];
+		float invW[3];
+		int vertices[3];
+		int bounds[4];	// pixel centers covered, inclusive
+		int job, view;
+		const Surface* surface;	// 0 for a shadow
+		float lod;
+	};
 
-	void setX(float x) {
-		position.x = x;
-	}
+	// a slice of the object list; its vertices, triangles and bins are its own, so jobs need no locks
+	struct Job
+	{
+		int index;
+		std::vector<Vertex> vertices;
+		std::vector<Triangle> triangles;
+		std::vector<std::vector<int> > bins;
+		std::vector<const Surface*> rangeSurfaces;
+		int transformed, binned;
+		double ms;
+	};
 
-	void setY(float y) {
-		position.y = y;
-	}
+	struct ViewSetup
+	{
+		int x, y, width, height;
+		mat4 VP;
+		vec3 eye, u, v, w;
+		float tanHalfFov, aspect, nearPlane, farPlane;
+		// the infinite ground, if the frame has one
+		const Surface* ground;
+		float groundHeight;
+	};
 
-	void setZ(float z) {
-		position.z = z;
+	UpscaleShader* blitShader;
+	GLTexture texture;
+	GLVertexArray vao;
+	int textureWidth, textureHeight;
+
+	int width, height, tilesX, tilesY;
+	std::vector<unsigned char> color;
+	std::vector<Job> jobs;
+	int jobCount;
+	std::vector<std::vector<int> > tileLights;
+	std::vector<double> tileMs;
+	std::vector<PointLight> lights;
+	std::map<std::string, Image*> images;
+	std::map<Material*, Surface> surfaces;
+
+	ViewCulling culling;
+	ViewSetup views[maxSplitScreenViews];
+	int viewCount;
+	double time;
+	vec3 La, Le;
+	vec4 lightPosition;
+
+	Image* LoadImage(const std::string& fileName)
+	{
+		std::map<std::string, Image*>::iterator found = images.find(fileName);
+		if (found != images.end()) return found->second;
+
+		Image* image = 0;
+		int w, h, nComponents;
+		unsigned char* data = stbi_load(fileName.c_str(), &w, &h, &nComponents, 4);
+		if (data) {
+			image = new Image();
+			image->levels.push_back(std::vector<unsigned char>(data, data + w * h * 4));
+			image->widths.push_back(w);
+			image->heights.push_back(h);
+			stbi_image_free(data);
+			while (w > 1 || h > 1) {
+				unsigned char* level = downsampleBox(&image->levels.back()[0], w, h, 4, w, h);
+				image->levels.push_back(std::vector<unsigned char>(level, level + w * h * 4));
+				image->widths.push_back(w);
+				image->heights.push_back(h);
+				delete[] level;
+			}
+		}
+		else printf("Software renderer cannot load %s\n", fileName.c_str());
+		images[fileName] = image;
+		return image;
 	}
 
-	void movePositionX(float x)
+	const Surface* SurfaceFor(Material* material)
 	{
-		position.x += x;
+		std::map<Material*, Surface>::iterator found = surfaces.find(material);
+		if (found != surfaces.end()) return &found->second;
+
+		Surface& surface = surfaces[material];
+		surface.ka = material->GetAmbient();
+		surface.kd = material->GetDiffuse();
+		surface.ks = material->GetSpecular();
+		surface.shininess = material->GetShininess();
+		std::string fileName = material->GetTextureFileName();
+		surface.image = fileName.empty() ? 0 : LoadImage(fileName);
+		return &surface;
 	}
 
-	void movePositionY(float y)
+	// bilinear from the nearest level, repeating like the GL textures
+	static void Sample(const Image* image, float u, float v, float lod, float* texel)
 	{
-		position.y += y;
+		int level = std::min((int)(lod + 0.5f), (int)image->levels.size() - 1);
+		int w = image->widths[level], h = image->heights[level];
+		const unsigned char* pixels = &image->levels[level][0];
+		float x = (u - floorf(u)) * w - 0.5f, y = (v - floorf(v)) * h - 0.5f;
+		float fx = floorf(x), fy = floorf(y), tx = x - fx, ty = y - fy;
+		int x0 = ((int)fx + w) % w, y0 = ((int)fy + h) % h, x1 = (x0 + 1) % w, y1 = (y0 + 1) % h;
+		const unsigned char* p00 = pixels + (y0 * w + x0) * 4, *p10 = pixels + (y0 * w + x1) * 4;
+		const unsigned char* p01 = pixels + (y1 * w + x0) * 4, *p11 = pixels + (y1 * w + x1) * 4;
+		for (int c = 0; c < 3; c++)
+		{
+			float top = p00[c] + (p10[c] - p00[c]) * tx, bottom = p01[c] + (p11[c] - p01[c]) * tx;
+			texel[c] = (top + (bottom - top) * ty) * (1 / 255.0f);
+		}
 	}
 
-	void movePositionZ(float z)
+	// one vertex of TransformVertices
+	static void TransformVertex(const float* source, const mat4& W, const mat4& N, const mat4& VP, const float* shadow, Vertex& out)
 	{
-		position.z += z;
+		float world[3];
+		for (int c = 0; c < 3; c++) world[c] = source[0] * W.m[0][c] + source[1] * W.m[1][c] + source[2] * W.m[2][c] + W.m[3][c];
+		if (shadow) {
+			float k = (shadow[3] - shadow[1]) / (world[1] - shadow[1]);
+			world[0] = shadow[0] + (world[0] - shadow[0]) * k;
+			world[1] = shadow[3];
+			world[2] = shadow[2] + (world[2] - shadow[2]) * k;
+		}
+		for (int c = 0; c < 4; c++) out.clip[c] = world[0] * VP.m[0][c] + world[1] * VP.m[1][c] + world[2] * VP.m[2][c] + VP.m[3][c];
+		for (int c = 0; c < 3; c++) {
+			out.world[c] = world[c];
+			out.normal[c] = source[5] * N.m[0][c] + source[6] * N.m[1][c] + source[7] * N.m[2][c];
+		}
+		out.uv[0] = source[3];
+		out.uv[1] = source[4];
 	}
 
-	int getID()
+	// world = position * W, normal = normal * N and clip = world * VP; a shadow is cast from the point
+	// shadow[0..2] onto the plane y = shadow[3], as the shadow shader does it
+	static void TransformVertices(const float* source, int count, const mat4& W, const mat4& N, const mat4& VP, const float* shadow, Vertex* out)
 	{
-		return ID;
-	}
+		int i = 0;
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE__)
+		for (; i + 4 <= count; i += 4)
+		{
+			const float* s = source + i * 8;
+			__m128 x = _mm_setr_ps(s[0], s[8], s[16], s[24]);
+			__m128 y = _mm_setr_ps(s[1], s[9], s[17], s[25]);
+			__m128 z = _mm_setr_ps(s[2], s[10], s[18], s[26]);
+			__m128 world[3];
+			for (int c = 0; c < 3; c++)
+				world[c] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(W.m[0][c])), _mm_mul_ps(y, _mm_set1_ps(W.m[1][c]))),
+					_mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(W.m[2][c])), _mm_set1_ps(W.m[3][c])));
+			if (shadow) {
+				__m128 lightY = _mm_set1_ps(shadow[1]), plane = _mm_set1_ps(shadow[3]);
+				__m128 k = _mm_div_ps(_mm_sub_ps(plane, lightY), _mm_sub_ps(world[1], lightY));
+				for (int c = 0; c < 3; c += 2) {
+					__m128 light = _mm_set1_ps(shadow[c]);
+					world[c] = _mm_add_ps(light, _mm_mul_ps(_mm_sub_ps(world[c], light), k));
+				}
+				world[1] = plane;
+			}
 
-	void setVelocity(vec3 v) {
-		velocity = v;
+			float clip[4][4], result[6][4];
+			for (int c = 0; c < 4; c++)
+				_mm_storeu_ps(clip[c], _mm_add_ps(_mm_add_ps(_mm_mul_ps(world[0], _mm_set1_ps(VP.m[0][c])), _mm_mul_ps(world[1], _mm_set1_ps(VP.m[1][c]))),
+					_mm_add_ps(_mm_mul_ps(world[2], _mm_set1_ps(VP.m[2][c])), _mm_set1_ps(VP.m[3][c]))));
+			__m128 nx = _mm_setr_ps(s[5], s[13], s[21], s[29]);
+			__m128 ny = _mm_setr_ps(s[6], s[14], s[22], s[30]);
+			__m128 nz = _mm_setr_ps(s[7], s[15], s[23], s[31]);
+			for (int c = 0; c < 3; c++) {
+				_mm_storeu_ps(result[c], world[c]);
+				_mm_storeu_ps(result[3 + c], _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, _mm_set1_ps(N.m[0][c])), _mm_mul_ps(ny, _mm_set1_ps(N.m[1][c]))),
+					_mm_mul_ps(nz, _mm_set1_ps(N.m[2][c]))));
+			}
+
+			for (int j = 0; j < 4; j++)
+			{
+				Vertex& v = out[i + j];
+				for (int c = 0; c < 4; c++) v.clip[c] = clip[c][j];
+				for (int c = 0; c < 3; c++) {
+					v.world[c] = result[c][j];
+					v.normal[c] = result[3 + c][j];
+				}
+				v.uv[0] = s[j * 8 + 3];
+				v.uv[1] = s[j * 8 + 4];
+			}
+		}
+#endif
+		for (; i < count; i++) TransformVertex(source + i * 8, W, N, VP, shadow, out[i]);
 	}
 
-	vec3 getVelocity() {
-		return velocity;
+	// the rotation of the animated shaders' spinMatrix, as a row-vector matrix
+	void SpinMatrix(const ObjectSnapshot& object, mat4& S)
+	{
+		float b = (float)(wrappedSpinAngle(object.animation, object.animationPhase, time) / 180.0 * M_PI);
+		float c = cosf(b), s = sinf(b);
+		const vec3& u = object.rotationAxis;
+		S = mat4(c + u.x * u.x * (1 - c), -u.z * s, u.x * u.z * (1 - c), 0,
+			u.z * s, c, -u.x * s, 0,
+			u.z * u.x * (1 - c), u.x * s, c + u.z * u.z * (1 - c), 0,
+			0, 0, 0, 1);
 	}
 
-	bool CollisionCoin(Object *target) {
-		if (target->getID() == 2) {
-			vec3 pos = this->GetPosition();
-			vec3 tarPos = target->GetPosition();
-			return (pos - tarPos).length() < 0.5;
+	void SetupTriangle(Job& job, int a, int b, int c, const Surface* surface, int view)
+	{
+		const ViewSetup& setup = views[view];
+		Triangle t;
+		int index[3] = { a, b, c };
+		float x[3], y[3];
+		for (int i = 0; i < 3; i++)
+		{
+			const Vertex& vertex = job.vertices[index[i]];
+			float invW = 1 / vertex.clip[3];
+			x[i] = setup.x + (vertex.clip[0] * invW * 0.5f + 0.5f) * setup.width;
+			y[i] = setup.y + (vertex.clip[1] * invW * 0.5f + 0.5f) * setup.height;
+			t.invW[i] = invW;
+			t.vertices[i] = index[i];
 		}
-		else {
-			return false;
+		float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+		if (!(fabsf(area) > 0)) return;
+
+		// small triangles that cover no pixel center end here
+		float left = std::max(ceilf(std::min(x[0], std::min(x[1], x[2])) - 0.5f), (float)setup.x);
+		float right = std::min(floorf(std::max(x[0], std::max(x[1], x[2])) - 0.5f), (float)(setup.x + setup.width - 1));
+		float bottom = std::max(ceilf(std::min(y[0], std::min(y[1], y[2])) - 0.5f), (float)setup.y);
+		float top = std::min(floorf(std::max(y[0], std::max(y[1], y[2])) - 0.5f), (float)(setup.y + setup.height - 1));
+		if (left > right || bottom > top) return;
+		t.bounds[0] = (int)left;
+		t.bounds[1] = (int)bottom;
+		t.bounds[2] = (int)right;
+		t.bounds[3] = (int)top;
+
+		// zero on the edge from j to k, one at vertex i
+		for (int i = 0; i < 3; i++)
+		{
+			int j = (i + 1) % 3, k = (i + 2) % 3;
+			t.edge[i][0] = (y[j] - y[k]) / area;
+			t.edge[i][1] = (x[k] - x[j]) / area;
+			t.edge[i][2] = (x[j] * y[k] - x[k] * y[j]) / area;
 		}
-		
-	}
-
-	bool CollisionTree(Object *target) {
-		if (target->getID() == 3) {
-			vec3 pos = this->GetPosition();
-			vec3 tarPos = target->GetPosition();
 
-			return (pos - tarPos).length() < 0.7;
+		// one level for the whole triangle, from its texel to pixel area ratio
+		t.lod = 0;
+		if (surface && surface->image) {
+			const float* uv0 = job.vertices[a].uv, *uv1 = job.vertices[b].uv, *uv2 = job.vertices[c].uv;
+			float texels = fabsf((uv1[0] - uv0[0]) * (uv2[1] - uv0[1]) - (uv2[0] - uv0[0]) * (uv1[1] - uv0[1])) * surface->image->widths[0] * surface->image->heights[0];
+			t.lod = std::max(0.0f, 0.5f * log2f(texels / fabsf(area)));
 		}
-		else {
-			return false;
+		t.job = job.index;
+		t.view = view;
+		t.surface = surface;
+
+		int triangle = (int)job.triangles.size();
+		job.triangles.push_back(t);
+
+		// tiles wholly outside one of the edges are skipped
+		for (int ty = t.bounds[1] / tileSize; ty <= t.bounds[3] / tileSize; ty++)
+		{
+			float tileBottom = std::max(ty * tileSize, t.bounds[1]) + 0.5f, tileTop = std::min(ty * tileSize + tileSize - 1, t.bounds[3]) + 0.5f;
+			for (int tx = t.bounds[0] / tileSize; tx <= t.bounds[2] / tileSize; tx++)
+			{
+				float tileLeft = std::max(tx * tileSize, t.bounds[0]) + 0.5f, tileRight = std::min(tx * tileSize + tileSize - 1, t.bounds[2]) + 0.5f;
+				bool outside = false;
+				for (int e = 0; e < 3 && !outside; e++) {
+					const float* edge = t.edge[e];
+					outside = edge[0] * (edge[0] > 0 ? tileRight : tileLeft) + edge[1] * (edge[1] > 0 ? tileTop : tileBottom) + edge[2] < 0;
+				}
+				if (outside) continue;
+				job.bins[ty * tilesX + tx].push_back(triangle);
+				job.binned++;
+			}
 		}
 	}
 
-	/* void MovePosition(vec3 pos, float dt) {
-		
-		vec3 dif = camera->GetLookAt() - camera->GetwEye();
-		velocity = dif * (keyboardState['w'] - keyboardState['s']);
-		position = position + velocity * dt;
-
-		if (keyboardState['a'] || keyboardState['d']) {
-			float angularSpeed = 180 / M_PI;
-			angularV = keyboardState['a'] * -angularSpeed + keyboardState['d'] * angularSpeed;
-			orientation += angularV * dt;
+	// outside bits: x < -w, x > w, y < -w, y > w, z < -w, z > w
+	static int OutCode(const Vertex& v)
+	{
+		const float* p = v.clip;
+		return (p[0] < -p[3]) | (p[0] > p[3]) << 1 | (p[1] < -p[3]) << 2 | (p[1] > p[3]) << 3 | (p[2] < -p[3]) << 4 | (p[2] > p[3]) << 5;
+	}
 
+	// the far plane is left to the depth test, the sides to the tile bounds; only the near plane cuts
+	void AddTriangle(Job& job, int a, int b, int c, const Surface* surface, int view)
+	{
+		int codes[3] = { OutCode(job.vertices[a]), OutCode(job.vertices[b]), OutCode(job.vertices[c]) };
+		if (codes[0] & codes[1] & codes[2]) return;
+		if (!((codes[0] | codes[1] | codes[2]) & 16)) {
+			SetupTriangle(job, a, b, c, surface, view);
+			return;
 		}
-		position = pos;
-		float angularSpeed = 180 / M_PI;
-		angularV = keyboardState['a'] * -angularSpeed + keyboardState['d'] * angularSpeed;
-		orientation += angularV * dt;
-
 
+		int corners[3] = { a, b, c }, polygon[4], count = 0;
+		for (int i = 0; i < 3; i++)
+		{
+			int from = corners[i], to = corners[(i + 1) % 3];
+			float dFrom = job.vertices[from].clip[2] + job.vertices[from].clip[3], dTo = job.vertices[to].clip[2] + job.vertices[to].clip[3];
+			if (dFrom >= 0) polygon[count++] = from;
+			if ((dFrom >= 0) == (dTo >= 0)) continue;
+
+			float s = dFrom / (dFrom - dTo);
+			Vertex vertex;
+			const float* p = job.vertices[from].clip, *q = job.vertices[to].clip;
+			float* r = vertex.clip;
+			for (int k = 0; k < sizeof(Vertex) / sizeof(float); k++) r[k] = p[k] + (q[k] - p[k]) * s;
+			job.vertices.push_back(vertex);
+			polygon[count++] = (int)job.vertices.size() - 1;
+		}
+		for (int i = 1; i + 1 < count; i++) SetupTriangle(job, polygon[0], polygon[i], polygon[i + 1], surface, view);
+	}
 
-		
-	}*/
+	// surfaces holds one surface per material range of the geometry, or is 0 for the shadow
+	void AddMesh(Job& job, const SoftwareMesh& mesh, Geometry* geometry, const mat4& W, const mat4& N, const float* shadow, const Surface* const* surfaces, int view)
+	{
+		int base = (int)job.vertices.size();
+		job.vertices.resize(base + mesh.vertexCount);
+		TransformVertices(mesh.vertices, mesh.vertexCount, W, N, views[view].VP, shadow, &job.vertices[base]);
+		job.transformed += mesh.vertexCount;
+		int ranges = surfaces ? geometry->GetRangeCount() : 1;
+		for (int r = 0; r < ranges; r++)
+		{
+			int first = 0, count = mesh.indexCount;
+			if (surfaces && ranges > 1) geometry->GetRange(r, first, count);
+			const Surface* surface = surfaces ? surfaces[r] : 0;
+			for (int i = first; i + 2 < first + count; i += 3)
+				AddTriangle(job, base + mesh.indices[i], base + mesh.indices[i + 1], base + mesh.indices[i + 2], surface, view);
+		}
+	}
 
-	void MovePosition(float dt) {
+	void AddObject(Job& job, const ObjectSnapshot& object)
+	{
+		SoftwareMesh mesh;
+		if (object.destroy || !object.mesh->GetGeometry()->GetSoftwareMesh(mesh) || mesh.groundPlane) return;
 
-		//        vec3 dif = camera.GetLookat()-camera.GetwEye();
+		// the ground, flat or terrain, casts no shadow
+		int visibleViews = culling.VisibleViews(object);
+		int shadowViews = object.ID != 5 ? culling.ShadowViews(object) : 0;
+		if (!visibleViews && !shadowViews) return;
 
-		//        velocity = dif * (keyboardState['w'] - keyboardState['s']);
+		// the normal matrix is InvM transposed, as the shaders multiply it from the left
+		mat4 W, InvM, N;
+		object.BuildTransform(W, InvM);
+		for (int i = 0; i < 4; i++)
+			for (int j = 0; j < 4; j++) N.m[i][j] = InvM.m[j][i];
+
+		// spun about the object's origin after the model transform
+		if (object.animation) {
+			mat4 S;
+			SpinMatrix(object, S);
+			vec4 origin = vec4(W.m[3][0], W.m[3][1], W.m[3][2], 0);
+			vec4 spun = origin * S;
+			S.m[3][0] = origin.v[0] - spun.v[0];
+			S.m[3][1] = origin.v[1] - spun.v[1];
+			S.m[3][2] = origin.v[2] - spun.v[2];
+			W = W * S;
+			S.m[3][0] = S.m[3][1] = S.m[3][2] = 0;
+			N = N * S;
+		}
 
-		//        SetAcceleration();
-		//        
-		//        if(keyboardState['w'] or keyboardState['s']){
-		//            velocity = velocity + acceleration * (keyboardState['w'] - keyboardState['s']);
-		//        } else {
-		//            velocity = velocity + acceleration;
-		//        }
-		//        
+		job.rangeSurfaces.clear();
+		for (int r = 0; r < object.mesh->GetRangeCount(); r++) job.rangeSurfaces.push_back(&surfaces.find(object.mesh->GetMaterial(r))->second);
+		Geometry* geometry = object.mesh->GetGeometry();
+		float shadow[] = { culling.shadowLight[0], culling.shadowLight[1] + object.ground + 1, culling.shadowLight[2], object.ground + 0.001f };
+		for (int v = 0; v < viewCount; v++)
+		{
+			if (shadowViews & (1 << v)) AddMesh(job, mesh, geometry, W, N, shadow, 0, v);
+			if (visibleViews & (1 << v)) AddMesh(job, mesh, geometry, W, N, 0, &job.rangeSurfaces[0], v);
+		}
+	}
 
-		//        position = position + velocity * dt;
+	void RunJob(int index, FrameSnapshot& frame)
+	{
+		Job& job = jobs[index];
+		int begin = index * objectsPerJob, end = std::min((int)frame.objects.size(), begin + objectsPerJob);
+		for (int i = begin; i < end; i++) AddObject(job, frame.objects[i]);
+	}
 
-		position = camera->GetLookAt();
-		position.y = -0.8;
+	// each light goes to the tiles under the screen box of its bounding cube, or to all of a view's
+	// tiles when the cube reaches behind the near plane
+	void BinLights()
+	{
+		for (int i = 0; i < tileLights.size(); i++) tileLights[i].clear();
+		for (int v = 0; v < viewCount; v++)
+		{
+			ViewSetup& view = views[v];
+			for (int l = 0; l < lights.size(); l++)
+			{
+				const PointLight& light = lights[l];
+				if (!(culling.SphereViews(light.position.x, light.position.y, light.position.z, light.radius) & (1 << v))) continue;
+
+				float left = (float)view.x, right = (float)(view.x + view.width - 1);
+				float bottom = (float)view.y, top = (float)(view.y + view.height - 1);
+				float minX = FLT_MAX, maxX = -FLT_MAX, minY = FLT_MAX, maxY = -FLT_MAX;
+				bool behind = false;
+				for (int corner = 0; corner < 8 && !behind; corner++)
+				{
+					vec4 p = vec4(light.position.x + (corner & 1 ? light.radius : -light.radius), light.position.y + (corner & 2 ? light.radius : -light.radius),
+						light.position.z + (corner & 4 ? light.radius : -light.radius), 1) * view.VP;
+					behind = p.v[3] < view.nearPlane;
+					float sx = view.x + (p.v[0] / p.v[3] * 0.5f + 0.5f) * view.width, sy = view.y + (p.v[1] / p.v[3] * 0.5f + 0.5f) * view.height;
+					minX = std::min(minX, sx);
+					maxX = std::max(maxX, sx);
+					minY = std::min(minY, sy);
+					maxY = std::max(maxY, sy);
+				}
+				if (!behind) {
+					left = std::max(left, floorf(minX));
+					right = std::min(right, ceilf(maxX));
+					bottom = std::max(bottom, floorf(minY));
+					top = std::min(top, ceilf(maxY));
+				}
+				if (left > right || bottom > top) continue;
+				for (int ty = (int)bottom / tileSize; ty <= (int)top / tileSize; ty++)
+					for (int tx = (int)left / tileSize; tx <= (int)right / tileSize; tx++) tileLights[ty * tilesX + tx].push_back(l);
+			}
+		}
+	}
 
-		if (keyboardState['a'] || keyboardState['d']) {
-			float angularSpeed = 180 / M_PI;
-			angularV = keyboardState['a'] * -angularSpeed + keyboardState['d'] * angularSpeed;
-			orientation += angularV * dt;
+	// the view's ray through a pixel center; its component along the view direction is one, so a hit
+	// at parameter t is t in front of the eye
+	vec3 PixelRay(const ViewSetup& view, int x, int y)
+	{
+		float nx = ((x + 0.5f - view.x) / view.width * 2 - 1) * view.tanHalfFov * view.aspect;
+		float ny = ((y + 0.5f - view.y) / view.height * 2 - 1) * view.tanHalfFov;
+		return vec3(view.u.x * nx + view.v.x * ny - view.w.x, view.u.y * nx + view.v.y * ny - view.w.y, view.u.z * nx + view.v.z * ny - view.w.z);
+	}
 
+	// the mesh shader's Phong model with the point lights of the tile, as the clustered shaders add them
+	void Shade(const Surface& surface, const float* position, float* N, const float* texel, const vec3& eye, const std::vector<int>& tileLightList, unsigned char* out)
+	{
+		float length = sqrtf(N[0] * N[0] + N[1] * N[1] + N[2] * N[2]);
+		if (length > 0) for (int c = 0; c < 3; c++) N[c] /= length;
+
+		float L[3];
+		for (int c = 0; c < 3; c++) L[c] = lightPosition.v[c] - position[c] * lightPosition.v[3];
+		length = sqrtf(L[0] * L[0] + L[1] * L[1] + L[2] * L[2]);
+		if (length > 0) for (int c = 0; c < 3; c++) L[c] /= length;
+		float diffuse = std::max(0.0f, L[0] * N[0] + L[1] * N[1] + L[2] * N[2]);
+
+		float specular = 0;
+		if (surface.ks.x + surface.ks.y + surface.ks.z > 0) {
+			float H[3] = { eye.x - position[0], eye.y - position[1], eye.z - position[2] };
+			length = sqrtf(H[0] * H[0] + H[1] * H[1] + H[2] * H[2]);
+			if (length > 0) for (int c = 0; c < 3; c++) H[c] /= length;
+			for (int c = 0; c < 3; c++) H[c] += L[c];
+			length = sqrtf(H[0] * H[0] + H[1] * H[1] + H[2] * H[2]);
+			if (length > 0) specular = powf(std::max(0.0f, (H[0] * N[0] + H[1] * N[1] + H[2] * N[2]) / length), surface.shininess);
 		}
-	}
 
-	void frenet(float dt) {
-		if (keyboardState['d']) {
-			if (keyboardState['w']) {
-				rotation -= 60 * dt;
-				rotation = fmax(rotation, -5);
+		const float* ka = &surface.ka.x, *kd = &surface.kd.x, *ks = &surface.ks.x, *la = &La.x, *le = &Le.x;
+		float color[3];
+		for (int c = 0; c < 3; c++) color[c] = la[c] * ka[c] + le[c] * kd[c] * texel[c] * diffuse + le[c] * ks[c] * specular;
 
-			}
-			else if (keyboardState['s']) {
-				rotation += 60 * dt;
-				rotation = fmin(rotation, 5);
+		for (int i = 0; i < tileLightList.size(); i++)
+		{
+			const PointLight& light = lights[tileLightList[i]];
+			float d[3] = { light.position.x - position[0], light.position.y - position[1], light.position.z - position[2] };
+			float distance = sqrtf(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+			if (distance >= light.radius || distance <= 0) continue;
+			float attenuation = 1 - distance / light.radius;
+			float lambert = std::max(0.0f, (N[0] * d[0] + N[1] * d[1] + N[2] * d[2]) / distance) * attenuation * attenuation;
+			const float* lightColor = &light.color.x;
+			for (int c = 0; c < 3; c++) color[c] += lightColor[c] * kd[c] * texel[c] * lambert;
+		}
 
-			}
-			else {
-				if (rotation>0) {
-					rotation -= 60 * dt;
-					rotation = fmax(rotation, 0);
+		for (int c = 0; c < 3; c++) out[c] = (unsigned char)(std::min(std::max(color[c], 0.0f), 1.0f) * 255 + 0.5f);
+		out[3] = 255;
+	}
 
-				}
-				else {
-					rotation += 60 * dt;
-					rotation = fmin(rotation, 0);
+	void DrawTile(int tile)
+	{
+		int x0 = tile % tilesX * tileSize, y0 = tile / tilesX * tileSize;
+		int x1 = std::min(x0 + tileSize, width), y1 = std::min(y0 + tileSize, height);
+
+		// the visibility buffer: depth, then the triangle and its barycentrics or the ground's view and
+		// ray parameter. depth is 1/w, which is linear on the screen and keeps its precision far away,
+		// where z/w is crowded next to one; larger is closer and zero is the far end
+		float depth[tileSize * tileSize], l1[tileSize * tileSize], l2[tileSize * tileSize];
+		const Triangle* owner[tileSize * tileSize];
+		signed char ground[tileSize * tileSize];
+		for (int i = 0; i < tileSize * tileSize; i++) {
+			depth[i] = 0;
+			owner[i] = 0;
+			ground[i] = -1;
+		}
 
+		for (int v = 0; v < viewCount; v++)
+		{
+			const ViewSetup& view = views[v];
+			if (!view.ground) continue;
+			for (int y = std::max(y0, view.y); y < std::min(y1, view.y + view.height); y++)
+			{
+				for (int x = std::max(x0, view.x); x < std::min(x1, view.x + view.width); x++)
+				{
+					vec3 ray = PixelRay(view, x, y);
+					float t = (view.groundHeight - view.eye.y) / ray.y;
+					if (!(t >= view.nearPlane && t <= view.farPlane)) continue;
+					float z = 1 / t;
+					int i = (y - y0) * tileSize + (x - x0);
+					if (z <= depth[i]) continue;
+					depth[i] = z;
+					ground[i] = (signed char)v;
+					l1[i] = t;
 				}
 			}
 		}
-		else if (keyboardState['a']) {
-			if (keyboardState['w']) {
-				rotation += 60 * dt;
-				rotation = fmin(rotation, 5);
-
-			}
-			else if (keyboardState['s']) {
-				rotation -= 60 * dt;
-				rotation = fmax(rotation, -5);
 
+		for (int j = 0; j < jobCount; j++)
+		{
+			const std::vector<int>& bin = jobs[j].bins[tile];
+			const std::vector<Triangle>& triangles = jobs[j].triangles;
+			for (int b = 0; b < bin.size(); b++)
+			{
+				const Triangle& t = triangles[bin[b]];
+				float farthest = 1 / views[t.view].farPlane;
+				int minX = std::max(t.bounds[0], x0), maxX = std::min(t.bounds[2], x1 - 1);
+				int minY = std::max(t.bounds[1], y0), maxY = std::min(t.bounds[3], y1 - 1);
+				for (int y = minY; y <= maxY; y++)
+				{
+					float px = minX + 0.5f, py = y + 0.5f;
+					float w0 = t.edge[0][0] * px + t.edge[0][1] * py + t.edge[0][2];
+					float w1 = t.edge[1][0] * px + t.edge[1][1] * py + t.edge[1][2];
+					float w2 = t.edge[2][0] * px + t.edge[2][1] * py + t.edge[2][2];
+					int i = (y - y0) * tileSize + (minX - x0);
+					for (int x = minX; x <= maxX; x++, i++, w0 += t.edge[0][0], w1 += t.edge[1][0], w2 += t.edge[2][0])
+					{
+						if (w0 < 0 || w1 < 0 || w2 < 0) continue;
+						float z = t.invW[0] * (1 - w1 - w2) + t.invW[1] * w1 + t.invW[2] * w2;
+						if (z <= depth[i] || z < farthest) continue;
+						depth[i] = z;
+						owner[i] = &t;
+						ground[i] = -1;
+						l1[i] = w1;
+						l2[i] = w2;
+					}
+				}
 			}
-			else {
-				if (rotation>0) {
-					rotation -= 60 * dt;
-					rotation = fmax(rotation, 0);
+		}
 
+		const std::vector<int>& tileLightList = tileLights[tile];
+		for (int y = y0; y < y1; y++)
+		{
+			unsigned char* out = &color[((size_t)y * width + x0) * 4];
+			for (int x = x0; x < x1; x++, out += 4)
+			{
+				int i = (y - y0) * tileSize + (x - x0);
+				if (owner[i]) {
+					const Triangle& t = *owner[i];
+					if (!t.surface) {
+						out[0] = 0;
+						out[1] = 26;
+						out[2] = 0;
+						out[3] = 255;
+						continue;
+					}
+
+					// perspective correct
+					float b[3] = { (1 - l1[i] - l2[i]) * t.invW[0], l1[i] * t.invW[1], l2[i] * t.invW[2] };
+					float sum = 1 / (b[0] + b[1] + b[2]);
+					const Vertex* v[3];
+					for (int k = 0; k < 3; k++) {
+						b[k] *= sum;
+						v[k] = &jobs[t.job].vertices[t.vertices[k]];
+					}
+					float position[3], normal[3], texel[3] = { 1, 1, 1 };
+					for (int c = 0; c < 3; c++) {
+						position[c] = v[0]->world[c] * b[0] + v[1]->world[c] * b[1] + v[2]->world[c] * b[2];
+						normal[c] = v[0]->normal[c] * b[0] + v[1]->normal[c] * b[1] + v[2]->normal[c] * b[2];
+					}
+					if (t.surface->image) {
+						float u = v[0]->uv[0] * b[0] + v[1]->uv[0] * b[1] + v[2]->uv[0] * b[2];
+						float w = v[0]->uv[1] * b[0] + v[1]->uv[1] * b[1] + v[2]->uv[1] * b[2];
+						Sample(t.surface->image, u, w, t.lod, texel);
+					}
+					Shade(*t.surface, position, normal, texel, views[t.view].eye, tileLightList, out);
+				}
+				else if (ground[i] >= 0) {
+					// the infinite quad's shader: one texture repeat per unit of the world's x and z
+					const ViewSetup& view = views[ground[i]];
+					vec3 ray = PixelRay(view, x, y);
+					float t = l1[i];
+					float position[3] = { view.eye.x + ray.x * t, view.groundHeight, view.eye.z + ray.z * t };
+					float normal[3] = { 0, 1, 0 }, texel[3] = { 1, 1, 1 };
+					if (view.ground->image) {
+						// a pixel covers about t |ray| / focal length units along the ray, stretched by the
+						// grazing angle
+						float focal = view.height / (2 * view.tanHalfFov);
+						float footprint = t * (ray.x * ray.x + ray.y * ray.y + ray.z * ray.z) / (focal * fabsf(ray.y));
+						float lod = std::max(0.0f, log2f(footprint * view.ground->image->widths[0]));
+						Sample(view.ground->image, position[0], position[2], lod, texel);
+					}
+					Shade(*view.ground, position, normal, texel, view.eye, tileLightList, out);
 				}
 				else {
-					rotation += 60 * dt;
-					rotation = fmin(rotation, 0);
-
+					out[0] = 0;
+					out[1] = 0;
+					out[2] = 255;
+					out[3] = 255;
 				}
 			}
-
-		}
-		else {
-			if (rotation>0) {
-				rotation -= 60 * dt;
-				rotation = fmax(rotation, 0);
-			}
-			else {
-				rotation += 60 * dt;
-				rotation = fmin(rotation, 0);
-
-			}
 		}
-
-	}
-
-	void Rotate(float dt) {
-		rotation += dt * 200;
 	}
 
-	void Spin(float dt)
+public:
+	SoftwareRenderer(UpscaleShader* blitShader) : blitShader(blitShader)
 	{
-		orientation += 100 * dt;
+		textureWidth = textureHeight = 0;
+		width = height = tilesX = tilesY = 0;
+		jobCount = 0;
+		viewCount = 0;
+		time = 0;
+		vao.Create();
 	}
 
-	void Move(float dt)
+	~SoftwareRenderer()
 	{
-		velocity = velocity + acceleration*dt;
-		position = position + velocity *dt;
-		angularV = angularV + angularA * dt;
-		orientation = orientation + angularV * dt;
+		for (std::map<std::string, Image*>::iterator i = images.begin(); i != images.end(); i++) delete i->second;
 	}
 
-	void SetOrientation(vec3 dir) {
-
-		vec3 v1 = dir.normalize();
-		vec3 v2 = vec3(0, 0, -1).normalize();
-
-		float cos = v1.x*v2.x + v1.z*v2.z;
-
+	void Draw(FrameSnapshot& frame, int targetWidth, int targetHeight, const std::vector<PointLight>& pointLights)
+	{
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+		width = targetWidth;
+		height = targetHeight;
+		color.resize((size_t)width * height * 4);
+		tilesX = (width + tileSize - 1) / tileSize;
+		tilesY = (height + tileSize - 1) / tileSize;
+		int tileCount = tilesX * tilesY;
+		tileLights.resize(tileCount);
+		tileMs.resize(tileCount);
+
+		culling.Set(frame);
+		viewCount = (int)frame.views.size();
+		for (int v = 0; v < viewCount; v++)
+		{
+			FrameView& frameView = frame.views[v];
+			ViewSetup& view = views[v];
+			view.x = (int)(frameView.rect.v[0] * width);
+			view.y = (int)(frameView.rect.v[1] * height);
+			view.width = (int)(frameView.rect.v[2] * width);
+			view.height = (int)(frameView.rect.v[3] * height);
+			view.VP = frameView.VP;
+			view.eye = frameView.camera.GetwEye();
+			frameView.camera.GetBasis(view.u, view.v, view.w);
+			view.tanHalfFov = tanf(frameView.camera.GetFov() / 2);
+			view.aspect = frameView.camera.GetAspectRatio();
+			view.nearPlane = frameView.camera.GetNearPlane();
+			view.farPlane = frameView.camera.GetFarPlane();
+			view.ground = 0;
+		}
+		time = frame.time;
+		La = frame.light.GetLa();
+		Le = frame.light.GetLe();
+		lightPosition = frame.light.GetWorldPosition();
+		lights = pointLights;
+
+		// surfaces and images are looked up here, so the jobs only read the maps
+		for (int i = 0; i < frame.objects.size(); i++)
+		{
+			const ObjectSnapshot& object = frame.objects[i];
+			const Surface* surface = SurfaceFor(object.mesh->GetMaterial());
+			for (int r = 0; r < object.mesh->GetRangeCount(); r++) SurfaceFor(object.mesh->GetMaterial(r));
+			SoftwareMesh mesh;
+			if (!object.mesh->GetGeometry()->GetSoftwareMesh(mesh) || !mesh.groundPlane) continue;
+			for (int v = 0; v < viewCount; v++) {
+				views[v].ground = surface;
+				views[v].groundHeight = object.position.y;
+			}
+		}
 
-		float angle = acosf(cos) * 180 / M_PI;
+		jobCount = ((int)frame.objects.size() + objectsPerJob - 1) / objectsPerJob;
+		if (jobs.size() < jobCount) jobs.resize(jobCount);
+		for (int j = 0; j < jobCount; j++)
+		{
+			Job& job = jobs[j];
+			job.index = j;
+			job.vertices.clear();
+			job.triangles.clear();
+			job.bins.resize(tileCount);
+			for (int t = 0; t < tileCount; t++) job.bins[t].clear();
+			job.transformed = job.binned = 0;
+		}
+		threadPool->ParallelFor(jobCount, [&](int j) {
+			std::chrono::high_resolution_clock::time_point jobStart = std::chrono::high_resolution_clock::now();
+			RunJob(j, frame);
+			jobs[j].ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - jobStart).count();
+		});
+		BinLights();
+
+		std::chrono::high_resolution_clock::time_point binned = std::chrono::high_resolution_clock::now();
+		threadPool->ParallelFor(tileCount, [this](int tile) {
+			std::chrono::high_resolution_clock::time_point tileStart = std::chrono::high_resolution_clock::now();
+			DrawTile(tile);
+			tileMs[tile] = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - tileStart).count();
+		});
+		std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+
+		renderStats.softwareThreads = threadPool->GetThreadCount();
+		renderStats.softwareTiles = tileCount;
+		double jobMaxMs = 0, tileMaxMs = 0;
+		for (int j = 0; j < jobCount; j++) {
+			renderStats.softwareVertices += jobs[j].transformed;
+			renderStats.softwareTriangles += (int)jobs[j].triangles.size();
+			renderStats.softwareBinned += jobs[j].binned;
+			renderStats.softwareJobSumMs += jobs[j].ms;
+			jobMaxMs = std::max(jobMaxMs, jobs[j].ms);
+		}
+		for (int t = 0; t < tileCount; t++) {
+			renderStats.softwareTileSumMs += tileMs[t];
+			tileMaxMs = std::max(tileMaxMs, tileMs[t]);
+		}
+		renderStats.softwareJobs += jobCount;
+		renderStats.softwareJobMaxMs += jobMaxMs;
+		renderStats.softwareTileMaxMs += tileMaxMs;
+		renderStats.softwareGeometryMs += std::chrono::duration<double, std::milli>(binned - start).count();
+		renderStats.softwareTileMs += std::chrono::duration<double, std::milli>(end - binned).count();
+	}
 
-		if (v1.x < 0) angle = -angle;
+	// onto the bound framebuffer's viewport, stretched if the image is smaller
+	void Blit()
+	{
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+		if (!texture || textureWidth != width || textureHeight != height) {
+			if (!texture) texture.Create();
+			glBindTexture(GL_TEXTURE_2D, texture);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			textureWidth = width;
+			textureHeight = height;
+		}
+		glDisable(GL_DEPTH_TEST);
 
+		blitShader->Run();
+		blitShader->UploadSamplerID();
+		blitShader->UploadUpscaleAttributes(1, 1, 1.0f / width, 1.0f / height, 0);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, &color[0]);
+		glBindVertexArray(vao);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
 
-		orientation = angle + 180;
+		renderStats.softwareBlitMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
 	}
 
-	void Falling(float t, float dt) {
-		velocity = vec3(cos(5 * t), -2, sin(5 * t)).normalize();
-		SetOrientation(velocity);
-		position = position + velocity * dt;
-		
+	// straight from memory, without reading anything back from GL
+	bool WritePng(const char* fileName)
+	{
+		if (color.empty()) return false;
+		std::vector<unsigned char> rgb((size_t)width * height * 3);
+		for (int y = 0; y < height; y++)
+		{
+			const unsigned char* src = &color[(size_t)(height - 1 - y) * width * 4];
+			unsigned char* dst = &rgb[(size_t)y * width * 3];
+			for (int x = 0; x < width; x++, src += 4, dst += 3)
+			{
+				dst[0] = src[0];
+				dst[1] = src[1];
+				dst[2] = src[2];
+			}
+		}
+		return writePng(fileName, &rgb[0], width, height);
 	}
-
 };
 
-/*class Avatar : public Object
-{
-	vec3 position;
-	vec3 scaling;
-	float orientation;
-	float angularV;
-	float angularA;
-	vec3 velocity = vec3(0, 0, 0);
-	vec3 acceleration;
-
-public: Avatar(vec3 position, vec3 scaling, float orientation, vec3 velocity, vec3 acceleration) {
-	
-	
-	void Control(float dt, vec3& avatar position)
-
-	{
-	velocity  = veloctiy * 0.999
-	if (keyboardState['w']) {
-	}
-	}
-	avatar class
-	vec3 getahead()
-	float alpha = (orientation plus 180 ) * pi / 180
-	return vec3(cos(alpha), 0, sin(alpha))
-}
-};*/
+SoftwareRenderer* softwareRenderer = 0;
 
 Object* objectT;
 Object* objectH;
 Object* objectHA;
 std::vector<Object*> objects;
 int numCoin = 70;
+// the spin Object::Rotate used to apply to every coin each step
+ProceduralAnimation coinSpin(200);
 int numTree = 200;
+// random static point lights added on top of the scene's own, for profiling the clustered lighting
+int extraPointLights = 0;
+// trees scattered far and wide, for profiling draw recording and culling
+int extraObjects = 0;
+// owned by the renderer, the simulation's camera only moves
+float viewAspectRatio = (float)windowWidth / windowHeight;
+
+// moves everything the simulation places by offset, for a new origin
+void shiftWorld(vec3 offset)
+{
+	for (int i = 0; i < objects.size(); i++)
+	{
+		objects[i]->movePositionX(offset.x);
+		objects[i]->movePositionY(offset.y);
+		objects[i]->movePositionZ(offset.z);
+	}
+	for (int i = 0; i < playerCameras.size(); i++) playerCameras[i]->Place(playerCameras[i]->GetwEye() + offset, playerCameras[i]->GetLookAt() + offset);
+	initialPos = initialPos + offset;
+	initialHat = initialHat + offset;
+}
+
+// once the car is far enough out, the origin jumps to its sector and the world comes along
+void recenterWorld()
+{
+	vec3 car = camera->GetLookAt();
+	if (!useFloatingOrigin || (fabsf(car.x) < recenterDistance && fabsf(car.z) < recenterDistance)) return;
+
+	WorldOrigin previous = worldOrigin;
+	worldOrigin.MoveTo(previous.GetX() + car.x, previous.GetZ() + car.z);
+	vec3 offset = previous.Offset(worldOrigin);
+	if (offset.x == 0 && offset.z == 0) return;
+	shiftWorld(offset);
+	printf("World origin moved to %.0f, %.0f\n", worldOrigin.GetX(), worldOrigin.GetZ());
+}
 
 class Scene
 {
-	MeshShader* meshShader;
+	MeshShaderCache meshShaders;
 	InfiniteQuadShader* infiniteShader;
 	ShadowShader* shadowShader;
-
+	DepthShader* depthShader;
+	ShadowShader* animatedShadowShader;
+	DepthShader* animatedDepthShader;
+	InfiniteQuadShader* multiViewInfiniteShader;
+	ShadowShader* multiViewShadowShader;
+	DepthShader* multiViewDepthShader;
+	ShadowShader* multiViewAnimatedShadowShader;
+	DepthShader* multiViewAnimatedDepthShader;
+	UpscaleShader* upscaleShader;
+	ImpostorShader* impostorShader;
+	ImpostorShader* impostorShadowShader;
+	DepthPrepassController* depthPrepass;
+	Terrain* terrain;
+	bool prepass;
+
+	std::vector<TextureArray*> textureArrays;
 	std::vector<Texture*> textures;
+	std::vector<PointLight> pointLights;
+	std::vector<PointLight> benchmarkLights;
+	DrawRecorder recorder;
 	std::vector<Material*> materials;
 	std::vector<Geometry*> geometries;
 	std::vector<Mesh*> meshes;
+	std::vector<ImpostorAtlas*> impostors;
 	//std::vector<Object*> objects;
 
 public:
 	Scene()
 	{
-		meshShader = 0;
+		infiniteShader = 0;
+		shadowShader = animatedShadowShader = 0;
+		depthShader = animatedDepthShader = 0;
+		upscaleShader = 0;
+		depthPrepass = 0;
+		terrain = 0;
+		prepass = false;
+		impostorShader = impostorShadowShader = 0;
+		multiViewInfiniteShader = 0;
+		multiViewShadowShader = multiViewAnimatedShadowShader = 0;
+		multiViewDepthShader = multiViewAnimatedDepthShader = 0;
+	}
+
+	// a mesh material either gets its own texture or a layer of the texture array for its image's size
+	// and format, so no image is resampled; sizes that are not powers of two keep their own texture
+	Material* NewMeshMaterial(vec3 ka, vec3 kd, vec3 ks, float shininess, const char* textureFileName)
+	{
+		int w, h, nComponents;
+		if (useTextureArray && stbi_info(textureFileName, &w, &h, &nComponents) && (w & (w - 1)) == 0 && (h & (h - 1)) == 0
+			&& (nComponents == 3 || nComponents == 4)) {
+			TextureArray* textureArray = 0;
+			for (int i = 0; i < textureArrays.size() && !textureArray; i++)
+				if (textureArrays[i]->Matches(w, h, nComponents)) textureArray = textureArrays[i];
+			if (!textureArray) {
+				textureArray = new TextureArray(w, h, nComponents);
+				textureArrays.push_back(textureArray);
+			}
+			int layer = textureArray->FindLayer(textureFileName);
+			if (layer < 0) layer = textureArray->AddLayer(textureFileName);
+			return new Material(&meshShaders, ka, kd, ks, shininess, textureArray, layer);
+		}
+
+		// .mtl libraries often name an image the scene already loaded
+		for (int i = 0; i < textures.size(); i++)
+			if (textures[i]->GetFileName() == textureFileName) return new Material(&meshShaders, ka, kd, ks, shininess, textures[i]);
+		textures.push_back(new Texture(textureFileName));
+		return new Material(&meshShaders, ka, kd, ks, shininess, textures.back());
+	}
+
+	// a material for each range the geometry's .mtl library describes, 0 for the others; created
+	// with the other materials, so their texture array layers and shader variants come in time
+	void NewRangeMaterials(Geometry* geometry, std::vector<Material*>& rangeMaterials)
+	{
+		for (int r = 0; r < geometry->GetRangeCount(); r++) {
+			const MtlMaterial* m = geometry->GetRangeMaterial(r);
+			if (!m) rangeMaterials.push_back(0);
+			else if (m->diffuseMap.empty()) rangeMaterials.push_back(new Material(&meshShaders, m->ka, m->kd, m->ks, m->shininess));
+			else rangeMaterials.push_back(NewMeshMaterial(m->ka, m->kd, m->ks, m->shininess, m->diffuseMap.c_str()));
+			if (rangeMaterials.back()) materials.push_back(rangeMaterials.back());
+		}
+	}
+
+	// after the mesh's animation is set, which decides the variants the ranges are drawn with
+	void SetRangeMaterials(Mesh* mesh, const std::vector<Material*>& rangeMaterials)
+	{
+		for (int r = 0; r < rangeMaterials.size(); r++) {
+			if (!rangeMaterials[r]) continue;
+			MeshShader* shader = static_cast<MeshShader*>(rangeMaterials[r]->GetShader());
+			if (mesh->GetAnimation()) shader = meshShaders.Animated(shader);
+			mesh->SetRangeMaterial(r, rangeMaterials[r], shader, splitScreenSupported ? meshShaders.MultiView(shader) : 0);
+		}
 	}
 
 	double get_random(double min, double max) {
@@ -1759,59 +8782,156 @@ public:
 		light = new Light(vec3(1, 1, 1), vec3(1, 1, 1), vec4(2.55, 2.55, 2.55, 0));
 		spotlight = new Light(vec3(1, 1, 1), vec3(1, 1, 1), vec4(-0.1, -0.3, 0.1, 1.0));
 		camera = new Camera();
+		playerCameras.push_back(camera);
+		for (int i = 1; i < maxSplitScreenViews; i++) playerCameras.push_back(new Camera());
 
-		infiniteShader = new InfiniteQuadShader();
+		initParallelShaderCompile();
+		infiniteShader = new InfiniteQuadShader(useClusteredLighting);
 		shadowShader = new ShadowShader();
-		meshShader = new MeshShader();
+		depthShader = new DepthShader();
+		animatedShadowShader = new ShadowShader(true);
+		animatedDepthShader = new DepthShader(true);
+		splitScreenSupported = GLEW_ARB_draw_instanced;
+		if (splitScreenSupported) {
+			multiViewInfiniteShader = new InfiniteQuadShader(useClusteredLighting, true);
+			multiViewShadowShader = new ShadowShader(false, true);
+			multiViewDepthShader = new DepthShader(false, true);
+			multiViewAnimatedShadowShader = new ShadowShader(true, true);
+			multiViewAnimatedDepthShader = new DepthShader(true, true);
+		}
+		else printf("Split screen needs instanced draws, one view only\n");
+		upscaleShader = new UpscaleShader();
+		depthPrepass = new DepthPrepassController();
+		softwareRenderer = new SoftwareRenderer(upscaleShader);
+
+		// mesh shader variants are compiled as the materials below request them
+		if (useClusteredLighting) clusteredLighting = new ClusteredLighting();
+		if (useDynamicResolution) dynamicResolution = new DynamicResolution(upscaleShader);
+		frameGraph = new FrameGraph();
+		if (FrameCapture::IsSupported()) frameCapture = new FrameCapture();
+		else printf("Capture needs fences, disabled\n");
+		if (useMinimap) {
+			if (Minimap::IsSupported()) minimap = new Minimap(upscaleShader);
+			else printf("Minimap needs instanced arrays, disabled\n");
+		}
+		if (textureStreaming) textureStreamer = new TextureStreamer();
+		if (useImpostors && !ImpostorAtlas::IsSupported()) {
+			printf("Impostors need instanced arrays, drawing full geometry\n");
+			useImpostors = false;
+		}
+		if (useParticles) {
+			if (ParticleSystem::IsSupported()) particleSystem = new ParticleSystem();
+			else printf("Particles need geometry shaders and transform feedback objects, disabled\n");
+		}
+		// materials may mix textures and texture array layers, so both bake programs are submitted
+		ImpostorBakeShader* textureBakeShader = 0;
+		ImpostorBakeShader* arrayBakeShader = 0;
+		if (useImpostors) {
+			textureBakeShader = new ImpostorBakeShader(false);
+			if (useTextureArray) arrayBakeShader = new ImpostorBakeShader(true);
+			impostorShader = new ImpostorShader(false);
+			impostorShadowShader = new ImpostorShader(true);
+		}
+
+		// loaded ahead of the materials, which the .mtl libraries of the meshes add to
+		geometries.push_back(new PolygonalMesh("tigger.obj"));
+		geometries.push_back(new PolygonalMesh("tree.obj"));
+		geometries.push_back(new PolygonalMesh("chevy.obj"));
+		geometries.push_back(new InfiniteTexturedQuad());
+		geometries.push_back(new PolygonalMesh("tricoin.obj"));
+		// its post and board are ranges with materials of their own, found through props/signpost.mtl
+		geometries.push_back(new PolygonalMesh("props/signpost.obj"));
+		//geometries.push_back(new PolygonalMesh("bmwtriangles.obj"));
 
-		textures.push_back(new Texture("tigger.png"));
-		textures.push_back(new Texture("tree.png"));
-		textures.push_back(new Texture("1-2-cowboy-hat-png-file-thumb.png"));
-		textures.push_back(new Texture("chevy.png"));
 		//textures.push_back(new Texture("grass.png"));
-		textures.push_back(new Texture("ice_texture3006.jpg"));
-		textures.push_back(new Texture("coin-texture.jpg"));
 		//textures.push_back(new Texture("NewTexture.png"));
 
-
-		materials.push_back(new Material(meshShader,
+		materials.push_back(NewMeshMaterial(
 			vec3(.1, .1, .1), vec3(.9, .9, .9), vec3(0.0, 0.0, 0.0), 0,
-			textures[0]));
-		materials.push_back(new Material(meshShader,
+			"tigger.png"));
+		materials.push_back(NewMeshMaterial(
 			vec3(.1, .1, .1), vec3(.6, .6, .6), vec3(0.3, 0.3, 0.3), 50,
-			textures[1]));
-		materials.push_back(new Material(meshShader,
+			"tree.png"));
+		materials.push_back(NewMeshMaterial(
 			vec3(.1, .1, .1), vec3(.9, .9, .9), vec3(0.0, 0.0, 0.0), 0,
-			textures[2]));
-		materials.push_back(new Material(meshShader,
+			"1-2-cowboy-hat-png-file-thumb.png"));
+		materials.push_back(NewMeshMaterial(
 			vec3(.1, .1, .1), vec3(.6, .6, .6), vec3(0.3, 0.3, 0.3), 50,
-			textures[3]));
-		materials.push_back(new Material(infiniteShader,
-			vec3(.1, .1, .1), vec3(.9, .9, .9), vec3(0.0, 0.0, 0.0), 0,
-			textures[4]));
-		materials.push_back(new Material(meshShader,
+			"chevy.png"));
+		// the flat ground tiles its texture through its own shader, so it stays a separate texture;
+		// terrain is a mesh whose texture coordinates do the tiling
+		if (useTerrain) {
+			materials.push_back(NewMeshMaterial(
+				vec3(.1, .1, .1), vec3(.9, .9, .9), vec3(0.0, 0.0, 0.0), 0,
+				"ice_texture3006.jpg"));
+		}
+		else {
+			textures.push_back(new Texture("ice_texture3006.jpg"));
+			materials.push_back(new Material(infiniteShader,
+				vec3(.1, .1, .1), vec3(.9, .9, .9), vec3(0.0, 0.0, 0.0), 0,
+				textures.back()));
+		}
+		materials.push_back(NewMeshMaterial(
 			vec3(.1, .1, .1), vec3(.9, .9, .9), vec3(0.0, 0.0, 0.0), 0,
-			textures[5]));
+			"coin-texture.jpg"));
+		std::vector<std::vector<Material*> > rangeMaterials(geometries.size());
+		for (int i = 0; i < geometries.size(); i++) NewRangeMaterials(geometries[i], rangeMaterials[i]);
+
+		// coins spin in the vertex shader; the variant is compiled along with the others
+		MeshShader* spinningCoinShader = meshShaders.Animated(static_cast<MeshShader*>(materials[5]->GetShader()));
+		// and every mesh program has a split-screen variant, the ground's aside
+		if (splitScreenSupported) {
+			for (int i = 0; i < materials.size(); i++) {
+				if (materials[i]->GetShader() != infiniteShader) meshShaders.MultiView(static_cast<MeshShader*>(materials[i]->GetShader()));
+			}
+			meshShaders.MultiView(spinningCoinShader);
+		}
+
+		for (int i = 0; i < textureArrays.size(); i++) textureArrays[i]->Finalize();
+		if (textureStreamer) {
+			for (int i = 0; i < textures.size(); i++) textureStreamer->Add(textures[i]);
+		}
+
+		// the driver compiles in the background while the textures above are decoded
+		std::chrono::high_resolution_clock::time_point waitStart = std::chrono::high_resolution_clock::now();
+		Shader::FinishPendingBuilds();
+		double shaderWaitMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - waitStart).count();
+		printf("Shader setup (%s): %.2f ms submit, %.2f ms wait, %d programs from cache, %d compiled\n",
+			programsCompiled ? "cold" : "warm", programSubmitMs, shaderWaitMs, programsFromCache, programsCompiled);
 		/*materials.push_back(new Material(meshShader,
 			vec3(.1, .1, .1), vec3(.9, .9, .9), vec3(0.0, 0.0, 0.0), 0,
 			textures[3]));*/
 
-		geometries.push_back(new PolygonalMesh("tigger.obj"));
-		geometries.push_back(new PolygonalMesh("tree.obj"));
-		geometries.push_back(new PolygonalMesh("chevy.obj"));
-		geometries.push_back(new InfiniteTexturedQuad());
-		geometries.push_back(new PolygonalMesh("tricoin.obj"));
-		//geometries.push_back(new PolygonalMesh("bmwtriangles.obj"));
-		
-
 		meshes.push_back(new Mesh(geometries[0], materials[0]));
 		meshes.push_back(new Mesh(geometries[1], materials[1]));
 		meshes.push_back(new Mesh(geometries[1], materials[2]));
 		meshes.push_back(new Mesh(geometries[2], materials[3]));
 		meshes.push_back(new Mesh(geometries[3], materials[4]));
 		meshes.push_back(new Mesh(geometries[4], materials[5]));
+		meshes.push_back(new Mesh(geometries[5], materials[1]));
 		//meshes.push_back(new Mesh(geometries[3], materials[3]));
 
+		meshes[5]->SetAnimation(&coinSpin, spinningCoinShader);
+		for (int i = 0; i < meshes.size(); i++) {
+			int g = (int)(std::find(geometries.begin(), geometries.end(), meshes[i]->GetGeometry()) - geometries.begin());
+			SetRangeMaterials(meshes[i], rangeMaterials[g]);
+		}
+		if (splitScreenSupported) {
+			for (int i = 0; i < meshes.size(); i++) {
+				Shader* shader = meshes[i]->GetShader();
+				if (shader == infiniteShader) meshes[i]->SetMultiViewShader(multiViewInfiniteShader);
+				else meshes[i]->SetMultiViewShader(meshShaders.MultiView(static_cast<MeshShader*>(shader)));
+			}
+		}
+
+		// the trees are the only mesh placed in numbers far from the camera
+		if (textureBakeShader) {
+			impostors.push_back(new ImpostorAtlas(meshes[1], textureBakeShader, arrayBakeShader));
+			meshes[1]->SetImpostor(impostors.back());
+			delete textureBakeShader;
+			if (arrayBakeShader) delete arrayBakeShader;
+		}
+
 		objectT = new Object(meshes[0], 1, vec3(0.0, -0.8, 0.0), vec3(0.015, 0.015, 0.015), 90.0);
 		objects.push_back(objectT);
 
@@ -1819,6 +8939,7 @@ public:
 			double random = get_random(-10.0, 10.0);
 			double randoz = get_random(-10.0, 10.0);
 			objects.push_back(new Object(meshes[5], 2, vec3(random, -0.5, randoz), vec3(.25, 0.25, 0.25), 90.0));
+			objects.back()->SetAnimationPhase(fmod(i * 137.5f, 360.0f));
 		}
 
 		for (int i = 0; i < numTree; i++) {
@@ -1827,27 +8948,71 @@ public:
 			double random1 = get_random(0.0, 0.05);
 			objects.push_back(new Object(meshes[1], 3, vec3(random, -1, randoz), vec3(random1, random1, random1), 0));
 		}
+
+		for (int i = 0; i < extraObjects; i++) {
+			double scale = get_random(0.01, 0.05);
+			objects.push_back(new Object(meshes[1], 3, vec3(get_random(-100.0, 100.0), -1, get_random(-100.0, 100.0)), vec3(scale, scale, scale), 0));
+		}
 		//objects.push_back(new Object(meshes[1], vec3(-.5, -1, -1), vec3(.03, .03, .03), 0));
 		//objects.push_back(new Object(meshes[1], vec3(.5, -1, -.5), vec3(.02, .02, .02), 30));
 		//objectH = new Object(meshes[2], vec3(0.0, 0.3, 0.0), vec3(.005, .005, .005), 90);
 		//objects.push_back(objectH);
 		objectHA = new Object(meshes[3], 4, vec3(0.0, -0.8, 0.0), vec3(.03, .03, .03), 180);
 		objects.push_back(objectHA);
-		objects.push_back(new Object(meshes[4], 5, vec3(0, -1, 0), vec3(1, 1, 1), 0));
+		objects.push_back(new Object(meshes[6], 6, vec3(1.6, -1, -3.5), vec3(.5, .5, .5), 20));
+		if (useTerrain) terrain = new Terrain(materials[4], meshes[4]->GetMultiViewShader());
+		else objects.push_back(new Object(meshes[4], 5, vec3(0, -1, 0), vec3(1, 1, 1), 0));
+
+		for (int i = 0; i < extraPointLights; i++) {
+			vec3 position(get_random(-15.0, 15.0), -0.7, get_random(-15.0, 15.0));
+			benchmarkLights.push_back(PointLight(position, vec3(.5, .5, .5) + vec3::random() * .5, 1.0));
+		}
 		//objects.push_back(new Object(meshes[3], vec3(1, -.5, -.5), vec3(.02, .02, .02), 30));
-		
 
+		// the level is built around zero and placed at the world start; without a floating
+		// origin its positions are the world's own, and lose precision as they grow
+		if (useFloatingOrigin) worldOrigin.MoveTo(worldStartX, worldStartZ);
+		shiftWorld(worldOrigin.ToLocal(worldStartX, 0, worldStartZ));
+		for (int i = 0; i < objects.size(); i++) objects[i]->PlaceOnGround();
 	}
 
 	~Scene()
 	{
+		// the loader threads may still be reading levels of the textures below
+		if (textureStreamer) delete textureStreamer;
+		if (terrain) delete terrain;
+
 		for (int i = 0; i < textures.size(); i++) delete textures[i];
 		for (int i = 0; i < materials.size(); i++) delete materials[i];
 		for (int i = 0; i < geometries.size(); i++) delete geometries[i];
 		for (int i = 0; i < meshes.size(); i++) delete meshes[i];
+		for (int i = 0; i < impostors.size(); i++) delete impostors[i];
 		for (int i = 0; i < objects.size(); i++) delete objects[i];
 
-		if (meshShader) delete meshShader;
+		for (int i = 0; i < textureArrays.size(); i++) delete textureArrays[i];
+		if (clusteredLighting) delete clusteredLighting;
+		if (depthPrepass) delete depthPrepass;
+		if (dynamicResolution) delete dynamicResolution;
+		if (softwareRenderer) delete softwareRenderer;
+		if (frameGraph) delete frameGraph;
+		if (frameCapture) delete frameCapture;
+		if (minimap) delete minimap;
+		if (particleSystem) delete particleSystem;
+		if (impostorShader) delete impostorShader;
+		if (impostorShadowShader) delete impostorShadowShader;
+		if (multiViewInfiniteShader) delete multiViewInfiniteShader;
+		if (multiViewShadowShader) delete multiViewShadowShader;
+		if (multiViewDepthShader) delete multiViewDepthShader;
+		if (multiViewAnimatedShadowShader) delete multiViewAnimatedShadowShader;
+		if (multiViewAnimatedDepthShader) delete multiViewAnimatedDepthShader;
+		// the minimap, dynamic resolution and software renderer above drew with the upscale shader
+		if (infiniteShader) delete infiniteShader;
+		if (shadowShader) delete shadowShader;
+		if (depthShader) delete depthShader;
+		if (animatedShadowShader) delete animatedShadowShader;
+		if (animatedDepthShader) delete animatedDepthShader;
+		if (upscaleShader) delete upscaleShader;
+		for (int i = 1; i < playerCameras.size(); i++) delete playerCameras[i];
 	}
 
 	//void Update() {
@@ -1866,82 +9031,170 @@ public:
 	//	}
 	//}
 
-	void Draw()
+	// a warm light above every coin, the car's headlights and tigger's spotlight
+	void GatherLights(FrameSnapshot& frame)
 	{
-		for (int i = 0; i < objects.size(); i++) {
-			//if (i != objects.size()-1)
-				//objects[i]->DrawShadow(shadowShader);
-			if (i != objects.size() - 1 && !objects[i]->destroy) {
-				objects[i]->DrawShadow(shadowShader);
+		// the benchmark lights are kept around the level's own zero, wherever the world put it
+		pointLights = benchmarkLights;
+		vec3 level = frame.origin.ToLocal(worldStartX, 0, worldStartZ);
+		for (int i = 0; i < pointLights.size(); i++) pointLights[i].position = pointLights[i].position + level;
+
+		vec4 spot = frame.spotlight.GetWorldPosition();
+		pointLights.push_back(PointLight(vec3(spot.v[0], spot.v[1], spot.v[2]), vec3(.6, .6, .6), 1.0));
+
+		for (int i = 0; i < frame.objects.size(); i++) {
+			if (frame.objects[i].ID == 2) {
+				pointLights.push_back(PointLight(frame.objects[i].position + vec3(0, 0.2, 0), vec3(1, .8, .2), 0.6));
 			}
-			objects[i]->Draw();
 		}
+
+		vec3 forward = frame.camera.GetLookAt() - frame.camera.GetwEye();
+		forward.y = 0;
+		forward = forward.normalize();
+		vec3 right = cross(forward, vec3(0, 1, 0));
+		vec3 car = frame.carPosition;
+		pointLights.push_back(PointLight(car + forward * 0.5 + right * 0.15 + vec3(0, 0.1, 0), vec3(1, 1, .9), 1.5));
+		pointLights.push_back(PointLight(car + forward * 0.5 - right * 0.15 + vec3(0, 0.1, 0), vec3(1, 1, .9), 1.5));
 	}
 
-};
+	bool HasImpostors() { return !impostors.empty(); }
 
-Scene scene;
+	const std::vector<PointLight>& GetPointLights() { return pointLights; }
 
-void onInitialization()
-{
-	glViewport(0, 0, windowWidth, windowHeight);
+	// each view keeps the pixel aspect of the whole target
+	void PrepareViews(FrameSnapshot& frame)
+	{
+		for (int i = 0; i < frame.views.size(); i++) {
+			FrameView& view = frame.views[i];
+			view.camera.SetAspectRatio(viewAspectRatio * view.rect.v[2] / view.rect.v[3]);
+			if (terrain) view.camera.SetFarPlane(terrainViewDistance);
+			view.VP = view.camera.GetViewMatrix() * view.camera.GetProjectionMatrix();
+		}
+		frame.camera = frame.views[0].camera;
+		frame.VP = frame.views[0].VP;
+		renderStats.views = (int)frame.views.size();
+		if (terrain) terrain->Update(frame);
+	}
 
-	scene.Initialize();
-}
+	// views and point lights for the software renderer, which culls and bins on its own
+	bool PrepareSoftware(FrameSnapshot& frame)
+	{
+		if (frame.objects.empty()) return false;
+		PrepareViews(frame);
+		pointLights.clear();
+		if (clusteredLighting) GatherLights(frame);
+		return true;
+	}
 
-void onExit()
-{
-	printf("exit");
-}
+	// camera, lights and draw packets for the frame, recorded against the current viewport;
+	// returns false when there is nothing to draw
+	bool Prepare(FrameSnapshot& frame)
+	{
+		std::vector<ObjectSnapshot>& drawn = frame.objects;
+		if (drawn.empty()) return false;
 
-void onDisplay()
-{
+		PrepareViews(frame);
+		if (clusteredLighting) {
+			GatherLights(frame);
+			clusteredLighting->Update(frame.views, pointLights);
+		}
 
-	glClearColor(0, 0, 1.0, 0);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		prepass = depthPrepass->Decide();
+		bool multiView = frame.views.size() > 1;
+		PassShaders still = { multiView ? multiViewDepthShader : depthShader, multiView ? multiViewShadowShader : shadowShader };
+		PassShaders animated = { multiView ? multiViewAnimatedDepthShader : animatedDepthShader,
+			multiView ? multiViewAnimatedShadowShader : animatedShadowShader };
+		recorder.Record(frame, prepass, still, animated);
+		if (textureStreamer) textureStreamer->Update();
+		return true;
+	}
 
-	scene.Draw();
+	bool UsesPrepass() { return prepass; }
 
-	glutSwapBuffers();
+	// depth only, front to back, so the color pass shades just the fragments that stay visible
+	void DrawDepthPrepass(FrameSnapshot& frame)
+	{
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		recorder.Replay(DrawDepthList, frame);
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	}
 
-}
+	void DrawColor(FrameSnapshot& frame)
+	{
+		if (prepass) {
+			glDepthFunc(GL_EQUAL);
+			glDepthMask(GL_FALSE);
+		}
+
+		depthPrepass->BeginColorPass(prepass);
+		recorder.Replay(DrawMainList, frame);
+		depthPrepass->EndColorPass(prepass);
+
+		// shadows lie just above the ground, so they go on top of the finished color pass
+		if (prepass) {
+			glDepthFunc(GL_LESS);
+			recorder.Replay(DrawShadowList, frame);
+			glDepthMask(GL_TRUE);
+		}
+
+		// impostors write their own depth, so they are tested normally after everything else
+		if (useImpostors) {
+			recorder.ReplayImpostors(ImpostorShadowList, impostorShadowShader, frame);
+			recorder.ReplayImpostors(ImpostorColorList, impostorShader, frame);
+		}
+
+		if (particleSystem) {
+			particleSystem->Update(frame.origin, frame.carGround);
+			int viewport[4];
+			glGetIntegerv(GL_VIEWPORT, viewport);
+			for (int i = 0; i < frame.views.size(); i++) {
+				if (frame.views.size() > 1) setViewViewport(viewport, frame.views[i].rect);
+				particleSystem->Draw(frame.views[i]);
+			}
+			glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+		}
+	}
+
+};
+
+// declared before the scene, so the count is taken once the scene has released everything
+struct GLLeakReport
+{
+	~GLLeakReport() { reportGLLeaks(); }
+} glLeakReport;
+
+Scene scene;
 
 bool tPressed = false;
 double tHeart = 0;
+// fraction of a trail particle carried over to the next step
+double trailParticles = 0;
 
-void onKeyboard(unsigned char key, int x, int y)
+// key events reach the simulation at the start of its next step
+void simulateKey(unsigned char key, bool down)
 {
-	keyboardState[key] = true;
-	if (key == 't' && !tPressed) {
+	keyboardState[key] = down;
+
+	if (key == 't' && down && !tPressed) {
 		tPressed = true;
 		initialPos = camera->GetwEye();
 		initialHat = objectHA->GetPosition();
 	}
-}
-
-void onKeyboardUp(unsigned char key, int x, int y)
-{
-	keyboardState[key] = false;
-
-	if (key == 't') {
+	if (key == 't' && !down) {
 		tPressed = false;
 		camera->SetwEye(initialPos);
 		tHeart = 0;
 	}
-
+	// 1 to 4 players share the screen
+	if (down && key >= '1' && key <= '0' + maxSplitScreenViews && splitScreenSupported) {
+		splitScreenViews = key - '0';
+		printf("Split screen: %d view%s\n", splitScreenViews, splitScreenViews > 1 ? "s" : "");
+	}
 }
 
-void onReshape(int winWidth, int winHeight)
+void simulate(double t, double dt)
 {
-	camera->SetAspectRatio((float)winWidth / winHeight);
-	glViewport(0, 0, winWidth, winHeight);
-}
-
-void onIdle() {
-	double t = glutGet(GLUT_ELAPSED_TIME) * 0.001;
-	static double lastTime = 0.0;
-	double dt = t - lastTime;
-	lastTime = t;
+	recenterWorld();
 
 	if (keyboardState['t']) {
 		tHeart += dt;
@@ -1957,12 +9210,20 @@ void onIdle() {
 		//4 : car
 		if (objectT->CollisionCoin(objects[i]))
 		{
+			if (particleSystem) {
+				vec3 coin = objects[i]->GetPosition();
+				particleSystem->Emit(ParticleEmitter(coin, vec3(0, 1.2, 0), vec3(1, .8, .2), 0.8, 1.5, 0.04, 500));
+			}
 			objects[i]->setY(-2);
+			delete objects[i];
 			objects.erase(objects.begin()+ i);
 			//objects[i]->Falling(t, dt);
 			
 			PlaySound(TEXT("coin.wav"), NULL, SND_FILENAME | SND_ASYNC);
 			camera->setVelocity(camera->getVelocity()*1.67);
+			// the next object moved into this slot
+			i--;
+			continue;
 		}
 		if (objectT->CollisionTree(objects[i]))
 		{
@@ -1977,6 +9238,11 @@ void onIdle() {
 	//scene.Update();
 	camera->Control();
 	camera->Move(dt);
+	// half a unit above the ground under the car, and never below the ground under the eye
+	vec3 eye = camera->GetwEye(), lookat = camera->GetLookAt();
+	float carGround = groundHeight(lookat.x, lookat.z);
+	float eyeGround = std::max(carGround, groundHeight(eye.x, eye.z));
+	camera->Place(vec3(eye.x, eyeGround + 0.5f, eye.z), vec3(lookat.x, carGround + 0.5f, lookat.z));
 	//vec3 pos = vec3(camera->GetLookAt().x, -0.8, camera->GetLookAt().z);
 	objectT->MovePosition(dt);
 	objectT->Move(dt);
@@ -1989,6 +9255,21 @@ void onIdle() {
 	//vec3 pos2 = vec3(camera->GetLookAt().x, -0.8, camera->GetLookAt().z);
 	objectHA->MovePosition(dt);
 
+	// dust thrown up behind the car while it drives
+	vec3 carVelocity = camera->getVelocity();
+	float carSpeed = carVelocity.length();
+	if (particleSystem && carSpeed > 0.05f) {
+		trailParticles += dt * 300 * std::min(carSpeed, 2.0f);
+		int count = (int)trailParticles;
+		if (count > 0) {
+			trailParticles -= count;
+			vec3 back = carVelocity * (-0.3f / carSpeed);
+			vec3 position = objectHA->GetPosition() + back;
+			position.y = objectHA->GetGround() + 0.05f;
+			particleSystem->Emit(ParticleEmitter(position, back + vec3(0, 0.4, 0), vec3(.55, .55, .5), 0.2, 0.8, 0.03, count));
+		}
+	}
+
 	if (keyboardState['t']) {
 		objectT->MovePosition(dt);
 	}
@@ -1999,7 +9280,7 @@ void onIdle() {
 	//vec3 dif = camera->GetLookAt() - camera->GetwEye();
 
 	// fix the spotlight to tiggers position
-	spotlight->SetPointLightSource(vec3(camera->GetLookAt().x, -1, camera->GetLookAt().z));
+	spotlight->SetPointLightSource(vec3(camera->GetLookAt().x, objectT->GetGround(), camera->GetLookAt().z));
 	//vec3 pos2 = vec3((dif.x*cos(-0.07) - dif.z*sin(-0.07))*0.9, -0.3, (dif.x*sin(-0.07) + dif.z*cos(-0.07)) * 0.9) + camera->GetwEye();
 	//spotlight->SetPointLightSource(pos2);
 
@@ -2012,10 +9293,13 @@ void onIdle() {
 	objectHA->frenet(dt);
 	objectHA->Rotate(0);
 
-	for (int i = 1; i < objects.size(); i++) {
-		if (objects[i]->getID() == 2) {
-			objects[i]->Rotate(dt);
-		}
+	// the other players have no car of their own yet, so their cameras circle the first one
+	vec3 car = objectHA->GetPosition();
+	for (int i = 1; i < playerCameras.size(); i++) {
+		float angle = (float)(i * M_PI / 2 + t * 0.2);
+		vec3 orbit = car + vec3(2.5f * sinf(angle), 0.5f, 2.5f * cosf(angle));
+		float orbitGround = groundHeight(orbit.x, orbit.z);
+		playerCameras[i]->Place(vec3(orbit.x, std::max(orbit.y, orbitGround + 0.5f), orbit.z), car);
 	}
 
 //	for (int i = 0; i < objects.size(); i++) {
@@ -2041,6 +9325,351 @@ void onIdle() {
 //	}
 
 
+}
+
+void captureFrame(FrameSnapshot& frame, double t)
+{
+	frame.time = t;
+	frame.camera = *camera;
+	frame.views.resize(splitScreenViews);
+	for (int i = 0; i < splitScreenViews; i++)
+	{
+		frame.views[i].camera = *playerCameras[i];
+		frame.views[i].rect = splitScreenRect(i, splitScreenViews);
+	}
+	frame.light = *light;
+	frame.spotlight = *spotlight;
+	frame.carPosition = objectHA->GetPosition();
+	frame.carGround = objectHA->GetGround();
+	frame.origin = worldOrigin;
+	vec4 sun = light->GetWorldPosition();
+	vec3 level = worldOrigin.ToLocal(worldStartX, 0, worldStartZ);
+	frame.shadowLightPosition = vec4(sun.v[0] + level.x, sun.v[1], sun.v[2] + level.z, 1);
+	frame.objects.clear();
+	for (int i = 0; i < objects.size(); i++) frame.objects.push_back(objects[i]->Snapshot());
+}
+
+// triple buffer: the simulation fills one snapshot while the renderer draws another, and the
+// third holds the newest finished step, so a hand-over is only an index swap
+class SnapshotBuffer
+{
+	FrameSnapshot snapshots[3];
+	int writeIndex, readyIndex, readIndex;
+	bool fresh;
+	std::mutex mutex;
+	std::condition_variable consumed;
+
+public:
+	SnapshotBuffer() : writeIndex(0), readyIndex(1), readIndex(2), fresh(false) { }
+
+	FrameSnapshot& Back() { return snapshots[writeIndex]; }
+
+	void Publish()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		std::swap(writeIndex, readyIndex);
+		fresh = true;
+	}
+
+	// the newest published step, or the one drawn last time if nothing new is ready
+	FrameSnapshot& Acquire()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (fresh) {
+				std::swap(readIndex, readyIndex);
+				fresh = false;
+			}
+		}
+		consumed.notify_one();
+		return snapshots[readIndex];
+	}
+
+	// keeps the simulation one step ahead of the frame being drawn rather than spinning
+	void WaitUntilConsumed(const std::atomic<bool>& running)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		consumed.wait(lock, [&] { return !fresh || !running; });
+	}
+
+	void Wake()
+	{
+		{ std::lock_guard<std::mutex> lock(mutex); }
+		consumed.notify_all();
+	}
+};
+
+bool useSimulationThread = true;
+
+// steps the game on its own thread while the GLUT thread, which owns the GL context, draws the
+// previous step's snapshot; without the thread onIdle steps it in place
+class Simulation
+{
+	SnapshotBuffer snapshots;
+	std::thread thread;
+	std::atomic<bool> running;
+
+	std::mutex inputMutex;
+	std::vector<std::pair<unsigned char, bool> > keyEvents, pendingKeys;
+
+	std::chrono::steady_clock::time_point startTime;
+	double lastTime;
+
+	void Run()
+	{
+		while (running) {
+			Step();
+			snapshots.WaitUntilConsumed(running);
+		}
+	}
+
+public:
+	Simulation() : running(false), lastTime(0) { }
+
+	~Simulation() { Stop(); }
+
+	void Start(bool threaded)
+	{
+		startTime = std::chrono::steady_clock::now();
+		captureFrame(snapshots.Back(), 0);
+		snapshots.Publish();
+
+		if (!threaded) return;
+		running = true;
+		thread = std::thread(&Simulation::Run, this);
+	}
+
+	void Stop()
+	{
+		if (!thread.joinable()) return;
+		running = false;
+		snapshots.Wake();
+		thread.join();
+	}
+
+	bool IsThreaded() { return thread.joinable(); }
+
+	void QueueKey(unsigned char key, bool down)
+	{
+		std::lock_guard<std::mutex> lock(inputMutex);
+		keyEvents.push_back(std::make_pair(key, down));
+	}
+
+	void Step()
+	{
+		double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		double dt = t - lastTime;
+		lastTime = t;
+
+		{
+			std::lock_guard<std::mutex> lock(inputMutex);
+			pendingKeys.swap(keyEvents);
+		}
+		for (int i = 0; i < pendingKeys.size(); i++) simulateKey(pendingKeys[i].first, pendingKeys[i].second);
+		pendingKeys.clear();
+
+		simulate(t, dt);
+
+		captureFrame(snapshots.Back(), t);
+		snapshots.Publish();
+	}
+
+	FrameSnapshot& Acquire() { return snapshots.Acquire(); }
+};
+
+// declared after the scene so it is stopped before the scene is torn down
+Simulation simulation;
+
+// size of the framebuffer the frame graph draws into
+int outputWidth = windowWidth, outputHeight = windowHeight;
+
+void onInitialization()
+{
+	glViewport(0, 0, windowWidth, windowHeight);
+
+	threadPool = new ThreadPool(renderThreads > 0 ? renderThreads - 1 : -1);
+	// llvmpipe filters anisotropically by walking the texels of the whole footprint, which on ground
+	// seen at a grazing angle costs milliseconds a fragment
+	if (strstr((const char*)glGetString(GL_RENDERER), "llvmpipe")) textureAnisotropy = 1;
+	scene.Initialize();
+	if (clusteredLighting) clusteredLighting->SetViewport(windowWidth, windowHeight);
+	if (dynamicResolution) dynamicResolution->SetWindowSize(windowWidth, windowHeight);
+	simulation.Start(useSimulationThread);
+}
+
+void onExit()
+{
+	printf("exit");
+}
+
+void clearTarget()
+{
+	glClearColor(0, 0, 1.0, 0);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+}
+
+void onDisplay()
+{
+	FrameSnapshot& frame = simulation.Acquire();
+
+	// packets are recorded against the render viewport, so it is set before the passes run
+	int renderWidth = dynamicResolution ? dynamicResolution->GetRenderWidth() : outputWidth;
+	int renderHeight = dynamicResolution ? dynamicResolution->GetRenderHeight() : outputHeight;
+	glViewport(0, 0, renderWidth, renderHeight);
+	if (clusteredLighting) clusteredLighting->SetViewport(renderWidth, renderHeight);
+	bool software = useSoftwareRenderer && softwareRenderer;
+	bool prepared = software ? scene.PrepareSoftware(frame) : scene.Prepare(frame);
+	bool upscale = !software && dynamicResolution && dynamicResolution->IsActive();
+	bool showMinimap = minimap && useMinimap;
+	bool refreshMinimap = showMinimap && prepared && minimap->Update(frame);
+
+	int framebuffer;
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+	frameGraph->Reset();
+	int output = frameGraph->Import("backbuffer", framebuffer, FrameResourceDesc(outputWidth, outputHeight));
+	int target = output;
+
+	// the software image is drawn at the render size and stretched over the output as it is shown
+	if (software) {
+		int pass = frameGraph->AddPass("software scene", [&frame, renderWidth, renderHeight, prepared]() {
+			glViewport(0, 0, outputWidth, outputHeight);
+			if (!prepared) {
+				clearTarget();
+				return;
+			}
+			softwareRenderer->Draw(frame, renderWidth, renderHeight, scene.GetPointLights());
+			softwareRenderer->Blit();
+		});
+		target = frameGraph->Write(pass, output);
+	}
+	else {
+		int color = output, depth = output;
+		if (upscale) {
+			color = frameGraph->Create("scene color", FrameResourceDesc(outputWidth, outputHeight, GL_RGBA8));
+			depth = frameGraph->Create("scene depth", FrameResourceDesc(outputWidth, outputHeight, GL_DEPTH_COMPONENT24));
+		}
+
+		if (prepared && scene.UsesPrepass()) {
+			int pass = frameGraph->AddPass("depth pre-pass", [&frame, renderWidth, renderHeight]() {
+				glViewport(0, 0, renderWidth, renderHeight);
+				clearTarget();
+				scene.DrawDepthPrepass(frame);
+			});
+			color = frameGraph->Write(pass, color);
+			if (depth != output) depth = frameGraph->Write(pass, depth);
+		}
+
+		bool cleared = prepared && scene.UsesPrepass();
+		int scenePass = frameGraph->AddPass("scene", [&frame, renderWidth, renderHeight, prepared, cleared]() {
+			glViewport(0, 0, renderWidth, renderHeight);
+			if (!cleared) clearTarget();
+			if (prepared) scene.DrawColor(frame);
+		});
+		color = frameGraph->Write(scenePass, color);
+		if (depth != output) depth = frameGraph->Write(scenePass, depth);
+
+		target = color;
+		if (upscale) {
+			int pass = frameGraph->AddPass("upscale", [color]() { dynamicResolution->Upscale(frameGraph->GetTexture(color)); });
+			frameGraph->Read(pass, color);
+			target = frameGraph->Write(pass, output);
+		}
+	}
+
+	// the map is redrawn a few times a second and its terrain only when that changed; the
+	// finished map goes on top of the output every frame
+	if (showMinimap) {
+		int map = frameGraph->Import("minimap", minimap->GetMapFramebuffer(), FrameResourceDesc(minimapSize, minimapSize));
+		if (refreshMinimap) {
+			int terrain = frameGraph->Import("minimap terrain", minimap->GetTerrainFramebuffer(), FrameResourceDesc(minimapSize, minimapSize));
+			if (minimap->IsTerrainDirty()) {
+				int pass = frameGraph->AddPass("minimap terrain", []() { minimap->DrawTerrain(); });
+				terrain = frameGraph->Write(pass, terrain);
+			}
+			int pass = frameGraph->AddPass("minimap markers", []() { minimap->DrawMarkers(); });
+			frameGraph->Read(pass, terrain);
+			map = frameGraph->Write(pass, map);
+		}
+		int pass = frameGraph->AddPass("minimap overlay", []() { minimap->DrawOverlay(outputWidth, outputHeight); });
+		frameGraph->Read(pass, map);
+		frameGraph->Write(pass, target);
+	}
+
+	frameGraph->Compile();
+	frameGraph->Execute();
+
+	if (frameCapture) frameCapture->Capture(outputWidth, outputHeight);
+
+	glutSwapBuffers();
+
+	static std::chrono::high_resolution_clock::time_point lastFrame = std::chrono::high_resolution_clock::now();
+	std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
+	static std::chrono::high_resolution_clock::time_point firstFrame = now;
+	double frameMs = std::chrono::duration<double, std::milli>(now - lastFrame).count();
+	if (dynamicResolution) dynamicResolution->FrameTime(frameMs);
+	renderStats.resolutionScale += dynamicResolution ? dynamicResolution->GetScale() : 1.0f;
+	renderStats.EndFrame(std::chrono::duration<double>(now - firstFrame).count(), frameMs);
+	lastFrame = now;
+
+}
+
+void onKeyboard(unsigned char key, int x, int y)
+{
+	simulation.QueueKey(key, true);
+	if (key == 'f') renderStats.enabled = !renderStats.enabled;
+	if (key == 'r' && dynamicResolution) dynamicResolution->enabled = !dynamicResolution->enabled;
+	if (key == 'z') depthPrepassMode = (DepthPrepassMode)((depthPrepassMode + 1) % 3);
+	if (key == 'i' && scene.HasImpostors()) useImpostors = !useImpostors;
+	if (key == 'm') useMinimap = !useMinimap;
+	if ((key == '[' || key == ']') && useTerrain) {
+		terrainViewDistance = key == ']' ? std::min(terrainViewDistance * 2, 4096.0f) : std::max(terrainViewDistance / 2, 32.0f);
+		printf("Terrain view distance %.0f\n", terrainViewDistance);
+	}
+	if (key == 'v' && frameCapture) {
+		if (frameCapture->IsRecording()) frameCapture->Stop();
+		else frameCapture->Start(CaptureY4m);
+	}
+	if (key == 'x') {
+		useSoftwareRenderer = !useSoftwareRenderer;
+		printf("Software renderer %s\n", useSoftwareRenderer ? "on" : "off");
+	}
+	// the software image is written from memory, at the size it was drawn
+	if (key == 'p' && useSoftwareRenderer && softwareRenderer) {
+		static int shots = 0;
+		char fileName[64];
+		sprintf(fileName, "software_%d.png", shots++);
+		if (softwareRenderer->WritePng(fileName)) printf("Software image written to %s\n", fileName);
+	}
+	else if (key == 'p' && frameCapture && !frameCapture->IsRecording()) frameCapture->Start(CapturePng, 1);
+	if (key == 'g' && frameGraph) {
+		FILE* file = fopen("framegraph.dot", "w");
+		if (file) {
+			frameGraph->WriteDot(file);
+			fclose(file);
+		}
+		printf("Frame graph written to framegraph.dot, peak transient memory %.2f MB (%.2f MB without aliasing)\n",
+			frameGraph->GetPeakTransientBytes() / 1048576.0, frameGraph->GetVirtualTransientBytes() / 1048576.0);
+	}
+}
+
+void onKeyboardUp(unsigned char key, int x, int y)
+{
+	simulation.QueueKey(key, false);
+}
+
+void onReshape(int winWidth, int winHeight)
+{
+	outputWidth = winWidth;
+	outputHeight = winHeight;
+	viewAspectRatio = (float)winWidth / winHeight;
+	glViewport(0, 0, winWidth, winHeight);
+	if (clusteredLighting) clusteredLighting->SetViewport(winWidth, winHeight);
+	if (dynamicResolution) dynamicResolution->SetWindowSize(winWidth, winHeight);
+}
+
+void onIdle() {
+	if (!simulation.IsThreaded()) simulation.Step();
+
 	glutPostRedisplay();
 }
 